@@ -29,22 +29,92 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include "flint/flint.h"
 #include "flint/ulong_extras.h"
 #include "flint/double_extras.h"
+#include "flint/profiler.h"
 #include "test_helpers.c"
+#include "thread_pool.c"
 
+/*
+    SIMD kernels are compiled with per-function target attributes and
+    selected at runtime, so no -m flags are needed to build this file.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define D_HAVE_X86 1
+#endif
+
+#define D_CPU_GENERIC 0
+#define D_CPU_AVX2 1
+#define D_CPU_AVX512 2
+
+/*
+    The level is first asked for from pool workers as often as from the
+    main thread; every caller computes the same value, so relaxed atomic
+    accesses suffice.
+*/
+static int
+_d_cpu_level(void)
+{
+    static int level = -1;
+    int cached = __atomic_load_n(&level, __ATOMIC_RELAXED);
+
+    if (cached < 0)
+    {
+        int l = D_CPU_GENERIC;
+#ifdef D_HAVE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            l = D_CPU_AVX512;
+        else if (__builtin_cpu_supports("avx2")
+                 && __builtin_cpu_supports("fma"))
+            l = D_CPU_AVX2;
+#endif
+        __atomic_store_n(&level, l, __ATOMIC_RELAXED);
+        cached = l;
+    }
+
+    return cached;
+}
+
+#define D_MAT_ROW_MAJOR 0
+#define D_MAT_COL_MAJOR 1
+
+/*
+    A row-major matrix keeps the usual array of row pointers, so that rows
+    can be swapped in O(1). A column-major matrix has no row pointers;
+    column j starts at entries + j * ld. In both cases ld is the distance
+    between consecutive rows (resp. columns) in memory.
+*/
 typedef struct
 {
     double *entries;
     slong r;
     slong c;
     double **rows;
+    slong ld;
+    int layout;
 } d_mat_struct;
 
 typedef d_mat_struct d_mat_t[1];
 
-#define d_mat_entry(mat,i,j) (*((mat)->rows[i] + (j)))
+#define d_mat_entry(mat,i,j)                                        \
+    (*((mat)->layout == D_MAT_ROW_MAJOR ? (mat)->rows[i] + (j)      \
+                        : (mat)->entries + (i) + (j) * (mat)->ld))
+
+/* Pointer to column j of a column-major matrix. */
+#define d_mat_col(mat,j) ((mat)->entries + (j) * (mat)->ld)
+
+/*
+    Pointer to the first entry of row i and distance between consecutive
+    entries of that row, valid for either layout.
+*/
+#define _d_mat_row_ptr(mat,i)                                       \
+    ((mat)->layout == D_MAT_ROW_MAJOR ? (mat)->rows[i] : (mat)->entries + (i))
+#define _d_mat_row_stride(mat)                                      \
+    ((mat)->layout == D_MAT_ROW_MAJOR ? WORD(1) : (mat)->ld)
 
 void
 _d_vec_add(double *r1, double *r2, double *r3, ulong n)
@@ -64,31 +134,425 @@ _d_vec_sub(double *r1, double *r2, double *r3, ulong n)
 }
 
 
+/*
+    The reductions below keep four independent accumulators (four vectors
+    of them in the SIMD versions) so that consecutive multiply-adds do not
+    wait on each other. For a given CPU every entry point sums in the same
+    order, so _d_vec_scalar_product_multi returns exactly the values of
+    the corresponding calls to _d_vec_scalar_product.
+*/
+
+static double
+_d_vec_scalar_product_generic(const double *vec1, const double *vec2,
+                              slong len)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0, s;
+    slong i;
+
+    for (i = 0; i + 4 <= len; i += 4)
+    {
+        s0 += vec1[i] * vec2[i];
+        s1 += vec1[i + 1] * vec2[i + 1];
+        s2 += vec1[i + 2] * vec2[i + 2];
+        s3 += vec1[i + 3] * vec2[i + 3];
+    }
+
+    s = (s0 + s1) + (s2 + s3);
+    for ( ; i < len; i++)
+        s += vec1[i] * vec2[i];
+
+    return s;
+}
+
+static double
+_d_vec_scalar_submul_dot_generic(double *vec1, const double *vec2, double c,
+                                 const double *vec3, slong len)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0, s;
+    slong i;
+
+    for (i = 0; i + 4 <= len; i += 4)
+    {
+        vec1[i] -= c * vec2[i];
+        vec1[i + 1] -= c * vec2[i + 1];
+        vec1[i + 2] -= c * vec2[i + 2];
+        vec1[i + 3] -= c * vec2[i + 3];
+        s0 += vec1[i] * vec3[i];
+        s1 += vec1[i + 1] * vec3[i + 1];
+        s2 += vec1[i + 2] * vec3[i + 2];
+        s3 += vec1[i + 3] * vec3[i + 3];
+    }
+
+    s = (s0 + s1) + (s2 + s3);
+    for ( ; i < len; i++)
+    {
+        vec1[i] -= c * vec2[i];
+        s += vec1[i] * vec3[i];
+    }
+
+    return s;
+}
+
+#ifdef D_HAVE_X86
+
+/*
+    The scalar tails use fma explicitly so that they round the same way as
+    the vector bodies whatever the compiler decides about contraction.
+*/
+
+__attribute__((target("avx2,fma")))
+static double
+_d_avx2_hsum(__m256d a)
+{
+    __m128d lo = _mm256_castpd256_pd128(a), hi = _mm256_extractf128_pd(a, 1);
+
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+static double
+_d_vec_scalar_product_avx2(const double *vec1, const double *vec2, slong len)
+{
+    __m256d a0, a1, a2, a3;
+    double s;
+    slong i;
+
+    a0 = a1 = a2 = a3 = _mm256_setzero_pd();
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        a0 = _mm256_fmadd_pd(_mm256_loadu_pd(vec1 + i),
+                             _mm256_loadu_pd(vec2 + i), a0);
+        a1 = _mm256_fmadd_pd(_mm256_loadu_pd(vec1 + i + 4),
+                             _mm256_loadu_pd(vec2 + i + 4), a1);
+        a2 = _mm256_fmadd_pd(_mm256_loadu_pd(vec1 + i + 8),
+                             _mm256_loadu_pd(vec2 + i + 8), a2);
+        a3 = _mm256_fmadd_pd(_mm256_loadu_pd(vec1 + i + 12),
+                             _mm256_loadu_pd(vec2 + i + 12), a3);
+    }
+
+    s = _d_avx2_hsum(_mm256_add_pd(_mm256_add_pd(a0, a1),
+                                   _mm256_add_pd(a2, a3)));
+    for ( ; i < len; i++)
+        s = fma(vec1[i], vec2[i], s);
+
+    return s;
+}
+
+/* Two dot products against the same vec, with the order of the above. */
+__attribute__((target("avx2,fma")))
+static void
+_d_vec_scalar_product2_avx2(double *res, const double *vec,
+                            const double *v0, const double *v1, slong len)
+{
+    __m256d a0, a1, a2, a3, b0, b1, b2, b3, x;
+    double s, t;
+    slong i;
+
+    a0 = a1 = a2 = a3 = b0 = b1 = b2 = b3 = _mm256_setzero_pd();
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        x = _mm256_loadu_pd(vec + i);
+        a0 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v0 + i), a0);
+        b0 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v1 + i), b0);
+        x = _mm256_loadu_pd(vec + i + 4);
+        a1 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v0 + i + 4), a1);
+        b1 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v1 + i + 4), b1);
+        x = _mm256_loadu_pd(vec + i + 8);
+        a2 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v0 + i + 8), a2);
+        b2 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v1 + i + 8), b2);
+        x = _mm256_loadu_pd(vec + i + 12);
+        a3 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v0 + i + 12), a3);
+        b3 = _mm256_fmadd_pd(x, _mm256_loadu_pd(v1 + i + 12), b3);
+    }
+
+    s = _d_avx2_hsum(_mm256_add_pd(_mm256_add_pd(a0, a1),
+                                   _mm256_add_pd(a2, a3)));
+    t = _d_avx2_hsum(_mm256_add_pd(_mm256_add_pd(b0, b1),
+                                   _mm256_add_pd(b2, b3)));
+    for ( ; i < len; i++)
+    {
+        s = fma(vec[i], v0[i], s);
+        t = fma(vec[i], v1[i], t);
+    }
+
+    res[0] = s;
+    res[1] = t;
+}
+
+__attribute__((target("avx2,fma")))
+static void
+_d_vec_scalar_submul_avx2(double *vec1, const double *vec2, slong len,
+                          double c)
+{
+    __m256d cc = _mm256_set1_pd(c);
+    slong i;
+
+    for (i = 0; i + 4 <= len; i += 4)
+        _mm256_storeu_pd(vec1 + i, _mm256_fnmadd_pd(cc,
+                  _mm256_loadu_pd(vec2 + i), _mm256_loadu_pd(vec1 + i)));
+
+    for ( ; i < len; i++)
+        vec1[i] = fma(-c, vec2[i], vec1[i]);
+}
+
+__attribute__((target("avx2,fma")))
+static double
+_d_vec_scalar_submul_dot_avx2(double *vec1, const double *vec2, double c,
+                              const double *vec3, slong len)
+{
+    __m256d cc = _mm256_set1_pd(c), a0, a1, x0, x1;
+    double s;
+    slong i;
+
+    a0 = a1 = _mm256_setzero_pd();
+
+    /* vec3 may be vec1, so it is loaded after the store */
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        x0 = _mm256_fnmadd_pd(cc, _mm256_loadu_pd(vec2 + i),
+                              _mm256_loadu_pd(vec1 + i));
+        x1 = _mm256_fnmadd_pd(cc, _mm256_loadu_pd(vec2 + i + 4),
+                              _mm256_loadu_pd(vec1 + i + 4));
+        _mm256_storeu_pd(vec1 + i, x0);
+        _mm256_storeu_pd(vec1 + i + 4, x1);
+        a0 = _mm256_fmadd_pd(x0, _mm256_loadu_pd(vec3 + i), a0);
+        a1 = _mm256_fmadd_pd(x1, _mm256_loadu_pd(vec3 + i + 4), a1);
+    }
+
+    s = _d_avx2_hsum(_mm256_add_pd(a0, a1));
+    for ( ; i < len; i++)
+    {
+        vec1[i] = fma(-c, vec2[i], vec1[i]);
+        s = fma(vec1[i], vec3[i], s);
+    }
+
+    return s;
+}
+
+__attribute__((target("avx512f")))
+static double
+_d_vec_scalar_product_avx512(const double *vec1, const double *vec2,
+                             slong len)
+{
+    __m512d a0, a1, a2, a3;
+    double s;
+    slong i;
+
+    a0 = a1 = a2 = a3 = _mm512_setzero_pd();
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        a0 = _mm512_fmadd_pd(_mm512_loadu_pd(vec1 + i),
+                             _mm512_loadu_pd(vec2 + i), a0);
+        a1 = _mm512_fmadd_pd(_mm512_loadu_pd(vec1 + i + 8),
+                             _mm512_loadu_pd(vec2 + i + 8), a1);
+        a2 = _mm512_fmadd_pd(_mm512_loadu_pd(vec1 + i + 16),
+                             _mm512_loadu_pd(vec2 + i + 16), a2);
+        a3 = _mm512_fmadd_pd(_mm512_loadu_pd(vec1 + i + 24),
+                             _mm512_loadu_pd(vec2 + i + 24), a3);
+    }
+
+    s = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(a0, a1),
+                                           _mm512_add_pd(a2, a3)));
+    for ( ; i < len; i++)
+        s = fma(vec1[i], vec2[i], s);
+
+    return s;
+}
+
+__attribute__((target("avx512f")))
+static void
+_d_vec_scalar_product2_avx512(double *res, const double *vec,
+                              const double *v0, const double *v1, slong len)
+{
+    __m512d a0, a1, a2, a3, b0, b1, b2, b3, x;
+    double s, t;
+    slong i;
+
+    a0 = a1 = a2 = a3 = b0 = b1 = b2 = b3 = _mm512_setzero_pd();
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        x = _mm512_loadu_pd(vec + i);
+        a0 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v0 + i), a0);
+        b0 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v1 + i), b0);
+        x = _mm512_loadu_pd(vec + i + 8);
+        a1 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v0 + i + 8), a1);
+        b1 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v1 + i + 8), b1);
+        x = _mm512_loadu_pd(vec + i + 16);
+        a2 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v0 + i + 16), a2);
+        b2 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v1 + i + 16), b2);
+        x = _mm512_loadu_pd(vec + i + 24);
+        a3 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v0 + i + 24), a3);
+        b3 = _mm512_fmadd_pd(x, _mm512_loadu_pd(v1 + i + 24), b3);
+    }
+
+    s = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(a0, a1),
+                                           _mm512_add_pd(a2, a3)));
+    t = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(b0, b1),
+                                           _mm512_add_pd(b2, b3)));
+    for ( ; i < len; i++)
+    {
+        s = fma(vec[i], v0[i], s);
+        t = fma(vec[i], v1[i], t);
+    }
+
+    res[0] = s;
+    res[1] = t;
+}
+
+__attribute__((target("avx512f")))
+static void
+_d_vec_scalar_submul_avx512(double *vec1, const double *vec2, slong len,
+                            double c)
+{
+    __m512d cc = _mm512_set1_pd(c);
+    slong i;
+
+    for (i = 0; i + 8 <= len; i += 8)
+        _mm512_storeu_pd(vec1 + i, _mm512_fnmadd_pd(cc,
+                  _mm512_loadu_pd(vec2 + i), _mm512_loadu_pd(vec1 + i)));
+
+    for ( ; i < len; i++)
+        vec1[i] = fma(-c, vec2[i], vec1[i]);
+}
+
+__attribute__((target("avx512f")))
+static double
+_d_vec_scalar_submul_dot_avx512(double *vec1, const double *vec2, double c,
+                                const double *vec3, slong len)
+{
+    __m512d cc = _mm512_set1_pd(c), a0, a1, x0, x1;
+    double s;
+    slong i;
+
+    a0 = a1 = _mm512_setzero_pd();
+
+    /* vec3 may be vec1, so it is loaded after the store */
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        x0 = _mm512_fnmadd_pd(cc, _mm512_loadu_pd(vec2 + i),
+                              _mm512_loadu_pd(vec1 + i));
+        x1 = _mm512_fnmadd_pd(cc, _mm512_loadu_pd(vec2 + i + 8),
+                              _mm512_loadu_pd(vec1 + i + 8));
+        _mm512_storeu_pd(vec1 + i, x0);
+        _mm512_storeu_pd(vec1 + i + 8, x1);
+        a0 = _mm512_fmadd_pd(x0, _mm512_loadu_pd(vec3 + i), a0);
+        a1 = _mm512_fmadd_pd(x1, _mm512_loadu_pd(vec3 + i + 8), a1);
+    }
+
+    s = _mm512_reduce_add_pd(_mm512_add_pd(a0, a1));
+    for ( ; i < len; i++)
+    {
+        vec1[i] = fma(-c, vec2[i], vec1[i]);
+        s = fma(vec1[i], vec3[i], s);
+    }
+
+    return s;
+}
+
+#endif
+
+
+double
+_d_vec_scalar_product(const double *vec1, const double *vec2, slong len)
+{
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+        return _d_vec_scalar_product_avx512(vec1, vec2, len);
+    if (_d_cpu_level() == D_CPU_AVX2)
+        return _d_vec_scalar_product_avx2(vec1, vec2, len);
+#endif
+    return _d_vec_scalar_product_generic(vec1, vec2, len);
+}
+
+
+/* Returns the square of the Euclidean norm of vec. */
 double
-_d_vec_scalar_product(double *vec1, double *vec2, ulong n)
+_d_vec_norm(const double *vec, slong len)
+{
+    return _d_vec_scalar_product(vec, vec, len);
+}
+
+
+/*
+    Sets res[i] to the scalar product of vec with vecs + i * stride for
+    0 <= i < count, reading vec once for every two of them.
+*/
+void
+_d_vec_scalar_product_multi(double *res, const double *vec,
+                            const double *vecs, slong stride, slong count,
+                            slong len)
+{
+    slong i = 0;
+
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+        for ( ; i + 2 <= count; i += 2)
+            _d_vec_scalar_product2_avx512(res + i, vec, vecs + i * stride,
+                                          vecs + (i + 1) * stride, len);
+    else if (_d_cpu_level() == D_CPU_AVX2)
+        for ( ; i + 2 <= count; i += 2)
+            _d_vec_scalar_product2_avx2(res + i, vec, vecs + i * stride,
+                                        vecs + (i + 1) * stride, len);
+#endif
+
+    for ( ; i < count; i++)
+        res[i] = _d_vec_scalar_product(vec, vecs + i * stride, len);
+}
+
+
+/* Sets vec1 to vec1 - c * vec2. */
+void
+_d_vec_scalar_submul(double *vec1, const double *vec2, slong len, double c)
 {
-    double sum;
+    slong i;
 
-    sum = vec1[0] * vec2[0];
-    long i;
-    for (i = 1; i < n; i++)
-        sum += vec1[i] * vec2[i];
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+    {
+        _d_vec_scalar_submul_avx512(vec1, vec2, len, c);
+        return;
+    }
+    if (_d_cpu_level() == D_CPU_AVX2)
+    {
+        _d_vec_scalar_submul_avx2(vec1, vec2, len, c);
+        return;
+    }
+#endif
 
-    return sum;
+    for (i = 0; i < len; i++)
+        vec1[i] -= c * vec2[i];
 }
 
 
+/*
+    Sets vec1 to vec1 - c * vec2 and returns the scalar product of the new
+    vec1 with vec3 (which may be vec1), in a single pass over the data.
+*/
 double
-_d_vec_norm(double *vec, ulong n)
+_d_vec_scalar_submul_dot(double *vec1, const double *vec2, double c,
+                         const double *vec3, slong len)
 {
-    double sum;
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+        return _d_vec_scalar_submul_dot_avx512(vec1, vec2, c, vec3, len);
+    if (_d_cpu_level() == D_CPU_AVX2)
+        return _d_vec_scalar_submul_dot_avx2(vec1, vec2, c, vec3, len);
+#endif
+    return _d_vec_scalar_submul_dot_generic(vec1, vec2, c, vec3, len);
+}
 
-    sum = vec[0] * vec[0];
-    long i;
-    for (i = 1; i < n; i++)
-        sum += vec[i] * vec[i];
 
-    return sum;
+void
+_d_vec_scalar_mul(double *vec1, const double *vec2, slong len, double c)
+{
+    slong i;
+    for (i = 0; i < len; i++)
+        vec1[i] = c * vec2[i];
 }
 
 
@@ -143,23 +607,78 @@ d_mat_randtest(d_mat_t mat, flint_rand_t state)
 }
 
 
+/*
+    Entries are allocated on D_MAT_ALIGN byte boundaries, and leading
+    dimensions of at least D_MAT_PAD doubles are rounded up to a multiple
+    of D_MAT_PAD, so that every row (resp. column) starts on such a
+    boundary.
+*/
+#define D_MAT_ALIGN 64
+#define D_MAT_PAD 8
+
+/*
+    Returns n bytes aligned on D_MAT_ALIGN bytes. The offset to the block
+    obtained from flint_malloc is kept in the byte before the result.
+*/
+static void *
+_d_mat_aligned_alloc(size_t n)
+{
+    unsigned char *p, *q;
+
+    p = flint_malloc(n + D_MAT_ALIGN);
+    q = p + D_MAT_ALIGN - ((ulong) p % D_MAT_ALIGN);
+    q[-1] = (unsigned char) (q - p);
+
+    return q;
+}
+
+static void
+_d_mat_aligned_free(void *q)
+{
+    unsigned char *p = q;
+
+    flint_free(p - p[-1]);
+}
+
 void
-d_mat_init(d_mat_t mat, slong rows, slong cols)
+d_mat_init_layout(d_mat_t mat, slong rows, slong cols, int layout)
 {
+    slong ld = (layout == D_MAT_ROW_MAJOR) ? cols : rows;
+
+    if (ld >= D_MAT_PAD)
+        ld = ((ld + D_MAT_PAD - 1) / D_MAT_PAD) * D_MAT_PAD;
+
+    mat->rows = NULL;
+
     if ((rows) && (cols))
     {
         slong i;
-        mat->entries = flint_malloc(rows * cols * sizeof(double));
-        mat->rows = flint_malloc(rows * sizeof(double *));
 
-        for (i = 0; i < rows; i++)
-            mat->rows[i] = mat->entries + i * cols;
+        if (layout == D_MAT_ROW_MAJOR)
+        {
+            mat->entries = _d_mat_aligned_alloc(rows * ld * sizeof(double));
+            mat->rows = flint_malloc(rows * sizeof(double *));
+
+            for (i = 0; i < rows; i++)
+                mat->rows[i] = mat->entries + i * ld;
+        }
+        else
+            mat->entries = _d_mat_aligned_alloc(cols * ld * sizeof(double));
     }
     else
         mat->entries = NULL;
 
     mat->r = rows;
     mat->c = cols;
+    mat->ld = ld;
+    mat->layout = layout;
+}
+
+
+void
+d_mat_init(d_mat_t mat, slong rows, slong cols)
+{
+    d_mat_init_layout(mat, rows, cols, D_MAT_ROW_MAJOR);
 }
 
 
@@ -168,9 +687,56 @@ d_mat_clear(d_mat_t mat)
 {
     if (mat->entries)
     {
-        flint_free(mat->entries);
-        flint_free(mat->rows);
+        _d_mat_aligned_free(mat->entries);
+        if (mat->rows)
+            flint_free(mat->rows);
+    }
+}
+
+
+/*
+    Sets window to a view of the rows [r1, r2) and columns [c1, c2) of mat,
+    sharing its entries. A column-major window needs no memory at all; a
+    row-major window allocates only its array of row pointers, as
+    fmpz_mat_window_init does. The window must be released with
+    d_mat_window_clear before mat is cleared.
+*/
+void
+d_mat_window_init(d_mat_t window, const d_mat_t mat, slong r1, slong c1,
+                  slong r2, slong c2)
+{
+    slong i;
+
+    window->r = r2 - r1;
+    window->c = c2 - c1;
+    window->ld = mat->ld;
+    window->layout = mat->layout;
+    window->rows = NULL;
+
+    if (window->r == 0 || window->c == 0)
+    {
+        window->entries = NULL;
+        return;
+    }
+
+    if (mat->layout == D_MAT_ROW_MAJOR)
+    {
+        window->entries = mat->rows[r1] + c1;
+        window->rows = flint_malloc(window->r * sizeof(double *));
+
+        for (i = 0; i < window->r; i++)
+            window->rows[i] = mat->rows[r1 + i] + c1;
     }
+    else
+        window->entries = d_mat_col(mat, c1) + r1;
+}
+
+
+void
+d_mat_window_clear(d_mat_t window)
+{
+    if (window->rows)
+        flint_free(window->rows);
 }
 
 
@@ -209,16 +775,53 @@ d_mat_swap(d_mat_t mat1, d_mat_t mat2)
 }
 
 
+/* Tile size of the blocked transpose used to convert between layouts. */
+#define D_MAT_TRANSPOSE_BLOCK 32
+
 void
 d_mat_set(d_mat_t mat1, const d_mat_t mat2)
 {
-    if (mat1 != mat2)
+    slong i, j, i0, j0, i1, j1;
+
+    if (mat1 == mat2 || mat2->r == 0 || mat2->c == 0)
+        return;
+
+    if (mat1->layout == D_MAT_ROW_MAJOR && mat2->layout == D_MAT_ROW_MAJOR)
     {
-        slong i;
+        for (i = 0; i < mat2->r; i++)
+            _d_vec_set(mat1->rows[i], mat2->rows[i], mat2->c);
+    }
+    else if (mat1->layout == D_MAT_COL_MAJOR
+             && mat2->layout == D_MAT_COL_MAJOR)
+    {
+        for (j = 0; j < mat2->c; j++)
+            _d_vec_set(d_mat_col(mat1, j), d_mat_col(mat2, j), mat2->r);
+    }
+    else
+    {
+        /* transpose tile by tile, so that both sides stay in cache */
+        for (i0 = 0; i0 < mat2->r; i0 += D_MAT_TRANSPOSE_BLOCK)
+        {
+            i1 = FLINT_MIN(i0 + D_MAT_TRANSPOSE_BLOCK, mat2->r);
+
+            for (j0 = 0; j0 < mat2->c; j0 += D_MAT_TRANSPOSE_BLOCK)
+            {
+                j1 = FLINT_MIN(j0 + D_MAT_TRANSPOSE_BLOCK, mat2->c);
 
-        if (mat2->r && mat2->c)
-            for (i = 0; i < mat2->r; i++)
-                _d_vec_set(mat1->rows[i], mat2->rows[i], mat2->c);
+                if (mat1->layout == D_MAT_ROW_MAJOR)
+                {
+                    for (i = i0; i < i1; i++)
+                        for (j = j0; j < j1; j++)
+                            mat1->rows[i][j] = d_mat_col(mat2, j)[i];
+                }
+                else
+                {
+                    for (j = j0; j < j1; j++)
+                        for (i = i0; i < i1; i++)
+                            d_mat_col(mat1, j)[i] = mat2->rows[i][j];
+                }
+            }
+        }
     }
 }
 
@@ -230,11 +833,26 @@ d_mat_swap_rows(d_mat_t mat, slong r, slong s)
     {
         if (r != s)
         {
-            double *u;
+            if (mat->layout == D_MAT_ROW_MAJOR)
+            {
+                double *u;
+
+                u = mat->rows[s];
+                mat->rows[s] = mat->rows[r];
+                mat->rows[r] = u;
+            }
+            else
+            {
+                slong j;
+                double u;
 
-            u = mat->rows[s];
-            mat->rows[s] = mat->rows[r];
-            mat->rows[r] = u;
+                for (j = 0; j < mat->c; j++)
+                {
+                    u = d_mat_col(mat, j)[s];
+                    d_mat_col(mat, j)[s] = d_mat_col(mat, j)[r];
+                    d_mat_col(mat, j)[r] = u;
+                }
+            }
         }
     }
 }
@@ -245,16 +863,20 @@ d_mat_zero(d_mat_t mat)
 {
     slong i;
 
-    if (mat->c < 1)
+    if (mat->c < 1 || mat->r < 1)
         return;
 
-    for (i = 0; i < mat->r; i++)
-        _d_vec_zero(mat->rows[i], mat->c);
+    if (mat->layout == D_MAT_ROW_MAJOR)
+        for (i = 0; i < mat->r; i++)
+            _d_vec_zero(mat->rows[i], mat->c);
+    else
+        for (i = 0; i < mat->c; i++)
+            _d_vec_zero(d_mat_col(mat, i), mat->r);
 }
 
 
 void
-d_mat_mul(d_mat_t C, const d_mat_t A, const d_mat_t B)
+d_mat_mul_classical(d_mat_t C, const d_mat_t A, const d_mat_t B)
 {
     slong ar, bc, br;
     slong i, j, k;
@@ -265,16 +887,17 @@ d_mat_mul(d_mat_t C, const d_mat_t A, const d_mat_t B)
 
     if (C->r != ar || C->c != bc)
     {
-        flint_printf("Exception (d_mat_mul). Incompatible dimensions.\n");
+        flint_printf("Exception (d_mat_mul_classical). "
+                     "Incompatible dimensions.\n");
         abort();
     }
 
     if (C == A || C == B)
     {
         d_mat_t t;
-        d_mat_init(t, ar, bc);
-        d_mat_mul(t, A, B);
-        d_mat_swap(C, t);
+        d_mat_init_layout(t, ar, bc, C->layout);
+        d_mat_mul_classical(t, A, B);
+        d_mat_set(C, t);
         d_mat_clear(t);
         return;
     }
@@ -301,279 +924,4764 @@ d_mat_mul(d_mat_t C, const d_mat_t A, const d_mat_t B)
 }
 
 
-int
-d_mat_approx_equal(const d_mat_t mat1, const d_mat_t mat2, double eps)
+/*
+    Blocking parameters of the packed multiplication. A KC x NC panel of B
+    is packed once and reused for every MC x KC block of A, so that the
+    packed block of A stays in L2 and one NR wide sliver of B in L1 while a
+    micro-kernel computes an MR x NR tile of C. MC and NC must be multiples
+    of every MR and NR used by the micro-kernels below.
+*/
+#define D_MAT_MUL_MC 96
+#define D_MAT_MUL_KC 256
+#define D_MAT_MUL_NC 4096
+#define D_MAT_MUL_MR_MAX 8
+#define D_MAT_MUL_NR_MAX 16
+#define D_MAT_MUL_CLASSICAL_CUTOFF 24
+
+typedef struct
 {
-    slong j;
+    slong mr;
+    slong nr;
+    void (*kernel)(slong kc, const double *a, const double *b, double *ab);
+} d_mat_mul_kernel_struct;
 
-    if (mat1->r != mat2->r || mat1->c != mat2->c)
-    {
-        return 0;
-    }
+static void
+_d_mat_mul_kernel_4x4(slong kc, const double *a, const double *b, double *ab)
+{
+    double c[16];
+    slong i, j, p;
 
-    if (mat1->r == 0 || mat1->c == 0)
-        return 1;
+    for (i = 0; i < 16; i++)
+        c[i] = 0;
 
-    for (j = 0; j < mat1->r; j++)
+    for (p = 0; p < kc; p++)
     {
-        if (!_d_vec_approx_equal(mat1->rows[j], mat2->rows[j], mat1->c, eps))
-        {
-            return 0;
-        }
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 4; j++)
+                c[i * 4 + j] += a[i] * b[j];
+        a += 4;
+        b += 4;
     }
 
-    return 1;
+    for (i = 0; i < 16; i++)
+        ab[i] = c[i];
 }
 
+#ifdef D_HAVE_X86
 
-void
-d_mat_gso(d_mat_t B, const d_mat_t A)
+__attribute__((target("avx2,fma")))
+static void
+_d_mat_mul_kernel_avx2_6x8(slong kc, const double *a, const double *b,
+                           double *ab)
 {
-    slong i, j, k, flag;
-    double t, s;
+    __m256d c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+    __m256d b0, b1, t;
+    slong p;
 
-    if (B->r != A->r || B->c != A->c)
-    {
-        flint_printf("Exception (d_mat_gso). Incompatible dimensions.\n");
-        abort();
-    }
+    c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_pd();
+    c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_pd();
 
-    if (B == A)
+    for (p = 0; p < kc; p++)
     {
-        d_mat_t t;
-        d_mat_init(t, A->r, A->c);
-        d_mat_gso(t, A);
-        d_mat_swap(B, t);
-        d_mat_clear(t);
-        return;
+        b0 = _mm256_load_pd(b);
+        b1 = _mm256_load_pd(b + 4);
+
+        t = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(t, b0, c00);
+        c01 = _mm256_fmadd_pd(t, b1, c01);
+        t = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(t, b0, c10);
+        c11 = _mm256_fmadd_pd(t, b1, c11);
+        t = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(t, b0, c20);
+        c21 = _mm256_fmadd_pd(t, b1, c21);
+        t = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(t, b0, c30);
+        c31 = _mm256_fmadd_pd(t, b1, c31);
+        t = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(t, b0, c40);
+        c41 = _mm256_fmadd_pd(t, b1, c41);
+        t = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(t, b0, c50);
+        c51 = _mm256_fmadd_pd(t, b1, c51);
+
+        a += 6;
+        b += 8;
     }
 
-    if (A->r == 0)
+    _mm256_storeu_pd(ab + 0, c00);
+    _mm256_storeu_pd(ab + 4, c01);
+    _mm256_storeu_pd(ab + 8, c10);
+    _mm256_storeu_pd(ab + 12, c11);
+    _mm256_storeu_pd(ab + 16, c20);
+    _mm256_storeu_pd(ab + 20, c21);
+    _mm256_storeu_pd(ab + 24, c30);
+    _mm256_storeu_pd(ab + 28, c31);
+    _mm256_storeu_pd(ab + 32, c40);
+    _mm256_storeu_pd(ab + 36, c41);
+    _mm256_storeu_pd(ab + 40, c50);
+    _mm256_storeu_pd(ab + 44, c51);
+}
+
+#define D_MAT_MUL_AVX512_ROW(i)                                 \
+    do {                                                        \
+        t = _mm512_set1_pd(a[i]);                               \
+        c ## i ## 0 = _mm512_fmadd_pd(t, b0, c ## i ## 0);      \
+        c ## i ## 1 = _mm512_fmadd_pd(t, b1, c ## i ## 1);      \
+    } while (0)
+
+__attribute__((target("avx512f")))
+static void
+_d_mat_mul_kernel_avx512_8x16(slong kc, const double *a, const double *b,
+                              double *ab)
+{
+    __m512d c00, c01, c10, c11, c20, c21, c30, c31;
+    __m512d c40, c41, c50, c51, c60, c61, c70, c71;
+    __m512d b0, b1, t;
+    slong p;
+
+    c00 = c01 = c10 = c11 = c20 = c21 = c30 = c31 = _mm512_setzero_pd();
+    c40 = c41 = c50 = c51 = c60 = c61 = c70 = c71 = _mm512_setzero_pd();
+
+    for (p = 0; p < kc; p++)
     {
-        return;
+        b0 = _mm512_load_pd(b);
+        b1 = _mm512_load_pd(b + 8);
+
+        D_MAT_MUL_AVX512_ROW(0);
+        D_MAT_MUL_AVX512_ROW(1);
+        D_MAT_MUL_AVX512_ROW(2);
+        D_MAT_MUL_AVX512_ROW(3);
+        D_MAT_MUL_AVX512_ROW(4);
+        D_MAT_MUL_AVX512_ROW(5);
+        D_MAT_MUL_AVX512_ROW(6);
+        D_MAT_MUL_AVX512_ROW(7);
+
+        a += 8;
+        b += 16;
     }
 
-    for (k = 0; k < A->c; k++)
+    _mm512_storeu_pd(ab + 0, c00);
+    _mm512_storeu_pd(ab + 8, c01);
+    _mm512_storeu_pd(ab + 16, c10);
+    _mm512_storeu_pd(ab + 24, c11);
+    _mm512_storeu_pd(ab + 32, c20);
+    _mm512_storeu_pd(ab + 40, c21);
+    _mm512_storeu_pd(ab + 48, c30);
+    _mm512_storeu_pd(ab + 56, c31);
+    _mm512_storeu_pd(ab + 64, c40);
+    _mm512_storeu_pd(ab + 72, c41);
+    _mm512_storeu_pd(ab + 80, c50);
+    _mm512_storeu_pd(ab + 88, c51);
+    _mm512_storeu_pd(ab + 96, c60);
+    _mm512_storeu_pd(ab + 104, c61);
+    _mm512_storeu_pd(ab + 112, c70);
+    _mm512_storeu_pd(ab + 120, c71);
+}
+
+#undef D_MAT_MUL_AVX512_ROW
+
+#endif
+
+static const d_mat_mul_kernel_struct *
+_d_mat_mul_kernel(void)
+{
+    static const d_mat_mul_kernel_struct generic = {
+        4, 4, _d_mat_mul_kernel_4x4 };
+#ifdef D_HAVE_X86
+    static const d_mat_mul_kernel_struct avx2 = {
+        6, 8, _d_mat_mul_kernel_avx2_6x8 };
+    static const d_mat_mul_kernel_struct avx512 = {
+        8, 16, _d_mat_mul_kernel_avx512_8x16 };
+
+    if (_d_cpu_level() == D_CPU_AVX512)
+        return &avx512;
+    if (_d_cpu_level() == D_CPU_AVX2)
+        return &avx2;
+#endif
+
+    return &generic;
+}
+
+/*
+    Packs the mc x kc block of A at (i0, k0) into row panels of height mr,
+    each stored column by column, padding the last panel with zeros.
+*/
+static void
+_d_mat_mul_pack_A(double *Ap, const d_mat_t A, slong i0, slong mc,
+                  slong k0, slong kc, slong mr)
+{
+    slong i, ir, p, mb;
+
+    for (ir = 0; ir < mc; ir += mr)
     {
-        for (j = 0; j < A->r; j++)
+        mb = FLINT_MIN(mr, mc - ir);
+
+        if (A->layout == D_MAT_ROW_MAJOR)
         {
-            d_mat_entry(B, j, k) = d_mat_entry(A, j, k);
+            for (i = 0; i < mb; i++)
+            {
+                const double *a = A->rows[i0 + ir + i] + k0;
+                for (p = 0; p < kc; p++)
+                    Ap[p * mr + i] = a[p];
+            }
         }
-        flag = 1;
-        while (flag)
+        else
         {
-            t = 0;
-            for (i = 0; i < k; i++)
+            for (p = 0; p < kc; p++)
             {
-                s = 0;
-                for (j = 0; j < A->r; j++)
+                const double *a = d_mat_col(A, k0 + p) + i0 + ir;
+                for (i = 0; i < mb; i++)
+                    Ap[p * mr + i] = a[i];
+            }
+        }
+        for (i = mb; i < mr; i++)
+            for (p = 0; p < kc; p++)
+                Ap[p * mr + i] = 0;
+
+        Ap += mr * kc;
+    }
+}
+
+/*
+    Packs the kc x nc block of B at (k0, j0) into column panels of width nr,
+    each stored row by row, padding the last panel with zeros. If trans is
+    set the block is taken from the transpose of B, so that A A^T can be
+    computed from A alone.
+*/
+static void
+_d_mat_mul_pack_B(double *Bp, const d_mat_t B, int trans, slong k0, slong kc,
+                  slong j0, slong nc, slong nr)
+{
+    slong j, jr, p, nb, s;
+
+    if (trans || B->layout == D_MAT_COL_MAJOR)
+    {
+        /* column j of the block starts at b and has stride s */
+        s = trans ? _d_mat_row_stride(B) : 1;
+
+        for (jr = 0; jr < nc; jr += nr)
+        {
+            nb = FLINT_MIN(nr, nc - jr);
+            for (j = 0; j < nr; j++)
+            {
+                if (j < nb)
                 {
-                    s += d_mat_entry(B, j, i) * d_mat_entry(B, j, k);
+                    const double *b = trans
+                            ? _d_mat_row_ptr(B, j0 + jr + j) + k0 * s
+                            : d_mat_col(B, j0 + jr + j) + k0;
+                    for (p = 0; p < kc; p++)
+                        Bp[p * nr + j] = b[p * s];
                 }
-                t += s * s;
-                for (j = 0; j < A->r; j++)
+                else
                 {
-                    d_mat_entry(B, j, k) -= s * d_mat_entry(B, j, i);
+                    for (p = 0; p < kc; p++)
+                        Bp[p * nr + j] = 0;
                 }
             }
-            s = 0;
-            for (j = 0; j < A->r; j++)
+            Bp += nr * kc;
+        }
+        return;
+    }
+
+    for (p = 0; p < kc; p++)
+    {
+        const double *b = B->rows[k0 + p] + j0;
+        double *d = Bp + p * nr;
+
+        for (jr = 0; jr < nc; jr += nr)
+        {
+            nb = FLINT_MIN(nr, nc - jr);
+            for (j = 0; j < nb; j++)
+                d[j] = b[jr + j];
+            for ( ; j < nr; j++)
+                d[j] = 0;
+            d += nr * kc;
+        }
+    }
+}
+
+/*
+    Sets the block of C with rows [i0, i1) and columns [j0, j1) to the
+    corresponding block of A * B, or of A * B^T if trans is set, or adds
+    that block to C if add is set. If upper is set, the micro-tiles lying
+    strictly below the diagonal of C are skipped. Each entry of C is
+    computed by the same sequence of operations however C is split into
+    blocks. Ap and Bp are packing buffers allocated by
+    _d_mat_mul_packed_alloc for at least j1 - j0 columns. If Bp is NULL,
+    j1 - j0 is at most D_MAT_MUL_NC and the columns [j0, j1) of B are
+    already packed in Bs, the panel of rows [pc, pc + D_MAT_MUL_KC) at
+    Bs + (pc / D_MAT_MUL_KC) * bstride.
+*/
+static void
+_d_mat_mul_packed_block_buf(d_mat_t C, const d_mat_t A, const d_mat_t B,
+                        int trans, int add, int upper,
+                        slong i0, slong i1, slong j0, slong j1,
+                        double *Ap, double *Bp,
+                        const double *Bs, slong bstride)
+{
+    const d_mat_mul_kernel_struct * K = _d_mat_mul_kernel();
+    double ab[D_MAT_MUL_MR_MAX * D_MAT_MUL_NR_MAX];
+    const double *Bc;
+    slong k, mr, nr, cs;
+    slong ic, jc, pc, ir, jr, mc, nc, kc, mb, nb, i, j;
+
+    k = A->c;
+    mr = K->mr;
+    nr = K->nr;
+    cs = _d_mat_row_stride(C);
+
+    for (jc = j0; jc < j1; jc += D_MAT_MUL_NC)
+    {
+        nc = FLINT_MIN(D_MAT_MUL_NC, j1 - jc);
+
+        for (pc = 0; pc < k; pc += D_MAT_MUL_KC)
+        {
+            kc = FLINT_MIN(D_MAT_MUL_KC, k - pc);
+
+            if (Bp != NULL)
             {
-                s += d_mat_entry(B, j, k) * d_mat_entry(B, j, k);
+                _d_mat_mul_pack_B(Bp, B, trans, pc, kc, jc, nc, nr);
+                Bc = Bp;
             }
-            t += s;
-            flag = 0;
-            if (s < t)
+            else
+                Bc = Bs + (pc / D_MAT_MUL_KC) * bstride;
+
+            for (ic = i0; ic < i1; ic += D_MAT_MUL_MC)
             {
-                if (s * D_EPS == 0)
-                    s = 0;
-                else
-                    flag = 1;
+                mc = FLINT_MIN(D_MAT_MUL_MC, i1 - ic);
+
+                _d_mat_mul_pack_A(Ap, A, ic, mc, pc, kc, mr);
+
+                for (jr = 0; jr < nc; jr += nr)
+                {
+                    nb = FLINT_MIN(nr, nc - jr);
+
+                    for (ir = 0; ir < mc; ir += mr)
+                    {
+                        mb = FLINT_MIN(mr, mc - ir);
+
+                        if (upper && jc + jr + nb <= ic + ir)
+                            break;
+
+                        K->kernel(kc, Ap + ir * kc, Bc + jr * kc, ab);
+
+                        for (i = 0; i < mb; i++)
+                        {
+                            double *c = _d_mat_row_ptr(C, ic + ir + i)
+                                        + (jc + jr) * cs;
+                            const double *t = ab + i * nr;
+
+                            if (pc == 0 && !add)
+                                for (j = 0; j < nb; j++)
+                                    c[j * cs] = t[j];
+                            else
+                                for (j = 0; j < nb; j++)
+                                    c[j * cs] += t[j];
+                        }
+                    }
+                }
             }
         }
-        s = sqrt(s);
-        if (s != 0)
-            s = 1 / s;
-        for (j = 0; j < A->r; j++)
-        {
-            d_mat_entry(B, j, k) *= s;
-        }
     }
+
+}
+
+static void
+_d_mat_mul_packed_alloc(double **Ap, double **Bp, slong n)
+{
+    slong nr = _d_mat_mul_kernel()->nr;
+
+    /* every sliver of the packed B is then aligned for the kernels */
+    *Ap = _d_mat_aligned_alloc(D_MAT_MUL_MC * D_MAT_MUL_KC * sizeof(double));
+    *Bp = _d_mat_aligned_alloc(D_MAT_MUL_KC
+                    * FLINT_MIN(D_MAT_MUL_NC, n + nr) * sizeof(double));
+}
+
+static void
+_d_mat_mul_packed_block(d_mat_t C, const d_mat_t A, const d_mat_t B,
+                        int trans, int add, int upper,
+                        slong i0, slong i1, slong j0, slong j1)
+{
+    double *Ap, *Bp;
+
+    _d_mat_mul_packed_alloc(&Ap, &Bp, j1 - j0);
+    _d_mat_mul_packed_block_buf(C, A, B, trans, add, upper,
+                                i0, i1, j0, j1, Ap, Bp, NULL, 0);
+    _d_mat_aligned_free(Ap);
+    _d_mat_aligned_free(Bp);
+}
+
+/* Width of the column tiles of C handed to each thread by d_mat_mul. */
+#define D_MAT_MUL_TILE_NC 256
+#define D_MAT_MUL_PARALLEL_CUTOFF 64
+
+typedef struct
+{
+    d_mat_struct * C;
+    const d_mat_struct * A;
+    const d_mat_struct * B;
+    int trans;
+    int add;
+    int upper;
+    slong tiles_c;
+    slong panels;       /* number of panels of D_MAT_MUL_KC rows of B */
+    slong bstride;      /* doubles between two packed panels of B */
+    double * Bs;        /* packed B, panel p of tile j at (j panels + p) */
+} d_mat_mul_arg_struct;
+
+/* Task t packs panel t % panels of the column tile t / panels of B. */
+static void
+_d_mat_mul_pack_tile(void * varg, slong t)
+{
+    d_mat_mul_arg_struct * arg = varg;
+    slong j0, pc;
+
+    j0 = (t / arg->panels) * D_MAT_MUL_TILE_NC;
+    pc = (t % arg->panels) * D_MAT_MUL_KC;
+
+    _d_mat_mul_pack_B(arg->Bs + t * arg->bstride, arg->B, arg->trans,
+                      pc, FLINT_MIN(D_MAT_MUL_KC, arg->A->c - pc),
+                      j0, FLINT_MIN(D_MAT_MUL_TILE_NC, arg->C->c - j0),
+                      _d_mat_mul_kernel()->nr);
+}
+
+static void
+_d_mat_mul_tile(void * varg, slong t)
+{
+    d_mat_mul_arg_struct * arg = varg;
+    slong i0, j0, j1;
+    double *Ap;
+
+    i0 = (t / arg->tiles_c) * D_MAT_MUL_MC;
+    j0 = (t % arg->tiles_c) * D_MAT_MUL_TILE_NC;
+    j1 = FLINT_MIN(j0 + D_MAT_MUL_TILE_NC, arg->C->c);
+
+    if (arg->upper && j1 <= i0)
+        return;
+
+    Ap = _d_mat_aligned_alloc(D_MAT_MUL_MC * D_MAT_MUL_KC * sizeof(double));
+    _d_mat_mul_packed_block_buf(arg->C, arg->A, arg->B,
+                            arg->trans, arg->add, arg->upper,
+                            i0, FLINT_MIN(i0 + D_MAT_MUL_MC, arg->C->r),
+                            j0, j1, Ap, NULL,
+                            arg->Bs + (t % arg->tiles_c) * arg->panels
+                                      * arg->bstride, arg->bstride);
+    _d_mat_aligned_free(Ap);
+}
+
+/*
+    C = A * B, or A * B^T if trans is set, or C += A * B (resp. A * B^T)
+    if add is set. If upper is set, only the entries of C on or above
+    the diagonal are guaranteed to be computed.
+*/
+void
+_d_mat_mul_packed(d_mat_t C, const d_mat_t A, const d_mat_t B,
+                  int trans, int add, int upper)
+{
+    d_mat_mul_arg_struct arg;
+    slong tiles_r, nr;
+
+    if (thread_pool_get_num_threads() == 1
+        || C->r < D_MAT_MUL_PARALLEL_CUTOFF || C->c < D_MAT_MUL_PARALLEL_CUTOFF)
+    {
+        _d_mat_mul_packed_block(C, A, B, trans, add, upper,
+                                0, C->r, 0, C->c);
+        return;
+    }
+
+    arg.C = C;
+    arg.A = A;
+    arg.B = B;
+    arg.trans = trans;
+    arg.add = add;
+    arg.upper = upper;
+    arg.tiles_c = (C->c + D_MAT_MUL_TILE_NC - 1) / D_MAT_MUL_TILE_NC;
+    tiles_r = (C->r + D_MAT_MUL_MC - 1) / D_MAT_MUL_MC;
+
+    /*
+        Every panel of B is packed once, by one task, and then shared by
+        the tiles_r tiles of its column, which only pack their rows of A.
+    */
+    nr = _d_mat_mul_kernel()->nr;
+    arg.panels = (A->c + D_MAT_MUL_KC - 1) / D_MAT_MUL_KC;
+    arg.bstride = D_MAT_MUL_KC * ((D_MAT_MUL_TILE_NC + nr - 1) / nr * nr);
+    arg.Bs = _d_mat_aligned_alloc(arg.tiles_c * arg.panels * arg.bstride
+                                  * sizeof(double));
+
+    thread_pool_parallel_for(arg.tiles_c * arg.panels,
+                             _d_mat_mul_pack_tile, &arg);
+    thread_pool_parallel_for(tiles_r * arg.tiles_c, _d_mat_mul_tile, &arg);
+
+    _d_mat_aligned_free(arg.Bs);
 }
 
 
 void
-d_mat_qr(d_mat_t Q, d_mat_t R, const d_mat_t A)
+d_mat_mul(d_mat_t C, const d_mat_t A, const d_mat_t B)
 {
-    slong i, j, k, flag, orig;
-    double t, s;
+    slong ar, bc, br;
 
-    if (Q->r != A->r || Q->c != A->c || R->r != A->c || R->c != A->c)
+    ar = A->r;
+    br = B->r;
+    bc = B->c;
+
+    if (C->r != ar || C->c != bc)
     {
-        flint_printf("Exception (d_mat_qr). Incompatible dimensions.\n");
+        flint_printf("Exception (d_mat_mul). Incompatible dimensions.\n");
         abort();
     }
 
-    if (Q == A)
+    if (C == A || C == B)
     {
         d_mat_t t;
-        d_mat_init(t, A->r, A->c);
-        d_mat_qr(t, R, A);
-        d_mat_swap(Q, t);
+        d_mat_init_layout(t, ar, bc, C->layout);
+        d_mat_mul(t, A, B);
+        d_mat_set(C, t);
         d_mat_clear(t);
         return;
     }
 
-    if (A->r == 0)
+    if (br == 0)
+    {
+        d_mat_zero(C);
+        return;
+    }
+
+    if (ar < D_MAT_MUL_CLASSICAL_CUTOFF || br < D_MAT_MUL_CLASSICAL_CUTOFF
+        || bc < D_MAT_MUL_CLASSICAL_CUTOFF)
+    {
+        d_mat_mul_classical(C, A, B);
+        return;
+    }
+
+    _d_mat_mul_packed(C, A, B, 0, 0, 0);
+}
+
+
+/*
+    C += A * B, accumulating into C in place. A temporary is needed only if
+    C aliases A or B.
+*/
+void
+d_mat_addmul(d_mat_t C, const d_mat_t A, const d_mat_t B)
+{
+    slong ar, bc, br;
+    slong i, j, k;
+
+    ar = A->r;
+    br = B->r;
+    bc = B->c;
+
+    if (C->r != ar || C->c != bc || A->c != br)
+    {
+        flint_printf("Exception (d_mat_addmul). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (C == A || C == B)
     {
+        d_mat_t t;
+        d_mat_init_layout(t, ar, bc, C->layout);
+        d_mat_mul(t, A, B);
+        for (i = 0; i < ar; i++)
+            for (j = 0; j < bc; j++)
+                d_mat_entry(C, i, j) += d_mat_entry(t, i, j);
+        d_mat_clear(t);
         return;
     }
 
-    for (k = 0; k < A->c; k++)
+    if (br == 0)
+        return;
+
+    if (ar < D_MAT_MUL_CLASSICAL_CUTOFF || br < D_MAT_MUL_CLASSICAL_CUTOFF
+        || bc < D_MAT_MUL_CLASSICAL_CUTOFF)
     {
-        for (j = 0; j < A->r; j++)
+        for (i = 0; i < ar; i++)
         {
-            d_mat_entry(Q, j, k) = d_mat_entry(A, j, k);
+            for (j = 0; j < bc; j++)
+            {
+                double s = d_mat_entry(A, i, 0) * d_mat_entry(B, 0, j);
+
+                for (k = 1; k < br; k++)
+                    s += d_mat_entry(A, i, k) * d_mat_entry(B, k, j);
+
+                d_mat_entry(C, i, j) += s;
+            }
         }
-        orig = flag = 1;
-        while (flag)
+        return;
+    }
+
+    _d_mat_mul_packed(C, A, B, 0, 1, 0);
+}
+
+
+/*
+    Sets C to the Gram matrix A * A^T of the rows of A. The transpose is
+    read from A while packing, and only the entries on or above the
+    diagonal are computed, the others being copied from them.
+*/
+void
+d_mat_gram(d_mat_t C, const d_mat_t A)
+{
+    slong i, j, k, r;
+
+    r = A->r;
+
+    if (C->r != r || C->c != r)
+    {
+        flint_printf("Exception (d_mat_gram). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (C == A)
+    {
+        d_mat_t t;
+        d_mat_init_layout(t, r, r, C->layout);
+        d_mat_gram(t, A);
+        d_mat_set(C, t);
+        d_mat_clear(t);
+        return;
+    }
+
+    if (A->c == 0)
+    {
+        d_mat_zero(C);
+        return;
+    }
+
+    if (r < D_MAT_MUL_CLASSICAL_CUTOFF || A->c < D_MAT_MUL_CLASSICAL_CUTOFF)
+    {
+        for (i = 0; i < r; i++)
         {
-            t = 0;
-            for (i = 0; i < k; i++)
+            for (j = i; j < r; j++)
             {
-                s = 0;
-                for (j = 0; j < A->r; j++)
-                {
-                    s += d_mat_entry(Q, j, i) * d_mat_entry(Q, j, k);
-                }
-                if (orig)
-                {
-                    d_mat_entry(R, i, k) = s;
-                }
-                else
-                {
-                    d_mat_entry(R, i, k) += s;
-                }
-                t += s * s;
-                for (j = 0; j < A->r; j++)
+                d_mat_entry(C, i, j) = d_mat_entry(A, i, 0)
+                    * d_mat_entry(A, j, 0);
+
+                for (k = 1; k < A->c; k++)
                 {
-                    d_mat_entry(Q, j, k) -= s * d_mat_entry(Q, j, i);
+                    d_mat_entry(C, i, j) += d_mat_entry(A, i, k)
+                        * d_mat_entry(A, j, k);
                 }
             }
-            s = 0;
-            for (j = 0; j < A->r; j++)
-            {
-                s += d_mat_entry(Q, j, k) * d_mat_entry(Q, j, k);
-            }
-            t += s;
-            flag = 0;
-            if (s < t)
-            {
-                orig = 0;
-                if (s * D_EPS == 0)
-                    s = 0;
-                else
-                    flag = 1;
-            }
-        }
-        d_mat_entry(R, k, k) = s = sqrt(s);
-        if (s != 0)
-            s = 1 / s;
-        for (j = 0; j < A->r; j++)
-        {
-            d_mat_entry(Q, j, k) *= s;
         }
     }
+    else
+        _d_mat_mul_packed(C, A, A, 1, 0, 1);
+
+    for (i = 1; i < r; i++)
+        for (j = 0; j < i; j++)
+            d_mat_entry(C, i, j) = d_mat_entry(C, j, i);
 }
 
 
-int
-test_d_mat_qr(void)
+/* Height of the row panels of A * B formed by d_mat_mul_residual. */
+#define D_MAT_MUL_RESIDUAL_ROWS (4 * D_MAT_MUL_MC)
+
+/*
+    Returns the Frobenius norm of A * B - C without forming A * B. Small
+    products are accumulated a row at a time in a vector of length B->c;
+    larger ones a panel of D_MAT_MUL_RESIDUAL_ROWS rows at a time by the
+    packed multiplication, into a single buffer reused for every panel.
+    For a QR factorisation this is the residual norm of Q * R - A.
+*/
+double
+d_mat_mul_residual(const d_mat_t A, const d_mat_t B, const d_mat_t C)
 {
-    int i;
-    FLINT_TEST_INIT(state);
+    slong i, j, k, n, s, i0, mb;
+    double d, res;
 
-    flint_printf("qr....");
-    fflush(stdout);
+    n = B->c;
 
-    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    if (C->r != A->r || C->c != n || A->c != B->r)
     {
-        double dot, norm;
-        int j, k, l;
-        d_mat_t A, Q, R, B;
-
-        slong m, n;
-
-        m = n_randint(state, 10);
-        n = n_randint(state, 10);
+        flint_printf("Exception (d_mat_mul_residual). "
+                     "Incompatible dimensions.\n");
+        abort();
+    }
 
-        d_mat_init(A, m, n);
-        d_mat_init(Q, m, n);
-        d_mat_init(R, n, n);
-        d_mat_init(B, m, n);
+    if (A->r == 0 || n == 0)
+        return 0;
 
-        d_mat_randtest(A, state);
-        d_mat_zero(R);
+    res = 0;
 
-        d_mat_qr(Q, R, A);
+    if (A->r < D_MAT_MUL_CLASSICAL_CUTOFF || B->r < D_MAT_MUL_CLASSICAL_CUTOFF
+        || n < D_MAT_MUL_CLASSICAL_CUTOFF)
+    {
+        double *t = flint_malloc(n * sizeof(double));
 
-        d_mat_mul(B, Q, R);
+        s = _d_mat_row_stride(B);
 
-        if (!d_mat_approx_equal(A, B, 3 * D_EPS))
+        for (i = 0; i < A->r; i++)
         {
-            flint_printf("FAIL:\n");
-            flint_printf("A:\n");
-            d_mat_print(A);
-            flint_printf("Q:\n");
-            d_mat_print(Q);
-            flint_printf("R:\n");
-            d_mat_print(R);
-            flint_printf("B:\n");
-            d_mat_print(B);
-            abort();
-        }
+            _d_vec_zero(t, n);
 
-        for (j = 0; j < n; j++)
-        {
-            norm = 0;
-            for (l = 0; l < m; l++)
+            for (k = 0; k < B->r; k++)
             {
-                norm += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, j);
+                const double *b = _d_mat_row_ptr(B, k);
+                double a = d_mat_entry(A, i, k);
+
+                for (j = 0; j < n; j++)
+                    t[j] += a * b[j * s];
+            }
+
+            for (j = 0; j < n; j++)
+            {
+                d = t[j] - d_mat_entry(C, i, j);
+                res += d * d;
+            }
+        }
+
+        flint_free(t);
+    }
+    else
+    {
+        d_mat_t W;
+        d_mat_struct Av, Wv;
+        double *Ap, *Bp;
+
+        d_mat_init_layout(W, FLINT_MIN(A->r, D_MAT_MUL_RESIDUAL_ROWS), n,
+                          D_MAT_COL_MAJOR);
+        _d_mat_mul_packed_alloc(&Ap, &Bp, n);
+
+        for (i0 = 0; i0 < A->r; i0 += D_MAT_MUL_RESIDUAL_ROWS)
+        {
+            mb = FLINT_MIN(D_MAT_MUL_RESIDUAL_ROWS, A->r - i0);
+
+            /* views of the rows [i0, i0 + mb) of A and the first mb of W */
+            Av = *A;
+            Av.r = mb;
+            if (A->layout == D_MAT_ROW_MAJOR)
+            {
+                Av.rows = A->rows + i0;
+                Av.entries = A->rows[i0];
+            }
+            else
+                Av.entries = A->entries + i0;
+            Wv = *W;
+            Wv.r = mb;
+
+            _d_mat_mul_packed_block_buf(&Wv, &Av, B, 0, 0, 0,
+                                        0, mb, 0, n, Ap, Bp, NULL, 0);
+
+            /* run along the rows of C if it is row-major */
+            s = (C->layout == D_MAT_ROW_MAJOR) ? W->ld : 1;
+            for (i = 0; i < (s == 1 ? n : mb); i++)
+            {
+                const double *w = (s == 1) ? d_mat_col(W, i) : W->entries + i;
+                const double *c = (s == 1) ? d_mat_col(C, i) + i0
+                                           : C->rows[i0 + i];
+
+                for (j = 0; j < (s == 1 ? mb : n); j++)
+                {
+                    d = w[j * s] - c[j];
+                    res += d * d;
+                }
+            }
+        }
+
+        _d_mat_aligned_free(Ap);
+        _d_mat_aligned_free(Bp);
+        d_mat_clear(W);
+    }
+
+    return sqrt(res);
+}
+
+
+int
+d_mat_equal(const d_mat_t mat1, const d_mat_t mat2)
+{
+    slong i, j;
+
+    if (mat1->r != mat2->r || mat1->c != mat2->c)
+        return 0;
+
+    for (i = 0; i < mat1->r; i++)
+        for (j = 0; j < mat1->c; j++)
+            if (d_mat_entry(mat1, i, j) != d_mat_entry(mat2, i, j))
+                return 0;
+
+    return 1;
+}
+
+
+int
+d_mat_approx_equal(const d_mat_t mat1, const d_mat_t mat2, double eps)
+{
+    slong j;
+
+    if (mat1->r != mat2->r || mat1->c != mat2->c)
+    {
+        return 0;
+    }
+
+    if (mat1->r == 0 || mat1->c == 0)
+        return 1;
+
+    if (mat1->layout == D_MAT_ROW_MAJOR && mat2->layout == D_MAT_ROW_MAJOR)
+    {
+        for (j = 0; j < mat1->r; j++)
+        {
+            if (!_d_vec_approx_equal(mat1->rows[j], mat2->rows[j], mat1->c,
+                                     eps))
+            {
+                return 0;
+            }
+        }
+    }
+    else
+    {
+        slong i;
+
+        for (i = 0; i < mat1->r; i++)
+            for (j = 0; j < mat1->c; j++)
+                if (fabs(d_mat_entry(mat1, i, j) - d_mat_entry(mat2, i, j))
+                    > eps)
+                    return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+    Projects the columns l0 <= l < l1 of the column-major matrix B once
+    against its normalised column k, adding the squares of the projection
+    coefficients to t[l] and, if R is not NULL, storing the coefficients in
+    row k of R.
+*/
+#define D_MAT_GSO_PROJECT_BLOCK 16
+
+static void
+_d_mat_gso_project(d_mat_t B, d_mat_t R, double *t, slong k,
+                   slong l0, slong l1)
+{
+    const double *bk = d_mat_col(B, k);
+    double s[D_MAT_GSO_PROJECT_BLOCK];
+    slong i, l, n;
+
+    for (l = l0; l < l1; l += n)
+    {
+        n = FLINT_MIN(D_MAT_GSO_PROJECT_BLOCK, l1 - l);
+        _d_vec_scalar_product_multi(s, bk, d_mat_col(B, l), B->ld, n, B->r);
+
+        for (i = 0; i < n; i++)
+        {
+            if (R != NULL)
+            {
+                d_mat_entry(R, k, l + i) = s[i];
+            }
+            t[l + i] += s[i] * s[i];
+            _d_vec_scalar_submul(d_mat_col(B, l + i), bk, B->r, s[i]);
+        }
+    }
+}
+
+#define D_MAT_GSO_PARALLEL_CUTOFF 16384
+
+typedef struct
+{
+    d_mat_struct * B;
+    d_mat_struct * R;
+    double * t;
+    slong k;
+    slong l0;
+    slong chunk;
+    slong l1;
+} d_mat_gso_arg_struct;
+
+static void
+_d_mat_gso_project_chunk(void * varg, slong i)
+{
+    d_mat_gso_arg_struct * arg = varg;
+    slong l0 = arg->l0 + i * arg->chunk;
+
+    _d_mat_gso_project(arg->B, arg->R, arg->t, arg->k,
+                       l0, FLINT_MIN(l0 + arg->chunk, arg->l1));
+}
+
+/*
+    Projects all columns after k against column k. The columns are
+    independent, so they are distributed over the thread pool; every column
+    sees the same operations in the same order as in a serial run.
+*/
+static void
+_d_mat_gso_project_trailing(d_mat_t B, d_mat_t R, double *t, slong k)
+{
+    d_mat_gso_arg_struct arg;
+    slong n, p;
+
+    n = B->c - k - 1;
+    p = thread_pool_get_num_threads();
+
+    if (p == 1 || n < 2 || B->r * n < D_MAT_GSO_PARALLEL_CUTOFF)
+    {
+        _d_mat_gso_project(B, R, t, k, k + 1, B->c);
+        return;
+    }
+
+    arg.B = B;
+    arg.R = R;
+    arg.t = t;
+    arg.k = k;
+    arg.l0 = k + 1;
+    arg.l1 = B->c;
+    arg.chunk = (n + 4 * p - 1) / (4 * p);
+
+    thread_pool_parallel_for((n + arg.chunk - 1) / arg.chunk,
+                             _d_mat_gso_project_chunk, &arg);
+}
+
+
+/*
+    Runs the Gram-Schmidt loop on the columns of the column-major matrix W
+    in place, storing the coefficients in R if it is not NULL.
+*/
+static void
+_d_mat_gso(d_mat_t W, d_mat_t R)
+{
+    slong i, k, m;
+    double s, tk, *t, *wk;
+
+    m = W->r;
+    t = flint_calloc(W->c, sizeof(double));
+
+    /*
+        Right-looking modified Gram-Schmidt: when column k is reached it has
+        already been projected once against columns 0, ..., k - 1 and t[k]
+        holds the sum of squares of the coefficients of that pass. Further
+        passes are made while cancellation is detected; for Q R these add to
+        the coefficients stored by the first pass. Each update of a pass is
+        fused with the scalar product needed by the next one, the last one
+        being the squared norm of column k.
+    */
+    for (k = 0; k < W->c; k++)
+    {
+        wk = d_mat_col(W, k);
+        s = _d_vec_norm(wk, m);
+        tk = t[k] + s;
+        while (s < tk)
+        {
+            if (s * D_EPS == 0)
+            {
+                s = 0;
+                break;
+            }
+            tk = 0;
+            s = _d_vec_scalar_product(d_mat_col(W, 0), wk, m);
+            for (i = 0; i < k; i++)
+            {
+                if (R != NULL)
+                {
+                    d_mat_entry(R, i, k) += s;
+                }
+                tk += s * s;
+                s = _d_vec_scalar_submul_dot(wk, d_mat_col(W, i), s,
+                                    i + 1 < k ? d_mat_col(W, i + 1) : wk, m);
+            }
+            tk += s;
+        }
+        s = sqrt(s);
+        if (R != NULL)
+        {
+            d_mat_entry(R, k, k) = s;
+        }
+        if (s != 0)
+            s = 1 / s;
+        _d_vec_scalar_mul(wk, wk, m, s);
+
+        _d_mat_gso_project_trailing(W, R, t, k);
+    }
+
+    flint_free(t);
+}
+
+
+void
+d_mat_gso(d_mat_t B, const d_mat_t A)
+{
+    d_mat_t W;
+
+    if (B->r != A->r || B->c != A->c)
+    {
+        flint_printf("Exception (d_mat_gso). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (A->r == 0)
+    {
+        return;
+    }
+
+    /* work on contiguous columns whatever the layouts of A and B */
+    d_mat_init_layout(W, A->r, A->c, D_MAT_COL_MAJOR);
+    d_mat_set(W, A);
+    _d_mat_gso(W, NULL);
+    d_mat_set(B, W);
+    d_mat_clear(W);
+}
+
+
+void
+d_mat_qr_mgs(d_mat_t Q, d_mat_t R, const d_mat_t A)
+{
+    d_mat_t W;
+
+    if (Q->r != A->r || Q->c != A->c || R->r != A->c || R->c != A->c)
+    {
+        flint_printf("Exception (d_mat_qr_mgs). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (A->r == 0)
+    {
+        return;
+    }
+
+    d_mat_init_layout(W, A->r, A->c, D_MAT_COL_MAJOR);
+    d_mat_set(W, A);
+    _d_mat_gso(W, R);
+    d_mat_set(Q, W);
+    d_mat_clear(W);
+}
+
+
+/* Panel width of the blocked Householder QR. */
+#define D_MAT_QR_HOUSEHOLDER_NB 32
+
+/*
+    Overwrites x[0:n] with the Householder vector v (with v[0] = 1 implied
+    and beta stored in its place) of the reflector H = I - tau v v^T which
+    maps x to beta e_1, and returns tau.
+*/
+static double
+_d_vec_householder(double *x, slong n)
+{
+    double alpha, xnorm, beta, scale;
+
+    alpha = x[0];
+    xnorm = _d_vec_norm(x + 1, n - 1);
+
+    if (xnorm == 0)
+        return 0;
+
+    beta = -copysign(sqrt(alpha * alpha + xnorm), alpha);
+    scale = 1 / (alpha - beta);
+    _d_vec_scalar_mul(x + 1, x + 1, n - 1, scale);
+    x[0] = beta;
+
+    return (beta - alpha) / beta;
+}
+
+/*
+    Sets V to the explicit (m - j0) x jb unit lower trapezoidal matrix of the
+    Householder vectors stored below the diagonal in columns [j0, j0 + jb)
+    of W.
+*/
+static void
+_d_mat_householder_V(d_mat_t V, const d_mat_t W, slong j0, slong jb)
+{
+    slong r, p;
+
+    for (r = 0; r < V->r; r++)
+        for (p = 0; p < jb; p++)
+            d_mat_entry(V, r, p) = (r < p) ? 0 : (r == p) ? 1
+                : d_mat_entry(W, j0 + r, j0 + p);
+}
+
+/*
+    Sets T to the upper triangular factor of the compact WY form
+    H_0 ... H_{k - 1} = I - V T V^T of the reflectors with vectors the
+    columns of V and coefficients tau.
+*/
+static void
+_d_mat_householder_T(d_mat_t T, const d_mat_t V, const double *tau)
+{
+    slong i, p, r, c;
+    double w;
+
+    d_mat_zero(T);
+    for (i = 0; i < V->c; i++)
+    {
+        d_mat_entry(T, i, i) = tau[i];
+
+        /* T[0:i, i] = -tau_i T[0:i, 0:i] V[:, 0:i]^T v_i */
+        for (p = 0; p < i; p++)
+        {
+            w = 0;
+            for (r = i; r < V->r; r++)
+                w += d_mat_entry(V, r, p) * d_mat_entry(V, r, i);
+            d_mat_entry(T, p, i) = w;
+        }
+        for (p = 0; p < i; p++)
+        {
+            w = 0;
+            for (c = p; c < i; c++)
+                w += d_mat_entry(T, p, c) * d_mat_entry(T, c, i);
+            d_mat_entry(T, p, i) = -tau[i] * w;
+        }
+    }
+}
+
+/*
+    Factors the panel of columns [j0, j0 + jb) of the column-major matrix W
+    in place with unblocked Householder QR, storing the coefficients in
+    tau[j0, j0 + jb).
+*/
+static void
+_d_mat_qr_householder_panel(d_mat_t W, double *tau, slong j0, slong jb)
+{
+    slong j, c, n;
+    double w, *v, *x;
+
+    for (j = j0; j < j0 + jb; j++)
+    {
+        n = W->r - j;
+        v = d_mat_col(W, j) + j;
+        tau[j] = _d_vec_householder(v, n);
+
+        for (c = j + 1; c < j0 + jb; c++)
+        {
+            x = d_mat_col(W, c) + j;
+            w = tau[j] * (x[0] + _d_vec_scalar_product(v + 1, x + 1, n - 1));
+            x[0] -= w;
+            _d_vec_scalar_submul(x + 1, v + 1, n - 1, w);
+        }
+    }
+}
+
+/*
+    Applies I - V T V^T (or its transpose if trans is set) from the left to
+    the block of B with rows [r0, B->r) and columns [c0, c1), using three
+    matrix products.
+*/
+static void
+_d_mat_apply_block_reflector(d_mat_t B, slong r0, slong c0, slong c1,
+                             const d_mat_t V, const d_mat_t T, int trans)
+{
+    d_mat_t C, Vt, Tt, Y, Z;
+    slong i, j, m, n, k;
+
+    m = B->r - r0;
+    n = c1 - c0;
+    k = V->c;
+
+    if (n <= 0 || k == 0)
+        return;
+
+    d_mat_window_init(C, B, r0, c0, B->r, c1);
+    d_mat_init(Vt, k, m);
+    d_mat_init(Tt, k, k);
+    d_mat_init(Y, k, n);
+    d_mat_init_layout(Z, m, n, B->layout);
+
+    for (i = 0; i < m; i++)
+        for (j = 0; j < k; j++)
+            d_mat_entry(Vt, j, i) = d_mat_entry(V, i, j);
+
+    for (i = 0; i < k; i++)
+        for (j = 0; j < k; j++)
+            d_mat_entry(Tt, i, j) = trans ? d_mat_entry(T, j, i)
+                                          : d_mat_entry(T, i, j);
+
+    d_mat_mul(Y, Vt, C);
+    d_mat_mul(Y, Tt, Y);
+    d_mat_mul(Z, V, Y);
+
+    if (B->layout == D_MAT_COL_MAJOR)
+        for (j = 0; j < n; j++)
+            _d_vec_sub(d_mat_col(C, j), d_mat_col(C, j), d_mat_col(Z, j), m);
+    else
+        for (i = 0; i < m; i++)
+            _d_vec_sub(C->rows[i], C->rows[i], Z->rows[i], n);
+
+    d_mat_window_clear(C);
+    d_mat_clear(Vt);
+    d_mat_clear(Tt);
+    d_mat_clear(Y);
+    d_mat_clear(Z);
+}
+
+
+/* As d_mat_qr_householder, but skips the computation of Q if it is NULL. */
+void
+_d_mat_qr_householder(d_mat_t Q, d_mat_t R, const d_mat_t A)
+{
+    d_mat_t W;
+    double *tau;
+    slong i, j, j0, jb, m, n, kmax;
+
+    m = A->r;
+    n = A->c;
+
+    if (m == 0 || n == 0)
+    {
+        /* with no rows R is still n x n, and A = Q R needs it zero */
+        d_mat_zero(R);
+        return;
+    }
+
+    kmax = FLINT_MIN(m, n);
+
+    d_mat_init_layout(W, m, n, D_MAT_COL_MAJOR);
+    d_mat_set(W, A);
+    tau = flint_malloc(kmax * sizeof(double));
+
+    for (j0 = 0; j0 < kmax; j0 += D_MAT_QR_HOUSEHOLDER_NB)
+    {
+        jb = FLINT_MIN(D_MAT_QR_HOUSEHOLDER_NB, kmax - j0);
+
+        _d_mat_qr_householder_panel(W, tau, j0, jb);
+
+        if (j0 + jb < n)
+        {
+            d_mat_t V, T;
+
+            d_mat_init(V, m - j0, jb);
+            d_mat_init(T, jb, jb);
+
+            _d_mat_householder_V(V, W, j0, jb);
+            _d_mat_householder_T(T, V, tau + j0);
+            _d_mat_apply_block_reflector(W, j0, j0 + jb, n, V, T, 1);
+
+            d_mat_clear(V);
+            d_mat_clear(T);
+        }
+    }
+
+    d_mat_zero(R);
+    for (i = 0; i < kmax; i++)
+        for (j = i; j < n; j++)
+            d_mat_entry(R, i, j) = d_mat_entry(W, i, j);
+
+    /* make the diagonal of R nonnegative, as for d_mat_qr */
+    for (i = 0; i < kmax; i++)
+    {
+        if (d_mat_entry(R, i, i) < 0)
+        {
+            for (j = i; j < n; j++)
+                d_mat_entry(R, i, j) = -d_mat_entry(R, i, j);
+        }
+    }
+
+    if (Q == NULL)
+    {
+        flint_free(tau);
+        d_mat_clear(W);
+        return;
+    }
+
+    /* accumulate the thin Q = H_0 ... H_{kmax - 1} [I; 0] backwards */
+    d_mat_zero(Q);
+    for (i = 0; i < kmax; i++)
+        d_mat_entry(Q, i, i) = 1;
+
+    for (j0 = ((kmax - 1) / D_MAT_QR_HOUSEHOLDER_NB) * D_MAT_QR_HOUSEHOLDER_NB;
+         j0 >= 0; j0 -= D_MAT_QR_HOUSEHOLDER_NB)
+    {
+        d_mat_t V, T;
+
+        jb = FLINT_MIN(D_MAT_QR_HOUSEHOLDER_NB, kmax - j0);
+
+        d_mat_init(V, m - j0, jb);
+        d_mat_init(T, jb, jb);
+
+        _d_mat_householder_V(V, W, j0, jb);
+        _d_mat_householder_T(T, V, tau + j0);
+        _d_mat_apply_block_reflector(Q, j0, j0, kmax, V, T, 0);
+
+        d_mat_clear(V);
+        d_mat_clear(T);
+    }
+
+    for (i = 0; i < kmax; i++)
+    {
+        if (d_mat_entry(W, i, i) < 0)
+        {
+            for (j = 0; j < m; j++)
+                d_mat_entry(Q, j, i) = -d_mat_entry(Q, j, i);
+        }
+    }
+
+    flint_free(tau);
+    d_mat_clear(W);
+}
+
+
+void
+d_mat_qr_householder(d_mat_t Q, d_mat_t R, const d_mat_t A)
+{
+    if (Q->r != A->r || Q->c != A->c || R->r != A->c || R->c != A->c)
+    {
+        flint_printf("Exception (d_mat_qr_householder). "
+                     "Incompatible dimensions.\n");
+        abort();
+    }
+
+    _d_mat_qr_householder(Q, R, A);
+}
+
+
+/*
+    Row block size of the leaves of TSQR. Every leaf has at least this many
+    rows (and at least A->c), and the leaves do not depend on the number of
+    threads, so neither does the result.
+*/
+#define D_MAT_QR_TSQR_BLOCK_ROWS 1024
+
+typedef struct
+{
+    d_mat_struct R;
+    d_mat_struct Q;
+    d_mat_struct M;
+    int pair;
+} d_mat_tsqr_node_struct;
+
+typedef struct
+{
+    const d_mat_struct * A;
+    d_mat_struct * Q;
+    d_mat_struct * Ql;
+    d_mat_tsqr_node_struct * prev;
+    d_mat_tsqr_node_struct * level;
+    slong prev_count;
+    const slong * start;
+} d_mat_tsqr_arg_struct;
+
+static void
+_d_mat_qr_tsqr_leaf(void * varg, slong i)
+{
+    d_mat_tsqr_arg_struct * arg = varg;
+    const d_mat_struct * A = arg->A;
+    d_mat_t Ai;
+
+    d_mat_window_init(Ai, A, arg->start[i], 0, arg->start[i + 1], A->c);
+
+    _d_mat_qr_householder(arg->Q == NULL ? NULL : arg->Ql + i,
+                          &arg->level[i].R, Ai);
+
+    d_mat_window_clear(Ai);
+}
+
+static void
+_d_mat_qr_tsqr_combine(void * varg, slong k)
+{
+    d_mat_tsqr_arg_struct * arg = varg;
+    d_mat_tsqr_node_struct * node = arg->level + k;
+    d_mat_struct * R0 = &arg->prev[2 * k].R;
+    slong n = R0->c, j;
+
+    if (2 * k + 1 < arg->prev_count)
+    {
+        d_mat_struct * R1 = &arg->prev[2 * k + 1].R;
+        d_mat_t S;
+
+        d_mat_init(S, 2 * n, n);
+        for (j = 0; j < n; j++)
+        {
+            _d_vec_set(S->rows[j], R0->rows[j], n);
+            _d_vec_set(S->rows[n + j], R1->rows[j], n);
+        }
+
+        node->pair = 1;
+        d_mat_init(&node->Q, 2 * n, n);
+        _d_mat_qr_householder(arg->Q == NULL ? NULL : &node->Q, &node->R, S);
+
+        d_mat_clear(S);
+    }
+    else
+    {
+        node->pair = 0;
+        d_mat_set(&node->R, R0);
+    }
+}
+
+static void
+_d_mat_qr_tsqr_leaf_q(void * varg, slong i)
+{
+    d_mat_tsqr_arg_struct * arg = varg;
+    d_mat_t Qi;
+
+    d_mat_window_init(Qi, arg->Q, arg->start[i], 0, arg->start[i + 1],
+                      arg->Q->c);
+    d_mat_mul(Qi, arg->Ql + i, &arg->level[i].M);
+    d_mat_window_clear(Qi);
+}
+
+/*
+    Tall-skinny QR: the rows of A are split into blocks of at least
+    block_rows rows which are factored independently, and the n x n R
+    factors are combined pairwise up a binary tree, each combination being
+    the QR factorisation of two stacked R factors. If Q is not NULL the thin
+    Q is rebuilt by pushing the small Q factors of the tree back down to the
+    leaves and multiplying each leaf Q by the product on its path.
+*/
+void
+_d_mat_qr_tsqr(d_mat_t Q, d_mat_t R, const d_mat_t A, slong block_rows)
+{
+    d_mat_tsqr_arg_struct arg;
+    d_mat_tsqr_node_struct ** levels;
+    d_mat_struct * Ql = NULL;
+    slong * start, * count;
+    slong m, n, leaves, depth, i, k, L;
+
+    m = A->r;
+    n = A->c;
+
+    if (m == 0 || n == 0)
+    {
+        /* with no rows R is still n x n, and A = Q R needs it zero */
+        d_mat_zero(R);
+        return;
+    }
+
+    block_rows = FLINT_MAX(block_rows, n);
+    leaves = m / block_rows;
+
+    if (leaves < 2)
+    {
+        _d_mat_qr_householder(Q, R, A);
+        return;
+    }
+
+    start = flint_malloc((leaves + 1) * sizeof(slong));
+    for (i = 0; i <= leaves; i++)
+        start[i] = (m * i) / leaves;
+
+    for (depth = 1, k = leaves; k > 1; k = (k + 1) / 2)
+        depth++;
+
+    count = flint_malloc(depth * sizeof(slong));
+    levels = flint_malloc(depth * sizeof(d_mat_tsqr_node_struct *));
+    for (L = 0, k = leaves; L < depth; L++, k = (k + 1) / 2)
+    {
+        count[L] = k;
+        levels[L] = flint_malloc(k * sizeof(d_mat_tsqr_node_struct));
+        for (i = 0; i < k; i++)
+        {
+            d_mat_init(&levels[L][i].R, n, n);
+            levels[L][i].pair = 0;
+        }
+    }
+
+    if (Q != NULL)
+    {
+        Ql = flint_malloc(leaves * sizeof(d_mat_struct));
+        for (i = 0; i < leaves; i++)
+            d_mat_init(Ql + i, start[i + 1] - start[i], n);
+    }
+
+    arg.A = A;
+    arg.Q = Q;
+    arg.Ql = Ql;
+    arg.start = start;
+    arg.level = levels[0];
+    thread_pool_parallel_for(leaves, _d_mat_qr_tsqr_leaf, &arg);
+
+    for (L = 1; L < depth; L++)
+    {
+        arg.prev = levels[L - 1];
+        arg.prev_count = count[L - 1];
+        arg.level = levels[L];
+        thread_pool_parallel_for(count[L], _d_mat_qr_tsqr_combine, &arg);
+    }
+
+    d_mat_set(R, &levels[depth - 1][0].R);
+
+    if (Q != NULL)
+    {
+        /* M is the n x n product of the tree Q factors above each node */
+        d_mat_tsqr_node_struct * top = &levels[depth - 1][0];
+
+        d_mat_init(&top->M, n, n);
+        d_mat_zero(&top->M);
+        for (i = 0; i < n; i++)
+            d_mat_entry(&top->M, i, i) = 1;
+
+        for (L = depth - 1; L > 0; L--)
+        {
+            for (k = 0; k < count[L]; k++)
+            {
+                d_mat_tsqr_node_struct * node = &levels[L][k];
+                d_mat_struct * M0 = &levels[L - 1][2 * k].M;
+
+                d_mat_init(M0, n, n);
+
+                if (node->pair)
+                {
+                    d_mat_struct * M1 = &levels[L - 1][2 * k + 1].M;
+                    d_mat_t H;
+
+                    d_mat_init(M1, n, n);
+
+                    d_mat_window_init(H, &node->Q, 0, 0, n, n);
+                    d_mat_mul(M0, H, &node->M);
+                    d_mat_window_clear(H);
+                    d_mat_window_init(H, &node->Q, n, 0, 2 * n, n);
+                    d_mat_mul(M1, H, &node->M);
+                    d_mat_window_clear(H);
+                }
+                else
+                {
+                    d_mat_set(M0, &node->M);
+                }
+            }
+        }
+
+        arg.level = levels[0];
+        thread_pool_parallel_for(leaves, _d_mat_qr_tsqr_leaf_q, &arg);
+
+        for (L = 0; L < depth; L++)
+            for (k = 0; k < count[L]; k++)
+                d_mat_clear(&levels[L][k].M);
+
+        for (i = 0; i < leaves; i++)
+            d_mat_clear(Ql + i);
+        flint_free(Ql);
+    }
+
+    for (L = 0; L < depth; L++)
+    {
+        for (k = 0; k < count[L]; k++)
+        {
+            d_mat_clear(&levels[L][k].R);
+            if (levels[L][k].pair)
+                d_mat_clear(&levels[L][k].Q);
+        }
+        flint_free(levels[L]);
+    }
+
+    flint_free(levels);
+    flint_free(count);
+    flint_free(start);
+}
+
+
+/*
+    Computes the thin QR factorisation of A with TSQR, intended for A with
+    many more rows than columns. Q may be NULL, in which case only R is
+    computed.
+*/
+void
+d_mat_qr_tsqr(d_mat_t Q, d_mat_t R, const d_mat_t A)
+{
+    if ((Q != NULL && (Q->r != A->r || Q->c != A->c))
+        || R->r != A->c || R->c != A->c)
+    {
+        flint_printf("Exception (d_mat_qr_tsqr). Incompatible dimensions.\n");
+        abort();
+    }
+
+    _d_mat_qr_tsqr(Q, R, A, D_MAT_QR_TSQR_BLOCK_ROWS);
+}
+
+
+/*
+    Matrices with at least this many columns (and at least as many rows as
+    columns) are factored by blocked Householder QR instead of modified
+    Gram-Schmidt.
+*/
+#define D_MAT_QR_HOUSEHOLDER_CUTOFF 64
+
+/* Matrices with at least this many times more rows than columns use TSQR. */
+#define D_MAT_QR_TSQR_RATIO 16
+
+void
+d_mat_qr(d_mat_t Q, d_mat_t R, const d_mat_t A)
+{
+    if (A->r >= 2 * D_MAT_QR_TSQR_BLOCK_ROWS
+        && A->r >= D_MAT_QR_TSQR_RATIO * A->c)
+        d_mat_qr_tsqr(Q, R, A);
+    else if (A->c >= D_MAT_QR_HOUSEHOLDER_CUTOFF && A->r >= A->c)
+        d_mat_qr_householder(Q, R, A);
+    else
+        d_mat_qr_mgs(Q, R, A);
+}
+
+
+/*
+    Incremental Gram-Schmidt data of a sequence of m vectors of length n,
+    for algorithms that change a basis a little between two queries. b[i] is
+    the i-th vector, r[i] = |b*_i|^2 and mu[i][j] = <b_i, b*_j> / r[j] for
+    j < i, taken to be 0 when r[j] = 0. This is the double counterpart of
+    fmpq_gso_t in gso.c and is updated with the same formulas; the b*_i are
+    only formed by d_gso_get_mat. Rows of mu have room for alloc entries,
+    so that moving a vector only exchanges pointers.
+
+    d_gso_set_d_mat runs the Gram-Schmidt loop of d_mat_qr_mgs, so right
+    after it every query returns what a full recomputation returns. The
+    updates are exact in exact arithmetic; in double precision each adds a
+    rounding error of the order of D_EPS times the condition of the
+    vectors, and a caller that has made many of them on an ill-conditioned
+    basis should call d_gso_set_d_mat again.
+*/
+typedef struct
+{
+    double **b;
+    double **mu;
+    double *r;
+    slong n;
+    slong m;
+    slong alloc;
+} d_gso_struct;
+
+typedef d_gso_struct d_gso_t[1];
+
+#define d_gso_mu(G, i, j) ((G)->mu[i][j])
+#define d_gso_r(G, i) ((G)->r[i])
+#define d_gso_vec(G, i) ((G)->b[i])
+
+
+void
+d_gso_init(d_gso_t G, slong n)
+{
+    G->b = NULL;
+    G->mu = NULL;
+    G->r = NULL;
+    G->n = n;
+    G->m = 0;
+    G->alloc = 0;
+}
+
+
+void
+d_gso_clear(d_gso_t G)
+{
+    slong i;
+
+    for (i = 0; i < G->alloc; i++)
+    {
+        _d_mat_aligned_free(G->b[i]);
+        flint_free(G->mu[i]);
+    }
+
+    flint_free(G->b);
+    flint_free(G->mu);
+    flint_free(G->r);
+}
+
+
+static void
+_d_gso_fit_length(d_gso_t G, slong m)
+{
+    slong i, alloc;
+
+    if (m <= G->alloc)
+        return;
+
+    alloc = FLINT_MAX(m, 2 * G->alloc);
+
+    G->b = flint_realloc(G->b, alloc * sizeof(double *));
+    G->mu = flint_realloc(G->mu, alloc * sizeof(double *));
+    G->r = flint_realloc(G->r, alloc * sizeof(double));
+
+    for (i = 0; i < G->alloc; i++)
+        G->mu[i] = flint_realloc(G->mu[i], alloc * sizeof(double));
+
+    for (i = G->alloc; i < alloc; i++)
+    {
+        G->b[i] = _d_mat_aligned_alloc(FLINT_MAX(G->n, 1) * sizeof(double));
+        G->mu[i] = flint_calloc(alloc, sizeof(double));
+    }
+
+    G->alloc = alloc;
+}
+
+
+/*
+    Exchanges the vectors k and k + 1 in O(m) operations, with the formulas
+    of fmpq_gso_swap (Cohen, Algorithm 2.6.3).
+*/
+void
+d_gso_swap(d_gso_t G, slong k)
+{
+    slong i, l = k + 1;
+    double mu, B, t, *p;
+
+    if (k < 0 || l >= G->m)
+    {
+        flint_printf("Exception (d_gso_swap). Index out of range.\n");
+        abort();
+    }
+
+    mu = G->mu[l][k];
+    B = G->r[l] + mu * mu * G->r[k];
+
+    p = G->b[k]; G->b[k] = G->b[l]; G->b[l] = p;
+    p = G->mu[k]; G->mu[k] = G->mu[l]; G->mu[l] = p;
+    G->mu[k][k] = 0;
+
+    if (B == 0)
+    {
+        t = G->r[k]; G->r[k] = G->r[l]; G->r[l] = t;
+        G->mu[l][k] = 0;
+        for (i = l + 1; i < G->m; i++)
+        {
+            t = G->mu[i][k];
+            G->mu[i][k] = G->mu[i][l];
+            G->mu[i][l] = t;
+        }
+        return;
+    }
+
+    G->mu[l][k] = mu * G->r[k] / B;
+    G->r[l] = G->r[k] * G->r[l] / B;
+    G->r[k] = B;
+
+    for (i = l + 1; i < G->m; i++)
+    {
+        t = G->mu[i][l];
+        G->mu[i][l] = G->mu[i][k] - mu * t;
+        G->mu[i][k] = t + G->mu[l][k] * G->mu[i][l];
+    }
+
+    if (G->r[l] == 0)
+        for (i = l + 1; i < G->m; i++)
+            G->mu[i][l] = 0;
+}
+
+
+/* Replaces vector k by b_k - q b_j for j < k, in O(n + j) operations. */
+void
+d_gso_size_reduce(d_gso_t G, slong k, slong j, double q)
+{
+    slong i;
+
+    if (j < 0 || j >= k || k >= G->m)
+    {
+        flint_printf("Exception (d_gso_size_reduce). Index out of range.\n");
+        abort();
+    }
+
+    _d_vec_scalar_submul(G->b[k], G->b[j], G->n, q);
+
+    for (i = 0; i < j; i++)
+        G->mu[k][i] -= q * G->mu[j][i];
+
+    if (G->r[j] != 0)
+        G->mu[k][j] -= q;
+}
+
+
+/*
+    Appends v in O(n m + m^2) operations, from the scalar products of v
+    with the vectors as in _fmpq_gso_append.
+*/
+static void
+_d_gso_append(d_gso_t G, const double *v)
+{
+    slong i, j, m = G->m;
+    double *s;
+
+    _d_gso_fit_length(G, m + 1);
+    s = G->mu[m];
+
+    _d_vec_set(G->b[m], v, G->n);
+
+    for (j = 0; j < m; j++)
+    {
+        s[j] = _d_vec_scalar_product(v, G->b[j], G->n);
+        for (i = 0; i < j; i++)
+            s[j] -= G->mu[j][i] * s[i];
+    }
+
+    G->r[m] = _d_vec_norm(v, G->n);
+
+    for (j = 0; j < m; j++)
+    {
+        if (G->r[j] == 0)
+            s[j] = 0;
+        else
+        {
+            G->r[m] -= s[j] * (s[j] / G->r[j]);
+            s[j] /= G->r[j];
+        }
+    }
+
+    /* cancellation may leave a tiny negative value for dependent vectors */
+    if (G->r[m] < 0)
+        G->r[m] = 0;
+
+    G->m = m + 1;
+}
+
+
+/* Inserts v before vector k (0 <= k <= m) by appending it and swapping. */
+void
+d_gso_insert(d_gso_t G, slong k, const double *v)
+{
+    slong i;
+
+    if (k < 0 || k > G->m)
+    {
+        flint_printf("Exception (d_gso_insert). Index out of range.\n");
+        abort();
+    }
+
+    _d_gso_append(G, v);
+
+    for (i = G->m - 2; i >= k; i--)
+        d_gso_swap(G, i);
+}
+
+
+/* Removes vector k by swapping it to the end. */
+void
+d_gso_delete(d_gso_t G, slong k)
+{
+    slong i;
+
+    if (k < 0 || k >= G->m)
+    {
+        flint_printf("Exception (d_gso_delete). Index out of range.\n");
+        abort();
+    }
+
+    for (i = k; i < G->m - 1; i++)
+        d_gso_swap(G, i);
+
+    G->m--;
+}
+
+
+/* Sets G to the columns of A, which must have n rows. */
+void
+d_gso_set_d_mat(d_gso_t G, const d_mat_t A)
+{
+    d_mat_t W, R;
+    slong i, j;
+
+    if (A->r != G->n)
+    {
+        flint_printf("Exception (d_gso_set_d_mat). Incompatible dimensions.\n");
+        abort();
+    }
+
+    _d_gso_fit_length(G, A->c);
+    G->m = A->c;
+
+    if (A->c == 0)
+        return;
+
+    d_mat_init_layout(W, A->r, A->c, D_MAT_COL_MAJOR);
+    d_mat_init(R, A->c, A->c);
+    d_mat_set(W, A);
+    d_mat_zero(R);
+
+    for (j = 0; j < A->c; j++)
+        for (i = 0; i < A->r; i++)
+            G->b[j][i] = d_mat_entry(W, i, j);
+
+    if (A->r != 0)
+        _d_mat_gso(W, R);
+
+    for (i = 0; i < A->c; i++)
+    {
+        G->r[i] = d_mat_entry(R, i, i) * d_mat_entry(R, i, i);
+        for (j = 0; j < i; j++)
+            G->mu[i][j] = (d_mat_entry(R, j, j) == 0) ? 0 :
+                          d_mat_entry(R, j, i) / d_mat_entry(R, j, j);
+    }
+
+    d_mat_clear(W);
+    d_mat_clear(R);
+}
+
+
+/*
+    Sets the columns of the n x m matrix B to the normalised b*_i, zero when
+    r[i] = 0, which is what d_mat_gso returns for the matrix with columns
+    b_0, ..., b_{m-1}.
+*/
+void
+d_gso_get_mat(d_mat_t B, const d_gso_t G)
+{
+    d_mat_t W;
+    slong i, j;
+    double s;
+
+    if (B->r != G->n || B->c != G->m)
+    {
+        flint_printf("Exception (d_gso_get_mat). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (G->n == 0 || G->m == 0)
+        return;
+
+    /* b*_i = b_i - sum_j mu[i][j] sqrt(r[j]) q_j, q_j normalised */
+    d_mat_init_layout(W, G->n, G->m, D_MAT_COL_MAJOR);
+
+    for (i = 0; i < G->m; i++)
+    {
+        _d_vec_set(d_mat_col(W, i), G->b[i], G->n);
+        for (j = 0; j < i; j++)
+            if (G->mu[i][j] != 0)
+                _d_vec_scalar_submul(d_mat_col(W, i), d_mat_col(W, j), G->n,
+                                     G->mu[i][j] * sqrt(G->r[j]));
+        s = G->r[i] == 0 ? 0 : 1 / sqrt(_d_vec_norm(d_mat_col(W, i), G->n));
+        _d_vec_scalar_mul(d_mat_col(W, i), d_mat_col(W, i), G->n, s);
+    }
+
+    d_mat_set(B, W);
+    d_mat_clear(W);
+}
+
+
+/*
+    A batch of count matrices of the same shape r x c, for factoring many
+    small matrices at once. The matrices are interleaved in groups of
+    D_MAT_BATCH_LANES: each group is stored column-major, and each of its
+    entries is a run of D_MAT_BATCH_LANES doubles, one per matrix, so that
+    the kernels below operate on a whole group with vector instructions,
+    every lane handling a different matrix. The last group is padded with
+    zero matrices.
+*/
+#define D_MAT_BATCH_LANES 8
+
+typedef struct
+{
+    double *entries;
+    slong count;
+    slong r;
+    slong c;
+} d_mat_batch_struct;
+
+typedef d_mat_batch_struct d_mat_batch_t[1];
+
+#define _d_mat_batch_groups(B)                                      \
+    (((B)->count + D_MAT_BATCH_LANES - 1) / D_MAT_BATCH_LANES)
+
+#define _d_mat_batch_group(B, g)                                    \
+    ((B)->entries + (g) * (B)->r * (B)->c * D_MAT_BATCH_LANES)
+
+#define d_mat_batch_entry(B, k, i, j)                               \
+    (_d_mat_batch_group(B, (k) / D_MAT_BATCH_LANES)                 \
+     [((j) * (B)->r + (i)) * D_MAT_BATCH_LANES + (k) % D_MAT_BATCH_LANES])
+
+
+void
+d_mat_batch_init(d_mat_batch_t B, slong count, slong rows, slong cols)
+{
+    slong len = ((count + D_MAT_BATCH_LANES - 1) / D_MAT_BATCH_LANES)
+                * D_MAT_BATCH_LANES * rows * cols;
+
+    B->entries = NULL;
+    if (len != 0)
+    {
+        B->entries = _d_mat_aligned_alloc(len * sizeof(double));
+        memset(B->entries, 0, len * sizeof(double));
+    }
+    B->count = count;
+    B->r = rows;
+    B->c = cols;
+}
+
+
+void
+d_mat_batch_clear(d_mat_batch_t B)
+{
+    if (B->entries)
+        _d_mat_aligned_free(B->entries);
+}
+
+
+/* Sets matrix k of the batch B to A. */
+void
+d_mat_batch_set_d_mat(d_mat_batch_t B, slong k, const d_mat_t A)
+{
+    slong i, j;
+
+    if (A->r != B->r || A->c != B->c || k < 0 || k >= B->count)
+    {
+        flint_printf("Exception (d_mat_batch_set_d_mat). Incompatible dimensions.\n");
+        abort();
+    }
+
+    for (j = 0; j < A->c; j++)
+        for (i = 0; i < A->r; i++)
+            d_mat_batch_entry(B, k, i, j) = d_mat_entry(A, i, j);
+}
+
+
+/* Sets A to matrix k of the batch B. */
+void
+d_mat_batch_get_d_mat(d_mat_t A, const d_mat_batch_t B, slong k)
+{
+    slong i, j;
+
+    if (A->r != B->r || A->c != B->c || k < 0 || k >= B->count)
+    {
+        flint_printf("Exception (d_mat_batch_get_d_mat). Incompatible dimensions.\n");
+        abort();
+    }
+
+    for (j = 0; j < A->c; j++)
+        for (i = 0; i < A->r; i++)
+            d_mat_entry(A, i, j) = d_mat_batch_entry(B, k, i, j);
+}
+
+
+/*
+    The loop of _d_mat_gso on a group of D_MAT_BATCH_LANES m x n matrices,
+    in place on the group w and, if it is not NULL, adding the coefficients
+    to the zeroed group R of n x n matrices; t has room for 2 n entries. Every
+    lane takes its own number of reorthogonalisation passes: a lane that is
+    done keeps taking part with coefficients of zero, which leaves it
+    unchanged. The sums run over the rows in order, so a lane does not
+    round exactly as the blocked _d_vec kernels do.
+
+    An entry of a group is one GCC vector of D_MAT_BATCH_LANES doubles. The
+    body is always inlined into the versions below, each compiled for its
+    own instruction set.
+*/
+typedef double d_mat_batch_vec
+    __attribute__((vector_size(D_MAT_BATCH_LANES * sizeof(double))));
+typedef slong d_mat_batch_mask
+    __attribute__((vector_size(D_MAT_BATCH_LANES * sizeof(double))));
+
+static inline __attribute__((always_inline)) int
+_d_mat_batch_any(d_mat_batch_mask a)
+{
+    slong l, r = 0;
+
+    for (l = 0; l < D_MAT_BATCH_LANES; l++)
+        r |= a[l];
+
+    return r != 0;
+}
+
+/*
+    Sets c[j] to the scalar product of v with the j-th of the four vectors
+    of length m starting at w, or only c[0] if m is given negated.
+*/
+static inline __attribute__((always_inline)) void
+_d_mat_batch_dot4(d_mat_batch_vec *c, const d_mat_batch_vec *v,
+                  const d_mat_batch_vec *w, slong m)
+{
+    d_mat_batch_vec c0, c1, c2, c3;
+    slong h;
+
+    c0 = c1 = c2 = c3 = (d_mat_batch_vec) { 0 };
+
+    if (m < 0)
+    {
+        m = -m;
+        for (h = 0; h + 2 <= m; h += 2)
+        {
+            c0 += v[h] * w[h];
+            c1 += v[h + 1] * w[h + 1];
+        }
+        if (h < m)
+            c0 += v[h] * w[h];
+        c[0] = c0 + c1;
+        return;
+    }
+
+    for (h = 0; h < m; h++)
+    {
+        c0 += v[h] * w[h];
+        c1 += v[h] * w[h + m];
+        c2 += v[h] * w[h + 2 * m];
+        c3 += v[h] * w[h + 3 * m];
+    }
+
+    c[0] = c0;
+    c[1] = c1;
+    c[2] = c2;
+    c[3] = c3;
+}
+
+static inline __attribute__((always_inline)) void
+_d_mat_batch_gso_group(double *wd, double *Rd, double *td, slong m, slong n)
+{
+    d_mat_batch_vec *w = (d_mat_batch_vec *) wd, *R = (d_mat_batch_vec *) Rd;
+    d_mat_batch_vec *t = (d_mat_batch_vec *) td, *wk, *wi;
+    d_mat_batch_vec *u = t + n;
+    d_mat_batch_vec s, tk, s2, c, c1, c2, c3, zero = { 0 };
+    d_mat_batch_mask act;
+    slong i, k, h, l;
+
+    for (k = 0; k < n; k++)
+        t[k] = zero;
+
+    for (k = 0; k < n; k++)
+    {
+        wk = w + k * m;
+
+        _d_mat_batch_dot4(&s, wk, wk, -m);
+        tk = t[k] + s;
+        act = (s < tk);
+
+        while (_d_mat_batch_any(act))
+        {
+            /* lanes with s * D_EPS == 0 stop with s = 0 */
+            d_mat_batch_mask z = act & (s * D_EPS == zero);
+            s = (d_mat_batch_vec) ((d_mat_batch_mask) s & ~z);
+            act &= ~z;
+            if (!_d_mat_batch_any(act))
+                break;
+
+            /*
+                The coefficients of this pass are all taken against the same
+                wk, as in classical Gram-Schmidt, which gives independent
+                sums; after the first pass this is as accurate as MGS.
+            */
+            for (i = 0; i + 4 <= k; i += 4)
+                _d_mat_batch_dot4(u + i, wk, w + i * m, m);
+            for ( ; i < k; i++)
+                _d_mat_batch_dot4(u + i, wk, w + i * m, -m);
+
+            s2 = zero;
+            for (i = 0; i < k; i++)
+            {
+                u[i] = (d_mat_batch_vec) ((d_mat_batch_mask) u[i] & act);
+                s2 += u[i] * u[i];
+                if (R != NULL)
+                    R[k * n + i] += u[i];
+            }
+
+            for (i = 0; i + 4 <= k; i += 4)
+            {
+                d_mat_batch_vec *w0 = w + i * m, *w1 = w0 + m;
+                d_mat_batch_vec *w2 = w1 + m, *w3 = w2 + m;
+
+                for (h = 0; h < m; h++)
+                    wk[h] -= u[i] * w0[h] + u[i + 1] * w1[h]
+                           + u[i + 2] * w2[h] + u[i + 3] * w3[h];
+            }
+            for ( ; i < k; i++)
+            {
+                wi = w + i * m;
+                for (h = 0; h < m; h++)
+                    wk[h] -= u[i] * wi[h];
+            }
+
+            _d_mat_batch_dot4(&c, wk, wk, -m);
+
+            /* s = new squared norm, tk = with the squared coefficients */
+            s = (d_mat_batch_vec) (((d_mat_batch_mask) c & act)
+                                   | ((d_mat_batch_mask) s & ~act));
+            tk = (d_mat_batch_vec) (((d_mat_batch_mask) (s2 + c) & act)
+                                    | ((d_mat_batch_mask) tk & ~act));
+            act &= (s < tk);
+        }
+
+        for (l = 0; l < D_MAT_BATCH_LANES; l++)
+        {
+            s[l] = sqrt(s[l]);
+            c[l] = (s[l] != 0) ? 1 / s[l] : 0;
+        }
+        if (R != NULL)
+            R[k * n + k] = s;
+        for (h = 0; h < m; h++)
+            wk[h] *= c;
+
+        /*
+            Project the later columns once against column k, four at a time
+            so that there are four independent sums to interleave.
+        */
+        for (i = k + 1; i + 4 <= n; i += 4)
+        {
+            d_mat_batch_vec *w0 = w + i * m, *w1 = w0 + m;
+            d_mat_batch_vec *w2 = w1 + m, *w3 = w2 + m;
+
+            _d_mat_batch_dot4(u, wk, w0, m);
+            c = u[0];
+            c1 = u[1];
+            c2 = u[2];
+            c3 = u[3];
+
+            t[i] += c * c;
+            t[i + 1] += c1 * c1;
+            t[i + 2] += c2 * c2;
+            t[i + 3] += c3 * c3;
+            if (R != NULL)
+            {
+                R[i * n + k] = c;
+                R[(i + 1) * n + k] = c1;
+                R[(i + 2) * n + k] = c2;
+                R[(i + 3) * n + k] = c3;
+            }
+
+            for (h = 0; h < m; h++)
+            {
+                w0[h] -= c * wk[h];
+                w1[h] -= c1 * wk[h];
+                w2[h] -= c2 * wk[h];
+                w3[h] -= c3 * wk[h];
+            }
+        }
+
+        for ( ; i < n; i++)
+        {
+            wi = w + i * m;
+
+            _d_mat_batch_dot4(&c, wk, wi, -m);
+            t[i] += c * c;
+            if (R != NULL)
+                R[i * n + k] = c;
+
+            for (h = 0; h < m; h++)
+                wi[h] -= c * wk[h];
+        }
+    }
+}
+
+#ifdef D_HAVE_X86
+
+__attribute__((target("avx512f")))
+static void
+_d_mat_batch_gso_group_avx512(double *w, double *R, double *t, slong m, slong n)
+{
+    _d_mat_batch_gso_group(w, R, t, m, n);
+}
+
+__attribute__((target("avx2,fma")))
+static void
+_d_mat_batch_gso_group_avx2(double *w, double *R, double *t, slong m, slong n)
+{
+    _d_mat_batch_gso_group(w, R, t, m, n);
+}
+
+#endif
+
+static void
+_d_mat_batch_gso_group_generic(double *w, double *R, double *t, slong m, slong n)
+{
+    _d_mat_batch_gso_group(w, R, t, m, n);
+}
+
+typedef struct
+{
+    const d_mat_batch_struct * A;
+    d_mat_batch_struct * W;
+    d_mat_batch_struct * R;
+    slong chunk;
+} d_mat_batch_arg_struct;
+
+/*
+    Factors the groups of chunk i of a batch, copying each group from A and
+    zeroing its R while it is in cache.
+*/
+static void
+_d_mat_batch_gso_chunk(void * varg, slong i)
+{
+    d_mat_batch_arg_struct * arg = varg;
+    d_mat_batch_struct * W = arg->W, * R = arg->R;
+    slong g, g1, m = W->r, n = W->c;
+    double *t;
+
+    t = _d_mat_aligned_alloc(2 * FLINT_MAX(n, 1) * D_MAT_BATCH_LANES
+                             * sizeof(double));
+
+    g1 = FLINT_MIN((i + 1) * arg->chunk, _d_mat_batch_groups(W));
+    for (g = i * arg->chunk; g < g1; g++)
+    {
+        double *w = _d_mat_batch_group(W, g);
+        double *r = NULL;
+
+        if (W != arg->A)
+            memcpy(w, _d_mat_batch_group(arg->A, g),
+                   m * n * D_MAT_BATCH_LANES * sizeof(double));
+
+        if (R != NULL)
+        {
+            r = _d_mat_batch_group(R, g);
+            memset(r, 0, n * n * D_MAT_BATCH_LANES * sizeof(double));
+        }
+
+#ifdef D_HAVE_X86
+        if (_d_cpu_level() == D_CPU_AVX512)
+            _d_mat_batch_gso_group_avx512(w, r, t, m, n);
+        else if (_d_cpu_level() == D_CPU_AVX2)
+            _d_mat_batch_gso_group_avx2(w, r, t, m, n);
+        else
+#endif
+            _d_mat_batch_gso_group_generic(w, r, t, m, n);
+    }
+
+    _d_mat_aligned_free(t);
+}
+
+/* Groups per task handed to the thread pool. */
+#define D_MAT_BATCH_CHUNK 64
+
+static void
+_d_mat_batch_gso(d_mat_batch_t W, d_mat_batch_t R, const d_mat_batch_t A)
+{
+    d_mat_batch_arg_struct arg;
+    slong groups = _d_mat_batch_groups(W);
+
+    arg.A = A;
+    arg.W = W;
+    arg.R = R;
+    arg.chunk = D_MAT_BATCH_CHUNK;
+
+    thread_pool_parallel_for((groups + arg.chunk - 1) / arg.chunk,
+                             _d_mat_batch_gso_chunk, &arg);
+}
+
+
+/*
+    Sets every matrix of the batch B to d_mat_gso of the corresponding
+    matrix of A. B may be A.
+*/
+void
+d_mat_batch_gso(d_mat_batch_t B, const d_mat_batch_t A)
+{
+    if (B->count != A->count || B->r != A->r || B->c != A->c)
+    {
+        flint_printf("Exception (d_mat_batch_gso). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (A->r == 0 || A->c == 0 || A->count == 0)
+        return;
+
+    _d_mat_batch_gso(B, NULL, A);
+}
+
+
+/*
+    Sets every matrix of the batches Q and R to the factors of d_mat_qr_mgs
+    of the corresponding matrix of A. Q may be A.
+*/
+void
+d_mat_batch_qr(d_mat_batch_t Q, d_mat_batch_t R, const d_mat_batch_t A)
+{
+    if (Q->count != A->count || Q->r != A->r || Q->c != A->c
+        || R->count != A->count || R->r != A->c || R->c != A->c)
+    {
+        flint_printf("Exception (d_mat_batch_qr). Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (A->r == 0 || A->c == 0 || A->count == 0)
+        return;
+
+    _d_mat_batch_gso(Q, R, A);
+}
+
+
+/*
+    Fixed-size matrices. D_MAT_FIXED_DEFINE(m, n) defines d_mat_mxn_t, an
+    m x n matrix held by value in a column-major array, which can live on
+    the stack, with multiplication by the n x n type and the Gram-Schmidt
+    and QR routines of d_mat_gso and d_mat_qr_mgs, and conversions from
+    and to d_mat_t. The routines are thin wrappers around the always
+    inlined kernels below, so they are compiled with the dimensions as
+    constants, and the loops over rows and columns are fully unrolled.
+    The n x n type must be defined before the m x n one.
+*/
+#define d_mat_fixed_entry(A, i, j) ((A)->e[j][i])
+
+/* C = A B, for column-major arrays, with no aliasing. */
+static inline __attribute__((always_inline)) void
+_d_mat_fixed_mul(double *C, const double *A, const double *B,
+                 slong m, slong l, slong n)
+{
+    slong i, j, k;
+
+#pragma GCC unroll 16
+    for (j = 0; j < n; j++)
+    {
+#pragma GCC unroll 16
+        for (i = 0; i < m; i++)
+            C[j * m + i] = A[i] * B[j * l];
+#pragma GCC unroll 16
+        for (k = 1; k < l; k++)
+#pragma GCC unroll 16
+            for (i = 0; i < m; i++)
+                C[j * m + i] += A[k * m + i] * B[j * l + k];
+    }
+}
+
+/*
+    The loop of _d_mat_gso on the columns of the column-major m x n array W,
+    storing the coefficients in the zeroed n x n array R if it is not NULL.
+    t is scratch space for n doubles, declared by the caller, whose n is a
+    constant.
+*/
+static inline __attribute__((always_inline)) void
+_d_mat_fixed_gso(double *W, double *R, double *t, slong m, slong n)
+{
+    double s, tk, c, *wk, *wi;
+    slong i, k, h;
+
+#pragma GCC unroll 16
+    for (k = 0; k < n; k++)
+        t[k] = 0;
+
+#pragma GCC unroll 16
+    for (k = 0; k < n; k++)
+    {
+        wk = W + k * m;
+
+        s = 0;
+#pragma GCC unroll 16
+        for (h = 0; h < m; h++)
+            s += wk[h] * wk[h];
+
+        tk = t[k] + s;
+        while (s < tk)
+        {
+            if (s * D_EPS == 0)
+            {
+                s = 0;
+                break;
+            }
+            tk = 0;
+#pragma GCC unroll 16
+            for (i = 0; i < k; i++)
+            {
+                wi = W + i * m;
+                c = 0;
+#pragma GCC unroll 16
+                for (h = 0; h < m; h++)
+                    c += wi[h] * wk[h];
+                if (R != NULL)
+                    R[k * n + i] += c;
+                tk += c * c;
+#pragma GCC unroll 16
+                for (h = 0; h < m; h++)
+                    wk[h] -= c * wi[h];
+            }
+            s = 0;
+#pragma GCC unroll 16
+            for (h = 0; h < m; h++)
+                s += wk[h] * wk[h];
+            tk += s;
+        }
+
+        s = sqrt(s);
+        if (R != NULL)
+            R[k * n + k] = s;
+        c = (s != 0) ? 1 / s : 0;
+#pragma GCC unroll 16
+        for (h = 0; h < m; h++)
+            wk[h] *= c;
+
+#pragma GCC unroll 16
+        for (i = k + 1; i < n; i++)
+        {
+            wi = W + i * m;
+            c = 0;
+#pragma GCC unroll 16
+            for (h = 0; h < m; h++)
+                c += wk[h] * wi[h];
+            if (R != NULL)
+                R[i * n + k] = c;
+            t[i] += c * c;
+#pragma GCC unroll 16
+            for (h = 0; h < m; h++)
+                wi[h] -= c * wk[h];
+        }
+    }
+}
+
+#define D_MAT_FIXED_DEFINE(m, n)                                            \
+                                                                            \
+typedef struct                                                              \
+{                                                                           \
+    double e[n][m];                                                         \
+} d_mat_##m##x##n##_struct;                                                 \
+                                                                            \
+typedef d_mat_##m##x##n##_struct d_mat_##m##x##n##_t[1];                    \
+                                                                            \
+static inline void                                                          \
+d_mat_##m##x##n##_set_d_mat(d_mat_##m##x##n##_t B, const d_mat_t A)         \
+{                                                                           \
+    slong i, j;                                                             \
+    if (A->r != m || A->c != n)                                             \
+    {                                                                       \
+        flint_printf("Exception (d_mat_" #m "x" #n "_set_d_mat). "          \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+    for (j = 0; j < n; j++)                                                 \
+        for (i = 0; i < m; i++)                                             \
+            B->e[j][i] = d_mat_entry(A, i, j);                              \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+d_mat_##m##x##n##_get_d_mat(d_mat_t A, const d_mat_##m##x##n##_t B)         \
+{                                                                           \
+    slong i, j;                                                             \
+    if (A->r != m || A->c != n)                                             \
+    {                                                                       \
+        flint_printf("Exception (d_mat_" #m "x" #n "_get_d_mat). "          \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+    for (j = 0; j < n; j++)                                                 \
+        for (i = 0; i < m; i++)                                             \
+            d_mat_entry(A, i, j) = B->e[j][i];                              \
+}                                                                           \
+                                                                            \
+/* C = A B; C may alias A or B. */                                          \
+static inline void                                                          \
+d_mat_##m##x##n##_mul(d_mat_##m##x##n##_t C, const d_mat_##m##x##n##_t A,   \
+                      const d_mat_##n##x##n##_t B)                          \
+{                                                                           \
+    d_mat_##m##x##n##_t T;                                                  \
+    _d_mat_fixed_mul(T->e[0], A->e[0], B->e[0], m, n, n);                   \
+    *C = *T;                                                                \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+d_mat_##m##x##n##_gso(d_mat_##m##x##n##_t B, const d_mat_##m##x##n##_t A)   \
+{                                                                           \
+    double t[n];                                                            \
+    *B = *A;                                                                \
+    _d_mat_fixed_gso(B->e[0], NULL, t, m, n);                               \
+}                                                                           \
+                                                                            \
+static inline void                                                          \
+d_mat_##m##x##n##_qr(d_mat_##m##x##n##_t Q, d_mat_##n##x##n##_t R,          \
+                     const d_mat_##m##x##n##_t A)                           \
+{                                                                           \
+    double t[n];                                                            \
+    *Q = *A;                                                                \
+    memset(R, 0, sizeof(d_mat_##n##x##n##_struct));                         \
+    _d_mat_fixed_gso(Q->e[0], R->e[0], t, m, n);                            \
+}
+
+D_MAT_FIXED_DEFINE(2, 2)
+D_MAT_FIXED_DEFINE(3, 3)
+D_MAT_FIXED_DEFINE(4, 4)
+D_MAT_FIXED_DEFINE(6, 6)
+D_MAT_FIXED_DEFINE(8, 8)
+D_MAT_FIXED_DEFINE(3, 2)
+D_MAT_FIXED_DEFINE(4, 3)
+D_MAT_FIXED_DEFINE(8, 4)
+
+
+/*
+    Matrices over other floating point types: s_mat_t has float entries,
+    for half the memory traffic and twice the SIMD width of d_mat_t when
+    approximate results suffice, and q_mat_t has __float128 entries (long
+    double where the compiler has no __float128), for when Gram-Schmidt
+    in double loses too much to cancellation. Both are column-major with
+    the padded leading dimension of d_mat_t, and convert to and from
+    d_mat_t.
+
+    The vector kernels are written for each type; the matrix routines are
+    generated from them by D_MAT_SCALAR_DEFINE, and follow d_mat_mul and
+    _d_mat_gso.
+*/
+#if defined(__SIZEOF_FLOAT128__)
+typedef __float128 d_quad;
+#define Q_EPS ((d_quad) 0x1p-112)
+#else
+typedef long double d_quad;
+#define Q_EPS ((d_quad) LDBL_EPSILON)
+#endif
+
+#define S_EPS 1.1920928955078125e-07f
+
+#define s_mat_entry(mat,i,j) ((mat)->entries[(i) + (j) * (mat)->ld])
+#define q_mat_entry(mat,i,j) ((mat)->entries[(i) + (j) * (mat)->ld])
+
+/*
+    Square root to full precision from the double one, by Newton steps.
+    x is first scaled by an even power of two into the range of double,
+    which is much smaller than that of d_quad.
+*/
+static d_quad
+_q_sqrt(d_quad x)
+{
+    d_quad y, s = 1;
+
+    if (x <= 0)
+        return 0;
+
+    if (x - x != 0)
+        return x;
+
+    while (x > (d_quad) 0x1p1000)
+    {
+        x *= (d_quad) 0x1p-1000;
+        s *= (d_quad) 0x1p500;
+    }
+
+    while (x < (d_quad) 0x1p-1000)
+    {
+        x *= (d_quad) 0x1p1000;
+        s *= (d_quad) 0x1p-500;
+    }
+
+    y = sqrt((double) x);
+    y = (y + x / y) / 2;
+    y = (y + x / y) / 2;
+
+    return y * s;
+}
+
+/*
+    Float kernels on GCC vectors of 16 floats, loaded without alignment
+    requirements; the reduction keeps four of them as accumulators, like
+    the double kernels.
+*/
+typedef float _s_vec16 __attribute__((vector_size(64), aligned(4)));
+
+static inline __attribute__((always_inline)) float
+_s_vec_scalar_product_body(const float *vec1, const float *vec2, slong len)
+{
+    _s_vec16 s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0};
+    float s = 0;
+    slong i, l;
+
+    for (i = 0; i + 64 <= len; i += 64)
+    {
+        s0 += *(const _s_vec16 *) (vec1 + i) * *(const _s_vec16 *) (vec2 + i);
+        s1 += *(const _s_vec16 *) (vec1 + i + 16)
+            * *(const _s_vec16 *) (vec2 + i + 16);
+        s2 += *(const _s_vec16 *) (vec1 + i + 32)
+            * *(const _s_vec16 *) (vec2 + i + 32);
+        s3 += *(const _s_vec16 *) (vec1 + i + 48)
+            * *(const _s_vec16 *) (vec2 + i + 48);
+    }
+    for ( ; i + 16 <= len; i += 16)
+        s0 += *(const _s_vec16 *) (vec1 + i) * *(const _s_vec16 *) (vec2 + i);
+
+    s0 = (s0 + s1) + (s2 + s3);
+    for (l = 0; l < 16; l++)
+        s += s0[l];
+    for ( ; i < len; i++)
+        s += vec1[i] * vec2[i];
+
+    return s;
+}
+
+static inline __attribute__((always_inline)) void
+_s_vec_scalar_submul_body(float *vec1, const float *vec2, slong len, float c)
+{
+    slong i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        *(_s_vec16 *) (vec1 + i) -= c * *(const _s_vec16 *) (vec2 + i);
+    for ( ; i < len; i++)
+        vec1[i] -= c * vec2[i];
+}
+
+static float
+_s_vec_scalar_product_generic(const float *vec1, const float *vec2, slong len)
+{
+    return _s_vec_scalar_product_body(vec1, vec2, len);
+}
+
+static void
+_s_vec_scalar_submul_generic(float *vec1, const float *vec2, slong len, float c)
+{
+    _s_vec_scalar_submul_body(vec1, vec2, len, c);
+}
+
+#ifdef D_HAVE_X86
+
+__attribute__((target("avx2,fma")))
+static float
+_s_vec_scalar_product_avx2(const float *vec1, const float *vec2, slong len)
+{
+    return _s_vec_scalar_product_body(vec1, vec2, len);
+}
+
+__attribute__((target("avx2,fma")))
+static void
+_s_vec_scalar_submul_avx2(float *vec1, const float *vec2, slong len, float c)
+{
+    _s_vec_scalar_submul_body(vec1, vec2, len, c);
+}
+
+__attribute__((target("avx512f")))
+static float
+_s_vec_scalar_product_avx512(const float *vec1, const float *vec2, slong len)
+{
+    return _s_vec_scalar_product_body(vec1, vec2, len);
+}
+
+__attribute__((target("avx512f")))
+static void
+_s_vec_scalar_submul_avx512(float *vec1, const float *vec2, slong len, float c)
+{
+    _s_vec_scalar_submul_body(vec1, vec2, len, c);
+}
+
+#endif
+
+float
+_s_vec_scalar_product(const float *vec1, const float *vec2, slong len)
+{
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+        return _s_vec_scalar_product_avx512(vec1, vec2, len);
+    if (_d_cpu_level() == D_CPU_AVX2)
+        return _s_vec_scalar_product_avx2(vec1, vec2, len);
+#endif
+    return _s_vec_scalar_product_generic(vec1, vec2, len);
+}
+
+/* Sets vec1 to vec1 - c * vec2. */
+void
+_s_vec_scalar_submul(float *vec1, const float *vec2, slong len, float c)
+{
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+    {
+        _s_vec_scalar_submul_avx512(vec1, vec2, len, c);
+        return;
+    }
+    if (_d_cpu_level() == D_CPU_AVX2)
+    {
+        _s_vec_scalar_submul_avx2(vec1, vec2, len, c);
+        return;
+    }
+#endif
+    _s_vec_scalar_submul_generic(vec1, vec2, len, c);
+}
+
+/*
+    C = A B for column-major arrays, A being m x k and B k x n, with
+    leading dimensions lda, ldb and ldc and no aliasing. Tiles of W R x 4
+    entries of C are kept in R x 4 vectors of W floats while a panel of
+    S_MAT_MUL_KC columns of A and rows of B is run through, so that C is
+    loaded and stored once per panel rather than once per column of A as
+    in a column update. W is 16, except for AVX2, whose code for vectors
+    of 16 floats goes through memory, and R is 2 where the registers can
+    hold both tile and operands. The remaining rows and columns are
+    computed by scalar products.
+*/
+#define S_MAT_MUL_MC 128
+#define S_MAT_MUL_KC 256
+
+typedef float _s_vec8 __attribute__((vector_size(32), aligned(4)));
+
+/* Adds to the W R x 4 tile of C at (i, j) its product over [p0, p1). */
+#define S_MAT_MUL_TILE_DEFINE(W)                                            \
+static inline __attribute__((always_inline)) void                           \
+_s_mat_mul_tile##W(float *C, slong ldc, const float *A, slong lda,          \
+                   const float *B, slong ldb, slong i, slong j,             \
+                   slong p0, slong p1, const slong R)                       \
+{                                                                           \
+    _s_vec##W c[2][4], a[2];                                                \
+    slong h, l, r;                                                          \
+    float b;                                                                \
+                                                                            \
+    _Pragma("GCC unroll 2")                                                 \
+    for (r = 0; r < R; r++)                                                 \
+        _Pragma("GCC unroll 4")                                             \
+        for (h = 0; h < 4; h++)                                             \
+            c[r][h] = (_s_vec##W) {0};                                      \
+                                                                            \
+    for (l = p0; l < p1; l++)                                               \
+    {                                                                       \
+        _Pragma("GCC unroll 2")                                             \
+        for (r = 0; r < R; r++)                                             \
+            a[r] = *(const _s_vec##W *) (A + i + W * r + l * lda);          \
+        _Pragma("GCC unroll 4")                                             \
+        for (h = 0; h < 4; h++)                                             \
+        {                                                                   \
+            b = B[l + (j + h) * ldb];                                       \
+            _Pragma("GCC unroll 2")                                         \
+            for (r = 0; r < R; r++)                                         \
+                c[r][h] += a[r] * b;                                        \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    _Pragma("GCC unroll 4")                                                 \
+    for (h = 0; h < 4; h++)                                                 \
+        _Pragma("GCC unroll 2")                                             \
+        for (r = 0; r < R; r++)                                             \
+            *(_s_vec##W *) (C + i + W * r + (j + h) * ldc) += c[r][h];      \
+}
+
+S_MAT_MUL_TILE_DEFINE(8)
+S_MAT_MUL_TILE_DEFINE(16)
+
+static inline __attribute__((always_inline)) void
+_s_mat_mul_array_body(float *C, slong ldc, const float *A, slong lda,
+                      const float *B, slong ldb, slong m, slong k, slong n,
+                      const slong W, const slong R)
+{
+    slong i, i0, i1, j, h, l, p0, p1, nb;
+    float t;
+
+    for (j = 0; j < n; j++)
+        for (i = 0; i < m; i++)
+            C[i + j * ldc] = 0;
+
+    for (p0 = 0; p0 < k; p0 += S_MAT_MUL_KC)
+    {
+        p1 = FLINT_MIN(p0 + S_MAT_MUL_KC, k);
+
+        for (i0 = 0; i0 < m; i0 += S_MAT_MUL_MC)
+        {
+            i1 = FLINT_MIN(i0 + S_MAT_MUL_MC, m);
+
+            for (j = 0; j < n; j += 4)
+            {
+                nb = FLINT_MIN(4, n - j);
+                i = i0;
+
+                for ( ; nb == 4 && i + W * R <= i1; i += W * R)
+                {
+                    if (W == 16)
+                        _s_mat_mul_tile16(C, ldc, A, lda, B, ldb, i, j,
+                                          p0, p1, R);
+                    else
+                        _s_mat_mul_tile8(C, ldc, A, lda, B, ldb, i, j,
+                                         p0, p1, R);
+                }
+
+                if (nb == 4 && R == 2 && i + W <= i1)
+                {
+                    if (W == 16)
+                        _s_mat_mul_tile16(C, ldc, A, lda, B, ldb, i, j,
+                                          p0, p1, 1);
+                    else
+                        _s_mat_mul_tile8(C, ldc, A, lda, B, ldb, i, j,
+                                         p0, p1, 1);
+                    i += W;
+                }
+
+                for ( ; i < i1; i++)
+                {
+                    for (h = 0; h < nb; h++)
+                    {
+                        t = 0;
+                        for (l = p0; l < p1; l++)
+                            t += A[i + l * lda] * B[l + (j + h) * ldb];
+                        C[i + (j + h) * ldc] += t;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+_s_mat_mul_array_generic(float *C, slong ldc, const float *A, slong lda,
+                         const float *B, slong ldb, slong m, slong k, slong n)
+{
+    _s_mat_mul_array_body(C, ldc, A, lda, B, ldb, m, k, n, 16, 1);
+}
+
+#ifdef D_HAVE_X86
+
+__attribute__((target("avx2,fma")))
+static void
+_s_mat_mul_array_avx2(float *C, slong ldc, const float *A, slong lda,
+                      const float *B, slong ldb, slong m, slong k, slong n)
+{
+    _s_mat_mul_array_body(C, ldc, A, lda, B, ldb, m, k, n, 8, 2);
+}
+
+__attribute__((target("avx512f")))
+static void
+_s_mat_mul_array_avx512(float *C, slong ldc, const float *A, slong lda,
+                        const float *B, slong ldb, slong m, slong k, slong n)
+{
+    _s_mat_mul_array_body(C, ldc, A, lda, B, ldb, m, k, n, 16, 2);
+}
+
+#endif
+
+void
+_s_mat_mul_array(float *C, slong ldc, const float *A, slong lda,
+                 const float *B, slong ldb, slong m, slong k, slong n)
+{
+#ifdef D_HAVE_X86
+    if (_d_cpu_level() == D_CPU_AVX512)
+    {
+        _s_mat_mul_array_avx512(C, ldc, A, lda, B, ldb, m, k, n);
+        return;
+    }
+    if (_d_cpu_level() == D_CPU_AVX2)
+    {
+        _s_mat_mul_array_avx2(C, ldc, A, lda, B, ldb, m, k, n);
+        return;
+    }
+#endif
+    _s_mat_mul_array_generic(C, ldc, A, lda, B, ldb, m, k, n);
+}
+
+/* The __float128 arithmetic is in software, so plain loops will do. */
+d_quad
+_q_vec_scalar_product(const d_quad *vec1, const d_quad *vec2, slong len)
+{
+    d_quad s = 0;
+    slong i;
+
+    for (i = 0; i < len; i++)
+        s += vec1[i] * vec2[i];
+
+    return s;
+}
+
+void
+_q_vec_scalar_submul(d_quad *vec1, const d_quad *vec2, slong len, d_quad c)
+{
+    slong i;
+
+    for (i = 0; i < len; i++)
+        vec1[i] -= c * vec2[i];
+}
+
+/* As _s_mat_mul_array, a column of C at a time. */
+void
+_q_mat_mul_array(d_quad *C, slong ldc, const d_quad *A, slong lda,
+                 const d_quad *B, slong ldb, slong m, slong k, slong n)
+{
+    slong i, j, l;
+
+    for (j = 0; j < n; j++)
+    {
+        for (i = 0; i < m; i++)
+            C[i + j * ldc] = 0;
+        for (l = 0; l < k; l++)
+            _q_vec_scalar_submul(C + j * ldc, A + l * lda, m,
+                                 -B[l + j * ldb]);
+    }
+}
+
+/*
+    Defines p_mat_t with entries of type T, given the kernels
+    _p_vec_scalar_product, _p_vec_scalar_submul and _p_mat_mul_array, the
+    unit roundoff EPS of T and its square root function SQRT.
+*/
+#define D_MAT_SCALAR_DEFINE(p, T, EPS, SQRT)                                \
+                                                                            \
+typedef struct                                                              \
+{                                                                           \
+    T *entries;                                                             \
+    slong r;                                                                \
+    slong c;                                                                \
+    slong ld;                                                               \
+} p##_mat_struct;                                                           \
+                                                                            \
+typedef p##_mat_struct p##_mat_t[1];                                        \
+                                                                            \
+void                                                                        \
+p##_mat_init(p##_mat_t mat, slong rows, slong cols)                         \
+{                                                                           \
+    slong pad = D_MAT_ALIGN / sizeof(T);                                    \
+                                                                            \
+    mat->ld = rows;                                                         \
+    if (pad > 0 && rows >= pad)                                             \
+        mat->ld = ((rows + pad - 1) / pad) * pad;                           \
+                                                                            \
+    if (rows && cols)                                                       \
+        mat->entries = _d_mat_aligned_alloc(cols * mat->ld * sizeof(T));    \
+    else                                                                    \
+        mat->entries = NULL;                                                \
+                                                                            \
+    mat->r = rows;                                                          \
+    mat->c = cols;                                                          \
+}                                                                           \
+                                                                            \
+void                                                                        \
+p##_mat_clear(p##_mat_t mat)                                                \
+{                                                                           \
+    if (mat->entries)                                                       \
+        _d_mat_aligned_free(mat->entries);                                  \
+}                                                                           \
+                                                                            \
+void                                                                        \
+p##_mat_zero(p##_mat_t mat)                                                 \
+{                                                                           \
+    slong i, j;                                                             \
+                                                                            \
+    for (j = 0; j < mat->c; j++)                                            \
+        for (i = 0; i < mat->r; i++)                                        \
+            mat->entries[i + j * mat->ld] = 0;                              \
+}                                                                           \
+                                                                            \
+void                                                                        \
+p##_mat_set_d_mat(p##_mat_t B, const d_mat_t A)                             \
+{                                                                           \
+    slong i, j;                                                             \
+                                                                            \
+    if (B->r != A->r || B->c != A->c)                                       \
+    {                                                                       \
+        flint_printf("Exception (" #p "_mat_set_d_mat). "                   \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    for (j = 0; j < A->c; j++)                                              \
+        for (i = 0; i < A->r; i++)                                          \
+            B->entries[i + j * B->ld] = d_mat_entry(A, i, j);               \
+}                                                                           \
+                                                                            \
+void                                                                        \
+p##_mat_get_d_mat(d_mat_t A, const p##_mat_t B)                             \
+{                                                                           \
+    slong i, j;                                                             \
+                                                                            \
+    if (B->r != A->r || B->c != A->c)                                       \
+    {                                                                       \
+        flint_printf("Exception (" #p "_mat_get_d_mat). "                   \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    for (j = 0; j < A->c; j++)                                              \
+        for (i = 0; i < A->r; i++)                                          \
+            d_mat_entry(A, i, j) = B->entries[i + j * B->ld];               \
+}                                                                           \
+                                                                            \
+/* C = A * B; C may alias A or B. */                                        \
+void                                                                        \
+p##_mat_mul(p##_mat_t C, const p##_mat_t A, const p##_mat_t B)              \
+{                                                                           \
+    if (C->r != A->r || C->c != B->c || A->c != B->r)                       \
+    {                                                                       \
+        flint_printf("Exception (" #p "_mat_mul). "                         \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    if (C == A || C == B)                                                   \
+    {                                                                       \
+        p##_mat_t t;                                                        \
+        p##_mat_init(t, C->r, C->c);                                        \
+        p##_mat_mul(t, A, B);                                               \
+        FLINT_SWAP(p##_mat_struct, *C, *t);                                 \
+        p##_mat_clear(t);                                                   \
+        return;                                                             \
+    }                                                                       \
+                                                                            \
+    _##p##_mat_mul_array(C->entries, C->ld, A->entries, A->ld,              \
+                         B->entries, B->ld, C->r, A->c, C->c);              \
+}                                                                           \
+                                                                            \
+/*                                                                          \
+    The loop of _d_mat_gso on the columns of W, storing the coefficients    \
+    in the zeroed matrix R if it is not NULL.                               \
+*/                                                                          \
+static void                                                                 \
+_##p##_mat_gso(p##_mat_t W, p##_mat_t R)                                    \
+{                                                                           \
+    slong i, k, m = W->r;                                                   \
+    T s, tk, c, *t, *wk, *wi;                                               \
+                                                                            \
+    t = flint_calloc(W->c, sizeof(T));                                      \
+                                                                            \
+    for (k = 0; k < W->c; k++)                                              \
+    {                                                                       \
+        wk = W->entries + k * W->ld;                                        \
+        s = _##p##_vec_scalar_product(wk, wk, m);                           \
+        tk = t[k] + s;                                                      \
+        while (s < tk)                                                      \
+        {                                                                   \
+            if (s * EPS == 0)                                               \
+            {                                                               \
+                s = 0;                                                      \
+                break;                                                      \
+            }                                                               \
+            tk = 0;                                                         \
+            for (i = 0; i < k; i++)                                         \
+            {                                                               \
+                wi = W->entries + i * W->ld;                                \
+                c = _##p##_vec_scalar_product(wi, wk, m);                   \
+                if (R != NULL)                                              \
+                    R->entries[i + k * R->ld] += c;                         \
+                tk += c * c;                                                \
+                _##p##_vec_scalar_submul(wk, wi, m, c);                     \
+            }                                                               \
+            s = _##p##_vec_scalar_product(wk, wk, m);                       \
+            tk += s;                                                        \
+        }                                                                   \
+                                                                            \
+        s = SQRT(s);                                                        \
+        if (R != NULL)                                                      \
+            R->entries[k + k * R->ld] = s;                                  \
+        c = (s != 0) ? 1 / s : 0;                                           \
+        for (i = 0; i < m; i++)                                             \
+            wk[i] *= c;                                                     \
+                                                                            \
+        for (i = k + 1; i < W->c; i++)                                      \
+        {                                                                   \
+            wi = W->entries + i * W->ld;                                    \
+            c = _##p##_vec_scalar_product(wk, wi, m);                       \
+            if (R != NULL)                                                  \
+                R->entries[k + i * R->ld] = c;                              \
+            t[i] += c * c;                                                  \
+            _##p##_vec_scalar_submul(wi, wk, m, c);                         \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    flint_free(t);                                                          \
+}                                                                           \
+                                                                            \
+void                                                                        \
+p##_mat_gso(p##_mat_t B, const p##_mat_t A)                                 \
+{                                                                           \
+    slong j;                                                                \
+                                                                            \
+    if (B->r != A->r || B->c != A->c)                                       \
+    {                                                                       \
+        flint_printf("Exception (" #p "_mat_gso). "                         \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    if (B != A)                                                             \
+        for (j = 0; j < A->c; j++)                                          \
+            memcpy(B->entries + j * B->ld, A->entries + j * A->ld,          \
+                   A->r * sizeof(T));                                       \
+    _##p##_mat_gso(B, NULL);                                                \
+}                                                                           \
+                                                                            \
+/* Q R = A by Gram-Schmidt, as d_mat_qr_mgs; R must be zero. */             \
+void                                                                        \
+p##_mat_qr(p##_mat_t Q, p##_mat_t R, const p##_mat_t A)                     \
+{                                                                           \
+    slong j;                                                                \
+                                                                            \
+    if (Q->r != A->r || Q->c != A->c || R->r != A->c || R->c != A->c)       \
+    {                                                                       \
+        flint_printf("Exception (" #p "_mat_qr). "                          \
+                     "Incompatible dimensions.\n");                         \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    if (Q != A)                                                             \
+        for (j = 0; j < A->c; j++)                                          \
+            memcpy(Q->entries + j * Q->ld, A->entries + j * A->ld,          \
+                   A->r * sizeof(T));                                       \
+    _##p##_mat_gso(Q, R);                                                   \
+}
+
+D_MAT_SCALAR_DEFINE(s, float, S_EPS, sqrtf)
+D_MAT_SCALAR_DEFINE(q, d_quad, Q_EPS, _q_sqrt)
+
+
+int
+test_d_vec(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("vec....");
+    fflush(stdout);
+
+    for (i = 0; i < 1000 * flint_test_multiplier(); i++)
+    {
+        double *a, *b, *c, *res, *ref, s, t;
+        slong len, count, stride, j, l;
+
+        len = n_randint(state, 100);
+        count = n_randint(state, 6);
+        stride = len + n_randint(state, 4);
+
+        a = flint_malloc((len + 1) * sizeof(double));
+        b = flint_malloc((count * stride + 1) * sizeof(double));
+        c = flint_malloc((len + 1) * sizeof(double));
+        res = flint_malloc((count + 1) * sizeof(double));
+        ref = flint_malloc((len + 1) * sizeof(double));
+
+        for (j = 0; j < len; j++)
+        {
+            a[j] = d_randtest(state) - 0.75;
+            c[j] = d_randtest(state) - 0.75;
+        }
+        for (j = 0; j < count * stride; j++)
+            b[j] = d_randtest(state) - 0.75;
+
+        /* the multi-dot agrees exactly with separate scalar products */
+        _d_vec_scalar_product_multi(res, a, b, stride, count, len);
+        for (l = 0; l < count; l++)
+        {
+            if (res[l] != _d_vec_scalar_product(a, b + l * stride, len))
+            {
+                flint_printf("FAIL (multi):\n");
+                flint_printf("len = %wd, count = %wd, l = %wd\n",
+                             len, count, l);
+                abort();
+            }
+        }
+
+        s = 0;
+        for (j = 0; j < len; j++)
+            s += a[j] * c[j];
+        t = _d_vec_scalar_product(a, c, len);
+        if (fabs(s - t) > len * 4 * D_EPS)
+        {
+            flint_printf("FAIL (scalar_product):\n");
+            flint_printf("len = %wd, %g != %g\n", len, s, t);
+            abort();
+        }
+
+        /* fused update and scalar product, with vec3 aliasing vec1 */
+        s = d_randtest(state);
+        for (j = 0; j < len; j++)
+            ref[j] = a[j] - s * c[j];
+        t = _d_vec_scalar_submul_dot(a, c, s, a, len);
+        if (fabs(t - _d_vec_norm(a, len)) > len * 4 * D_EPS
+            || !_d_vec_approx_equal(ref, a, len, 4 * D_EPS))
+        {
+            flint_printf("FAIL (submul_dot):\n");
+            flint_printf("len = %wd\n", len);
+            abort();
+        }
+
+        flint_free(a);
+        flint_free(b);
+        flint_free(c);
+        flint_free(res);
+        flint_free(ref);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+int
+test_d_mat_mul(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("mul....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_t A, B, C, D;
+
+        slong m, n, k;
+
+        m = n_randint(state, 120);
+        n = n_randint(state, 120);
+        k = n_randint(state, 10) == 0 ? n_randint(state, 600)
+            : n_randint(state, 120);
+
+        d_mat_init(A, m, k);
+        d_mat_init(B, k, n);
+        d_mat_init(C, m, n);
+        d_mat_init(D, m, n);
+
+        d_mat_randtest(A, state);
+        d_mat_randtest(B, state);
+
+        d_mat_mul(C, A, B);
+        d_mat_mul_classical(D, A, B);
+
+        if (!d_mat_approx_equal(C, D, (k + 1) * (k + 1) * D_EPS))
+        {
+            flint_printf("FAIL:\n");
+            flint_printf("A:\n");
+            d_mat_print(A);
+            flint_printf("B:\n");
+            d_mat_print(B);
+            flint_printf("C:\n");
+            d_mat_print(C);
+            flint_printf("D:\n");
+            d_mat_print(D);
+            abort();
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(B);
+        d_mat_clear(C);
+        d_mat_clear(D);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_mat_qr(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("qr....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        double dot, norm;
+        int j, k, l;
+        d_mat_t A, Q, R, B;
+
+        slong m, n;
+
+        m = n_randint(state, 10);
+        n = n_randint(state, 10);
+
+        d_mat_init(A, m, n);
+        d_mat_init(Q, m, n);
+        d_mat_init(R, n, n);
+        d_mat_init(B, m, n);
+
+        d_mat_randtest(A, state);
+        d_mat_zero(R);
+
+        d_mat_qr(Q, R, A);
+
+        d_mat_mul(B, Q, R);
+
+        if (!d_mat_approx_equal(A, B, 3 * D_EPS))
+        {
+            flint_printf("FAIL:\n");
+            flint_printf("A:\n");
+            d_mat_print(A);
+            flint_printf("Q:\n");
+            d_mat_print(Q);
+            flint_printf("R:\n");
+            d_mat_print(R);
+            flint_printf("B:\n");
+            d_mat_print(B);
+            abort();
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            norm = 0;
+            for (l = 0; l < m; l++)
+            {
+                norm += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, j);
             }
             if (norm != 0 && fabs(norm - 1) > 4 * D_EPS)
             {
-                flint_printf("FAIL:\n");
-                flint_printf("Q:\n");
-                d_mat_print(Q);
-                flint_printf("%g\n", norm);
-                flint_printf("%d\n", j);
+                flint_printf("FAIL:\n");
+                flint_printf("Q:\n");
+                d_mat_print(Q);
+                flint_printf("%g\n", norm);
+                flint_printf("%d\n", j);
+                abort();
+            }
+            for (k = j + 1; k < n; k++)
+            {
+
+                dot = 0;
+                for (l = 0; l < m; l++)
+                {
+                    dot += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, k);
+                }
+
+                if (fabs(dot) > 2 * D_EPS)
+                {
+                    flint_printf("FAIL:\n");
+                    flint_printf("Q:\n");
+                    d_mat_print(Q);
+                    flint_printf("%g\n", dot);
+                    flint_printf("%d %d\n", j, k);
+                    abort();
+                }
+            }
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(Q);
+        d_mat_clear(R);
+        d_mat_clear(B);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_mat_layout(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("layout....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_t A, B, C, A2, B2, C2, Q, R, Q2, R2;
+        int la, lb, lc;
+
+        slong m, n, k, r, s;
+
+        m = n_randint(state, 80);
+        n = n_randint(state, 80);
+        k = n_randint(state, 80);
+        la = n_randint(state, 2);
+        lb = n_randint(state, 2);
+        lc = n_randint(state, 2);
+
+        d_mat_init(A, m, k);
+        d_mat_init(B, k, n);
+        d_mat_init(C, m, n);
+        d_mat_init_layout(A2, m, k, la);
+        d_mat_init_layout(B2, k, n, lb);
+        d_mat_init_layout(C2, m, n, lc);
+
+        d_mat_randtest(A, state);
+        d_mat_randtest(B, state);
+        d_mat_set(A2, A);
+        d_mat_set(B2, B);
+
+        if (!d_mat_equal(A, A2) || !d_mat_equal(B, B2))
+        {
+            flint_printf("FAIL (set):\n");
+            d_mat_print(A);
+            d_mat_print(A2);
+            abort();
+        }
+
+        if (m > 0)
+        {
+            r = n_randint(state, m);
+            s = n_randint(state, m);
+            d_mat_swap_rows(A, r, s);
+            d_mat_swap_rows(A2, r, s);
+        }
+
+        d_mat_mul(C, A, B);
+        d_mat_mul(C2, A2, B2);
+
+        if (!d_mat_equal(A, A2) || !d_mat_equal(C, C2))
+        {
+            flint_printf("FAIL (mul):\n");
+            d_mat_print(C);
+            d_mat_print(C2);
+            abort();
+        }
+
+        d_mat_init(Q, m, k);
+        d_mat_init(R, k, k);
+        d_mat_init_layout(Q2, m, k, lb);
+        d_mat_init_layout(R2, k, k, lc);
+        d_mat_zero(R);
+        d_mat_zero(R2);
+
+        d_mat_qr(Q, R, A);
+        d_mat_qr(Q2, R2, A2);
+
+        if (!d_mat_equal(Q, Q2) || !d_mat_equal(R, R2))
+        {
+            flint_printf("FAIL (qr):\n");
+            d_mat_print(Q);
+            d_mat_print(Q2);
+            abort();
+        }
+
+        d_mat_gso(Q, A);
+        d_mat_gso(A2, A2);
+
+        if (!d_mat_equal(Q, A2))
+        {
+            flint_printf("FAIL (gso):\n");
+            d_mat_print(Q);
+            d_mat_print(A2);
+            abort();
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(B);
+        d_mat_clear(C);
+        d_mat_clear(A2);
+        d_mat_clear(B2);
+        d_mat_clear(C2);
+        d_mat_clear(Q);
+        d_mat_clear(R);
+        d_mat_clear(Q2);
+        d_mat_clear(R2);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_mat_window(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("window....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_t A, B, C, W, X, Y;
+        int layout;
+
+        slong m, n, r1, r2, c1, c2, j, k, l;
+
+        m = n_randint(state, 80);
+        n = n_randint(state, 80);
+        layout = n_randint(state, 2);
+
+        d_mat_init_layout(A, m, n, layout);
+        d_mat_randtest(A, state);
+
+        if (((ulong) A->entries) % D_MAT_ALIGN != 0
+            || (A->ld >= D_MAT_PAD && A->ld % D_MAT_PAD != 0))
+        {
+            flint_printf("FAIL (alignment):\n");
+            flint_printf("m = %wd, n = %wd, ld = %wd\n", m, n, A->ld);
+            abort();
+        }
+
+        r1 = n_randint(state, m + 1);
+        r2 = r1 + n_randint(state, m - r1 + 1);
+        c1 = n_randint(state, n + 1);
+        c2 = c1 + n_randint(state, n - c1 + 1);
+
+        d_mat_window_init(W, A, r1, c1, r2, c2);
+
+        for (j = 0; j < r2 - r1; j++)
+        {
+            for (k = 0; k < c2 - c1; k++)
+            {
+                if (&d_mat_entry(W, j, k) != &d_mat_entry(A, r1 + j, c1 + k))
+                {
+                    flint_printf("FAIL (aliasing):\n");
+                    abort();
+                }
+            }
+        }
+
+        /* multiply into a window and compare with a product of copies */
+        d_mat_init(B, c2 - c1, c2 - c1);
+        d_mat_init(X, r2 - r1, c2 - c1);
+        d_mat_init(Y, r2 - r1, c2 - c1);
+        d_mat_randtest(B, state);
+
+        d_mat_init(C, m, n);
+        d_mat_set(C, A);
+
+        /* first through a copy, then in place, with the window aliased */
+        for (l = 0; l < 3; l++)
+        {
+            d_mat_set(A, C);
+            d_mat_set(X, W);
+
+            if (l == 0)
+            {
+                d_mat_mul(Y, X, B);
+                d_mat_mul(X, W, B);
+                d_mat_set(W, X);
+            }
+            else if (l == 1)
+            {
+                d_mat_mul(Y, X, B);
+                d_mat_mul(W, W, B);
+            }
+            else
+            {
+                d_mat_mul_classical(Y, X, B);
+                d_mat_mul_classical(W, W, B);
+            }
+
+            for (j = 0; j < m; j++)
+            {
+                for (k = 0; k < n; k++)
+                {
+                    double e = (j >= r1 && j < r2 && k >= c1 && k < c2)
+                        ? d_mat_entry(Y, j - r1, k - c1)
+                        : d_mat_entry(C, j, k);
+
+                    if (d_mat_entry(A, j, k) != e)
+                    {
+                        flint_printf("FAIL (mul, %wd):\n", l);
+                        d_mat_print(A);
+                        abort();
+                    }
+                }
+            }
+        }
+
+        /* Gram matrix of a square window, in place */
+        l = FLINT_MIN(r2 - r1, c2 - c1);
+        d_mat_window_clear(W);
+        d_mat_window_init(W, A, r1, c1, r1 + l, c1 + l);
+        d_mat_clear(X);
+        d_mat_clear(Y);
+        d_mat_init(X, l, l);
+        d_mat_init(Y, l, l);
+
+        d_mat_set(A, C);
+        d_mat_set(X, W);
+        d_mat_gram(Y, X);
+        d_mat_gram(W, W);
+
+        for (j = 0; j < m; j++)
+        {
+            for (k = 0; k < n; k++)
+            {
+                double e = (j >= r1 && j < r1 + l && k >= c1 && k < c1 + l)
+                    ? d_mat_entry(Y, j - r1, k - c1) : d_mat_entry(C, j, k);
+
+                if (d_mat_entry(A, j, k) != e)
+                {
+                    flint_printf("FAIL (gram):\n");
+                    d_mat_print(A);
+                    abort();
+                }
+            }
+        }
+
+        d_mat_window_clear(W);
+        d_mat_clear(A);
+        d_mat_clear(B);
+        d_mat_clear(C);
+        d_mat_clear(X);
+        d_mat_clear(Y);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+/* Task of the thread pool test: counts its calls and records each index. */
+typedef struct
+{
+    slong calls;
+    slong * out;
+} test_thread_pool_arg_struct;
+
+static void
+_test_thread_pool_task(void * varg, slong i)
+{
+    test_thread_pool_arg_struct * arg = varg;
+
+    __atomic_add_fetch(&arg->calls, 1, __ATOMIC_RELAXED);
+    arg->out[i] += i + 1;
+}
+
+int
+test_d_mat_threads(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("threads....");
+    fflush(stdout);
+
+    for (i = 0; i < 10 * flint_test_multiplier(); i++)
+    {
+        d_mat_t A, B, C1, C2, D1, D2, Q1, Q2, R1, R2;
+
+        slong m, n, threads;
+
+        /* B A has an inner dimension of several panels of B */
+        m = 64 + n_randint(state, 500);
+        n = 64 + n_randint(state, 150);
+        threads = 2 + n_randint(state, 7);
+
+        d_mat_init(A, m, n);
+        d_mat_init(B, n, m);
+        d_mat_init(C1, m, m);
+        d_mat_init(C2, m, m);
+        d_mat_init(D1, n, n);
+        d_mat_init(D2, n, n);
+        d_mat_init(Q1, m, n);
+        d_mat_init(Q2, m, n);
+        d_mat_init(R1, n, n);
+        d_mat_init(R2, n, n);
+
+        d_mat_randtest(A, state);
+        d_mat_randtest(B, state);
+        d_mat_zero(R1);
+        d_mat_zero(R2);
+
+        thread_pool_set_num_threads(1);
+        d_mat_mul(C1, A, B);
+        d_mat_mul(D1, B, A);
+        d_mat_qr_mgs(Q1, R1, A);
+
+        thread_pool_set_num_threads(threads);
+        d_mat_mul(C2, A, B);
+        d_mat_mul(D2, B, A);
+        d_mat_qr_mgs(Q2, R2, A);
+
+        if (!d_mat_equal(C1, C2) || !d_mat_equal(D1, D2)
+            || !d_mat_equal(Q1, Q2)
+            || !d_mat_equal(R1, R2))
+        {
+            flint_printf("FAIL:\n");
+            flint_printf("threads = %wd, m = %wd, n = %wd\n", threads, m, n);
+            abort();
+        }
+
+        d_mat_gso(Q2, A);
+        thread_pool_set_num_threads(1);
+        d_mat_gso(Q1, A);
+
+        if (!d_mat_equal(Q1, Q2))
+        {
+            flint_printf("FAIL (gso):\n");
+            flint_printf("threads = %wd, m = %wd, n = %wd\n", threads, m, n);
+            abort();
+        }
+
+        d_mat_qr_householder(Q1, R1, A);
+        thread_pool_set_num_threads(threads);
+        d_mat_qr_householder(Q2, R2, A);
+        thread_pool_set_num_threads(1);
+
+        if (!d_mat_equal(Q1, Q2) || !d_mat_equal(R1, R2))
+        {
+            flint_printf("FAIL (qr_householder):\n");
+            flint_printf("threads = %wd, m = %wd, n = %wd\n", threads, m, n);
+            abort();
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(B);
+        d_mat_clear(C1);
+        d_mat_clear(C2);
+        d_mat_clear(D1);
+        d_mat_clear(D2);
+        d_mat_clear(Q1);
+        d_mat_clear(Q2);
+        d_mat_clear(R1);
+        d_mat_clear(R2);
+    }
+
+    /*
+        Change the number of threads before every call: each call must run
+        every index once, and no earlier call may be run again by workers
+        started for a later one.
+    */
+    {
+        test_thread_pool_arg_struct args[20];
+        slong k, j, n = 1000;
+
+        for (k = 0; k < 20; k++)
+        {
+            args[k].calls = 0;
+            args[k].out = flint_calloc(n, sizeof(slong));
+
+            thread_pool_set_num_threads(1 + n_randint(state, 8));
+            thread_pool_parallel_for(n, _test_thread_pool_task, args + k);
+        }
+        thread_pool_set_num_threads(1);
+
+        for (k = 0; k < 20; k++)
+        {
+            for (j = 0; j < n; j++)
+            {
+                if (args[k].out[j] != j + 1)
+                {
+                    flint_printf("FAIL (pool restart): call %wd, index %wd\n",
+                                 k, j);
+                    abort();
+                }
+            }
+            if (args[k].calls != n)
+            {
+                flint_printf("FAIL (pool restart): call %wd ran %wd tasks\n",
+                             k, args[k].calls);
+                abort();
+            }
+            flint_free(args[k].out);
+        }
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Prints wall times of d_mat_mul and d_mat_qr for 1, 2, 4, ... threads up
+    to max_threads, with the speedup and parallel efficiency relative to one
+    thread.
+*/
+void
+profile_d_mat_threads(slong max_threads)
+{
+    d_mat_t A, B, C, Q, R;
+    slong p, n = 1000, qm = 2000, qn = 200;
+    double mul1 = 0, qr1 = 0;
+    timeit_t t;
+    FLINT_TEST_INIT(state);
+
+    d_mat_init(A, n, n);
+    d_mat_init(B, n, n);
+    d_mat_init(C, n, n);
+    d_mat_randtest(A, state);
+    d_mat_randtest(B, state);
+
+    d_mat_init(Q, qm, qn);
+    d_mat_init(R, qn, qn);
+
+    flint_printf("threads  mul %wdx%wd (ms)  speedup  eff    "
+                 "qr %wdx%wd (ms)  speedup  eff\n", n, n, qm, qn);
+
+    for (p = 1; p <= max_threads; p = (p == max_threads) ? p + 1
+                                      : FLINT_MIN(2 * p, max_threads))
+    {
+        double mul, qr;
+
+        thread_pool_set_num_threads(p);
+
+        timeit_start(t);
+        d_mat_mul(C, A, B);
+        timeit_stop(t);
+        mul = FLINT_MAX(t->wall, 1);
+
+        d_mat_clear(A);
+        d_mat_init(A, qm, qn);
+        d_mat_randtest(A, state);
+        timeit_start(t);
+        d_mat_qr(Q, R, A);
+        timeit_stop(t);
+        qr = FLINT_MAX(t->wall, 1);
+        d_mat_clear(A);
+        d_mat_init(A, n, n);
+        d_mat_randtest(A, state);
+
+        if (p == 1)
+        {
+            mul1 = mul;
+            qr1 = qr;
+        }
+
+        flint_printf("%7d  %17.0f  %7.2f  %5.2f  %17.0f  %7.2f  %5.2f\n",
+                     (int) p, mul, mul1 / mul, mul1 / (p * mul),
+                     qr, qr1 / qr, qr1 / (p * qr));
+    }
+
+    thread_pool_set_num_threads(1);
+
+    d_mat_clear(A);
+    d_mat_clear(B);
+    d_mat_clear(C);
+    d_mat_clear(Q);
+    d_mat_clear(R);
+
+    FLINT_TEST_CLEANUP(state);
+}
+
+
+int
+test_d_mat_qr_householder(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("qr_householder....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        double dot, norm, eps;
+        int j, k, l;
+        d_mat_t A, Q, R, B;
+
+        slong m, n;
+
+        m = n_randint(state, 100);
+        n = n_randint(state, 100);
+
+        d_mat_init(A, m, n);
+        d_mat_init(Q, m, n);
+        d_mat_init(R, n, n);
+        d_mat_init(B, m, n);
+
+        d_mat_randtest(A, state);
+
+        d_mat_qr_householder(Q, R, A);
+
+        d_mat_mul(B, Q, R);
+
+        eps = 4 * (m + n + 1) * D_EPS;
+
+        if (!d_mat_approx_equal(A, B, 4 * eps))
+        {
+            flint_printf("FAIL:\n");
+            flint_printf("A:\n");
+            d_mat_print(A);
+            flint_printf("Q:\n");
+            d_mat_print(Q);
+            flint_printf("R:\n");
+            d_mat_print(R);
+            flint_printf("B:\n");
+            d_mat_print(B);
+            abort();
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            for (k = 0; k < j && k < n; k++)
+            {
+                if (d_mat_entry(R, j, k) != 0)
+                {
+                    flint_printf("FAIL: R not upper triangular\n");
+                    d_mat_print(R);
+                    abort();
+                }
+            }
+            if (d_mat_entry(R, j, j) < 0)
+            {
+                flint_printf("FAIL: negative diagonal in R\n");
+                d_mat_print(R);
+                abort();
+            }
+            norm = 0;
+            for (l = 0; l < m; l++)
+            {
+                norm += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, j);
+            }
+            if (norm != 0 && fabs(norm - 1) > eps)
+            {
+                flint_printf("FAIL:\n");
+                flint_printf("Q:\n");
+                d_mat_print(Q);
+                flint_printf("%g\n", norm);
+                flint_printf("%d\n", j);
+                abort();
+            }
+            for (k = j + 1; k < n; k++)
+            {
+
+                dot = 0;
+                for (l = 0; l < m; l++)
+                {
+                    dot += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, k);
+                }
+
+                if (fabs(dot) > eps)
+                {
+                    flint_printf("FAIL:\n");
+                    flint_printf("Q:\n");
+                    d_mat_print(Q);
+                    flint_printf("%g\n", dot);
+                    flint_printf("%d %d\n", j, k);
+                    abort();
+                }
+            }
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(Q);
+        d_mat_clear(R);
+        d_mat_clear(B);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_mat_qr_tsqr(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("qr_tsqr....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        double dot, norm, eps;
+        int j, k, l;
+        d_mat_t A, Q, R, R2, B;
+
+        slong m, n, block_rows;
+
+        n = n_randint(state, 12);
+        m = n + n_randint(state, 300);
+        block_rows = 1 + n_randint(state, 40);
+
+        d_mat_init(A, m, n);
+        d_mat_init(Q, m, n);
+        d_mat_init(R, n, n);
+        d_mat_init(R2, n, n);
+        d_mat_init(B, m, n);
+
+        d_mat_randtest(A, state);
+
+        _d_mat_qr_tsqr(Q, R, A, block_rows);
+        _d_mat_qr_tsqr(NULL, R2, A, block_rows);
+
+        if (!d_mat_equal(R, R2))
+        {
+            flint_printf("FAIL: R differs when Q is not computed\n");
+            d_mat_print(R);
+            d_mat_print(R2);
+            abort();
+        }
+
+        d_mat_mul(B, Q, R);
+
+        eps = 4 * (m + n + 1) * D_EPS;
+
+        if (!d_mat_approx_equal(A, B, 4 * eps))
+        {
+            flint_printf("FAIL:\n");
+            flint_printf("A:\n");
+            d_mat_print(A);
+            flint_printf("Q:\n");
+            d_mat_print(Q);
+            flint_printf("R:\n");
+            d_mat_print(R);
+            flint_printf("B:\n");
+            d_mat_print(B);
+            abort();
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            for (k = 0; k < j; k++)
+            {
+                if (d_mat_entry(R, j, k) != 0)
+                {
+                    flint_printf("FAIL: R not upper triangular\n");
+                    d_mat_print(R);
+                    abort();
+                }
+            }
+            if (d_mat_entry(R, j, j) < 0)
+            {
+                flint_printf("FAIL: negative diagonal in R\n");
+                d_mat_print(R);
+                abort();
+            }
+            norm = 0;
+            for (l = 0; l < m; l++)
+            {
+                norm += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, j);
+            }
+            if (fabs(norm - 1) > eps)
+            {
+                flint_printf("FAIL:\n");
+                flint_printf("Q:\n");
+                d_mat_print(Q);
+                flint_printf("%g\n", norm);
+                flint_printf("%d\n", j);
+                abort();
+            }
+            for (k = j + 1; k < n; k++)
+            {
+
+                dot = 0;
+                for (l = 0; l < m; l++)
+                {
+                    dot += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, k);
+                }
+
+                if (fabs(dot) > eps)
+                {
+                    flint_printf("FAIL:\n");
+                    flint_printf("Q:\n");
+                    d_mat_print(Q);
+                    flint_printf("%g\n", dot);
+                    flint_printf("%d %d\n", j, k);
+                    abort();
+                }
+            }
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(Q);
+        d_mat_clear(R);
+        d_mat_clear(R2);
+        d_mat_clear(B);
+    }
+
+    /* with no rows, R must still be set to zero */
+    for (i = 0; i < 10; i++)
+    {
+        d_mat_t A, R;
+        slong n, j, k;
+
+        n = 1 + n_randint(state, 12);
+
+        d_mat_init(A, 0, n);
+        d_mat_init(R, n, n);
+        d_mat_randtest(R, state);
+
+        d_mat_qr_tsqr(NULL, R, A);
+
+        for (j = 0; j < n; j++)
+        {
+            for (k = 0; k < n; k++)
+            {
+                if (d_mat_entry(R, j, k) != 0)
+                {
+                    flint_printf("FAIL: R not zero for 0 rows\n");
+                    d_mat_print(R);
+                    abort();
+                }
+            }
+        }
+
+        d_mat_clear(A);
+        d_mat_clear(R);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_gso(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("gso_incremental....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_gso_t G, H;
+        d_mat_t A, B, C;
+        double *v, e;
+        slong m, n, j, k, l, op;
+
+        n = 1 + n_randint(state, 12);
+        m = n_randint(state, n + 1);
+
+        d_gso_init(G, n);
+        d_gso_init(H, n);
+        v = flint_malloc(n * sizeof(double));
+
+        d_mat_init(A, n, m);
+        d_mat_randtest(A, state);
+        d_gso_set_d_mat(G, A);
+        d_mat_clear(A);
+
+        for (op = 0; op < 20; op++)
+        {
+            switch (n_randint(state, 4))
+            {
+            case 0:
+                if (G->m >= 2)
+                    d_gso_swap(G, n_randint(state, G->m - 1));
+                break;
+            case 1:
+                if (G->m >= 2)
+                {
+                    k = 1 + n_randint(state, G->m - 1);
+                    j = n_randint(state, k);
+                    d_gso_size_reduce(G, k, j, rint(d_gso_mu(G, k, j)));
+                }
+                break;
+            case 2:
+                if (G->m < n)
+                {
+                    for (l = 0; l < n; l++)
+                        v[l] = d_randtest(state);
+                    d_gso_insert(G, n_randint(state, G->m + 1), v);
+                }
+                break;
+            default:
+                if (G->m > 0)
+                    d_gso_delete(G, n_randint(state, G->m));
+            }
+
+            m = G->m;
+            d_mat_init(A, n, m);
+            d_mat_init(B, n, m);
+            d_mat_init(C, n, m);
+
+            for (j = 0; j < m; j++)
+                for (l = 0; l < n; l++)
+                    d_mat_entry(A, l, j) = d_gso_vec(G, j)[l];
+
+            d_gso_set_d_mat(H, A);
+            d_mat_gso(B, A);
+            d_gso_get_mat(C, G);
+
+            /* the updates are exact up to rounding, see d_gso_struct */
+            e = 1e-8;
+            for (j = 0; j < m; j++)
+            {
+                if (fabs(d_gso_r(G, j) - d_gso_r(H, j))
+                        > e * FLINT_MAX(1, d_gso_r(H, j)))
+                {
+                    flint_printf("FAIL (r):\n");
+                    flint_printf("n = %wd, m = %wd, j = %wd: %g %g\n", n, m, j,
+                                 d_gso_r(G, j), d_gso_r(H, j));
+                    abort();
+                }
+                for (k = 0; k < j; k++)
+                {
+                    if (fabs(d_gso_mu(G, j, k) - d_gso_mu(H, j, k))
+                            > e * FLINT_MAX(1, fabs(d_gso_mu(H, j, k))))
+                    {
+                        flint_printf("FAIL (mu):\n");
+                        flint_printf("n = %wd, m = %wd, j = %wd, k = %wd\n",
+                                     n, m, j, k);
+                        abort();
+                    }
+                }
+            }
+
+            if (!d_mat_approx_equal(B, C, e))
+            {
+                flint_printf("FAIL (incremental gso):\n");
+                d_mat_print(B);
+                d_mat_print(C);
+                abort();
+            }
+
+            d_mat_clear(A);
+            d_mat_clear(B);
+            d_mat_clear(C);
+        }
+
+        d_gso_clear(G);
+        d_gso_clear(H);
+        flint_free(v);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+int
+test_d_mat_batch(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("batch....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_batch_t A, Q, R, B;
+        d_mat_t a, q, r, q1, r1, p;
+        slong m, n, count, k, j, l;
+
+        m = n_randint(state, 10);
+        n = n_randint(state, 10);
+        count = n_randint(state, 40);
+
+        d_mat_batch_init(A, count, m, n);
+        d_mat_batch_init(Q, count, m, n);
+        d_mat_batch_init(R, count, n, n);
+        d_mat_batch_init(B, count, m, n);
+        d_mat_init(a, m, n);
+        d_mat_init(q, m, n);
+        d_mat_init(r, n, n);
+        d_mat_init(q1, m, n);
+        d_mat_init(r1, n, n);
+        d_mat_init(p, m, n);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_randtest(a, state);
+            d_mat_batch_set_d_mat(A, k, a);
+        }
+
+        d_mat_batch_qr(Q, R, A);
+        d_mat_batch_gso(B, A);
+        d_mat_batch_gso(A, A);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_batch_get_d_mat(q, Q, k);
+            d_mat_batch_get_d_mat(r, R, k);
+            d_mat_batch_get_d_mat(q1, B, k);
+            d_mat_batch_get_d_mat(p, A, k);
+
+            if (!d_mat_equal(q, q1) || !d_mat_equal(q, p))
+            {
+                flint_printf("FAIL (gso):\n");
                 abort();
             }
-            for (k = j + 1; k < n; k++)
-            {
 
-                dot = 0;
+            /* the matrix itself went to A, recover it from Q R */
+            d_mat_mul(a, q, r);
+            d_mat_zero(r1);
+            d_mat_qr_mgs(q1, r1, a);
+
+            /* beyond the rank the columns of Q are not determined */
+            for (j = 0; j < FLINT_MIN(m, n); j++)
+            {
                 for (l = 0; l < m; l++)
                 {
-                    dot += d_mat_entry(Q, l, j) * d_mat_entry(Q, l, k);
+                    if (fabs(d_mat_entry(q, l, j) - d_mat_entry(q1, l, j)) > 1e-8)
+                    {
+                        flint_printf("FAIL (qr):\n");
+                        flint_printf("m = %wd, n = %wd, k = %wd\n", m, n, k);
+                        d_mat_print(q);
+                        d_mat_print(q1);
+                        abort();
+                    }
+                }
+                for (l = 0; l <= j; l++)
+                {
+                    if (fabs(d_mat_entry(r, l, j) - d_mat_entry(r1, l, j))
+                            > 1e-8 * FLINT_MAX(1, fabs(d_mat_entry(r1, l, j))))
+                    {
+                        flint_printf("FAIL (qr, R):\n");
+                        flint_printf("m = %wd, n = %wd, k = %wd\n", m, n, k);
+                        d_mat_print(r);
+                        d_mat_print(r1);
+                        abort();
+                    }
                 }
+            }
+        }
 
-                if (fabs(dot) > 2 * D_EPS)
+        d_mat_batch_clear(A);
+        d_mat_batch_clear(Q);
+        d_mat_batch_clear(R);
+        d_mat_batch_clear(B);
+        d_mat_clear(a);
+        d_mat_clear(q);
+        d_mat_clear(r);
+        d_mat_clear(q1);
+        d_mat_clear(r1);
+        d_mat_clear(p);
+    }
+
+    /* Q R = A and orthonormality, as for d_mat_qr */
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_batch_t A, Q, R;
+        d_mat_t a, b, q, r;
+        double dot;
+        slong m, n, count, k, j, l, h;
+
+        m = n_randint(state, 17);
+        n = n_randint(state, 17);
+        count = 1 + n_randint(state, 20);
+
+        d_mat_batch_init(A, count, m, n);
+        d_mat_batch_init(Q, count, m, n);
+        d_mat_batch_init(R, count, n, n);
+        d_mat_init(a, m, n);
+        d_mat_init(b, m, n);
+        d_mat_init(q, m, n);
+        d_mat_init(r, n, n);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_randtest(a, state);
+            d_mat_batch_set_d_mat(A, k, a);
+        }
+
+        d_mat_batch_qr(Q, R, A);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_batch_get_d_mat(a, A, k);
+            d_mat_batch_get_d_mat(q, Q, k);
+            d_mat_batch_get_d_mat(r, R, k);
+            d_mat_mul(b, q, r);
+
+            if (!d_mat_approx_equal(a, b, 3 * D_EPS))
+            {
+                flint_printf("FAIL (Q R):\n");
+                d_mat_print(a);
+                d_mat_print(b);
+                abort();
+            }
+
+            for (j = 0; j < n; j++)
+            {
+                for (l = j; l < n; l++)
                 {
-                    flint_printf("FAIL:\n");
-                    flint_printf("Q:\n");
-                    d_mat_print(Q);
-                    flint_printf("%g\n", dot);
-                    flint_printf("%d %d\n", j, k);
-                    abort();
+                    dot = 0;
+                    for (h = 0; h < m; h++)
+                        dot += d_mat_entry(q, h, j) * d_mat_entry(q, h, l);
+                    if (l == j ? (dot != 0 && fabs(dot - 1) > 4 * D_EPS)
+                               : fabs(dot) > 2 * D_EPS)
+                    {
+                        flint_printf("FAIL (orthonormality):\n");
+                        d_mat_print(q);
+                        abort();
+                    }
                 }
             }
         }
 
+        d_mat_batch_clear(A);
+        d_mat_batch_clear(Q);
+        d_mat_batch_clear(R);
+        d_mat_clear(a);
+        d_mat_clear(b);
+        d_mat_clear(q);
+        d_mat_clear(r);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Checks the fixed-size r x c routines against d_mat_mul, d_mat_gso and
+    d_mat_qr_mgs on the matrices a (r x c) and b (c x c), going through
+    the conversions.
+*/
+#define TEST_D_MAT_FIXED(r, c)                                              \
+do {                                                                        \
+    d_mat_##r##x##c##_t A, Q;                                               \
+    d_mat_##c##x##c##_t B, R;                                               \
+    d_mat_t a, b, d, e, q, t;                                               \
+                                                                            \
+    d_mat_init(a, r, c);                                                    \
+    d_mat_init(b, c, c);                                                    \
+    d_mat_init(d, r, c);                                                    \
+    d_mat_init(e, r, c);                                                    \
+    d_mat_init(q, r, c);                                                    \
+    d_mat_init(t, c, c);                                                    \
+                                                                            \
+    d_mat_randtest(a, state);                                               \
+    d_mat_randtest(b, state);                                               \
+    d_mat_##r##x##c##_set_d_mat(A, a);                                      \
+    d_mat_##c##x##c##_set_d_mat(B, b);                                      \
+                                                                            \
+    d_mat_##r##x##c##_get_d_mat(d, A);                                      \
+    if (!d_mat_equal(a, d))                                                 \
+    {                                                                       \
+        flint_printf("FAIL (" #r "x" #c " conversion):\n");                 \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    d_mat_mul(d, a, b);                                                     \
+    d_mat_##r##x##c##_mul(Q, A, B);                                         \
+    d_mat_##r##x##c##_mul(A, A, B);                                         \
+    d_mat_##r##x##c##_get_d_mat(e, Q);                                      \
+    d_mat_##r##x##c##_get_d_mat(q, A);                                      \
+    if (!d_mat_approx_equal(d, e, (c + 1) * (c + 1) * D_EPS)                \
+        || !d_mat_equal(e, q))                                              \
+    {                                                                       \
+        flint_printf("FAIL (" #r "x" #c " mul):\n");                        \
+        d_mat_print(d);                                                     \
+        d_mat_print(e);                                                     \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    d_mat_##r##x##c##_set_d_mat(A, a);                                      \
+    d_mat_##r##x##c##_qr(Q, R, A);                                          \
+    d_mat_##r##x##c##_get_d_mat(q, Q);                                      \
+    d_mat_##c##x##c##_get_d_mat(t, R);                                      \
+    d_mat_mul(d, q, t);                                                     \
+    if (!d_mat_approx_equal(a, d, 3 * D_EPS))                               \
+    {                                                                       \
+        flint_printf("FAIL (" #r "x" #c " Q R):\n");                        \
+        d_mat_print(a);                                                     \
+        d_mat_print(d);                                                     \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    d_mat_zero(t);                                                          \
+    d_mat_qr_mgs(e, t, a);                                                  \
+    d_mat_##c##x##c##_get_d_mat(b, R);                                      \
+    if (!d_mat_approx_equal(b, t, 4 * (r + c) * D_EPS))                     \
+    {                                                                       \
+        flint_printf("FAIL (" #r "x" #c " R):\n");                          \
+        d_mat_print(b);                                                     \
+        d_mat_print(t);                                                     \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    d_mat_##r##x##c##_gso(A, A);                                            \
+    d_mat_##r##x##c##_get_d_mat(d, A);                                      \
+    if (!d_mat_equal(d, q))                                                 \
+    {                                                                       \
+        flint_printf("FAIL (" #r "x" #c " gso):\n");                        \
+        d_mat_print(d);                                                     \
+        d_mat_print(q);                                                     \
+        abort();                                                            \
+    }                                                                       \
+                                                                            \
+    d_mat_clear(a);                                                         \
+    d_mat_clear(b);                                                         \
+    d_mat_clear(d);                                                         \
+    d_mat_clear(e);                                                         \
+    d_mat_clear(q);                                                         \
+    d_mat_clear(t);                                                         \
+} while (0)
+
+int
+test_d_mat_fixed(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("fixed....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        TEST_D_MAT_FIXED(2, 2);
+        TEST_D_MAT_FIXED(3, 3);
+        TEST_D_MAT_FIXED(4, 4);
+        TEST_D_MAT_FIXED(6, 6);
+        TEST_D_MAT_FIXED(8, 8);
+        TEST_D_MAT_FIXED(3, 2);
+        TEST_D_MAT_FIXED(4, 3);
+        TEST_D_MAT_FIXED(8, 4);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+
+    flint_printf("PASS\n");
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Allocation counters for the tests of the fused products: the FLINT
+    allocator is replaced by counting wrappers while they are measured.
+*/
+static slong d_mat_test_allocs = 0;
+
+static void *
+d_mat_test_malloc(size_t n)
+{
+    d_mat_test_allocs++;
+    return malloc(n);
+}
+
+static void *
+d_mat_test_calloc(size_t k, size_t n)
+{
+    d_mat_test_allocs++;
+    return calloc(k, n);
+}
+
+static void *
+d_mat_test_realloc(void *p, size_t n)
+{
+    d_mat_test_allocs++;
+    return realloc(p, n);
+}
+
+static void
+d_mat_test_count_allocs(int on)
+{
+    if (on)
+        __flint_set_memory_functions(d_mat_test_malloc, d_mat_test_calloc,
+                                     d_mat_test_realloc, free);
+    else
+        __flint_set_memory_functions(malloc, calloc, realloc, free);
+}
+
+/* The explicit sequences the fused products replace. */
+static void
+d_mat_transpose_naive(d_mat_t B, const d_mat_t A)
+{
+    slong i, j;
+
+    for (i = 0; i < A->r; i++)
+        for (j = 0; j < A->c; j++)
+            d_mat_entry(B, j, i) = d_mat_entry(A, i, j);
+}
+
+static void
+d_mat_gram_naive(d_mat_t C, const d_mat_t A)
+{
+    d_mat_t T;
+
+    d_mat_init(T, A->c, A->r);
+    d_mat_transpose_naive(T, A);
+    d_mat_mul(C, A, T);
+    d_mat_clear(T);
+}
+
+static void
+d_mat_addmul_naive(d_mat_t C, const d_mat_t A, const d_mat_t B)
+{
+    d_mat_t T;
+    slong i, j;
+
+    d_mat_init(T, C->r, C->c);
+    d_mat_mul(T, A, B);
+    for (i = 0; i < C->r; i++)
+        for (j = 0; j < C->c; j++)
+            d_mat_entry(C, i, j) += d_mat_entry(T, i, j);
+    d_mat_clear(T);
+}
+
+static double
+d_mat_mul_residual_naive(const d_mat_t A, const d_mat_t B, const d_mat_t C)
+{
+    d_mat_t T;
+    slong i, j;
+    double d, res = 0;
+
+    d_mat_init(T, C->r, C->c);
+    d_mat_mul(T, A, B);
+    for (i = 0; i < C->r; i++)
+    {
+        for (j = 0; j < C->c; j++)
+        {
+            d = d_mat_entry(T, i, j) - d_mat_entry(C, i, j);
+            res += d * d;
+        }
+    }
+    d_mat_clear(T);
+
+    return sqrt(res);
+}
+
+int
+test_d_mat_fused(void)
+{
+    int i;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("fused....");
+    fflush(stdout);
+
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        d_mat_t A, B, C, D;
+        slong m, k, n, a1, a2;
+        double r1, r2;
+
+        m = n_randint(state, i % 4 == 0 ? 150 : 40);
+        k = n_randint(state, i % 4 == 0 ? 150 : 40);
+        n = n_randint(state, i % 4 == 0 ? 150 : 40);
+
+        d_mat_init_layout(A, m, k, n_randint(state, 2));
+        d_mat_init_layout(B, k, n, n_randint(state, 2));
+        d_mat_init_layout(C, m, m, n_randint(state, 2));
+        d_mat_init_layout(D, m, m, n_randint(state, 2));
+        d_mat_randtest(A, state);
+        d_mat_randtest(B, state);
+
+        /* A A^T, serially and on the thread pool */
+        thread_pool_set_num_threads(1 + n_randint(state, 4));
+        d_mat_gram(C, A);
+        thread_pool_set_num_threads(1);
+        d_mat_gram_naive(D, A);
+        if (!d_mat_approx_equal(C, D, (k + 1) * (k + 1) * D_EPS))
+        {
+            flint_printf("FAIL (gram):\n");
+            d_mat_print(C);
+            d_mat_print(D);
+            abort();
+        }
+
+        d_mat_test_allocs = 0;
+        d_mat_test_count_allocs(1);
+        d_mat_gram(C, A);
+        a1 = d_mat_test_allocs;
+        d_mat_gram_naive(D, A);
+        a2 = d_mat_test_allocs - a1;
+        d_mat_test_count_allocs(0);
+        if (a1 > 2 || (m != 0 && k != 0 && a1 >= a2))
+        {
+            flint_printf("FAIL (gram allocations): %wd, %wd\n", a1, a2);
+            abort();
+        }
+
+        d_mat_clear(C);
+        d_mat_clear(D);
+        d_mat_init_layout(C, m, n, n_randint(state, 2));
+        d_mat_init_layout(D, m, n, D_MAT_ROW_MAJOR);
+
+        /* C += A B */
+        d_mat_randtest(C, state);
+        d_mat_set(D, C);
+        d_mat_test_allocs = 0;
+        d_mat_test_count_allocs(1);
+        d_mat_addmul(C, A, B);
+        a1 = d_mat_test_allocs;
+        d_mat_addmul_naive(D, A, B);
+        a2 = d_mat_test_allocs - a1;
+        d_mat_test_count_allocs(0);
+        if (!d_mat_approx_equal(C, D, (k + 2) * (k + 2) * D_EPS))
+        {
+            flint_printf("FAIL (addmul):\n");
+            d_mat_print(C);
+            d_mat_print(D);
+            abort();
+        }
+        if (a1 > 2 || (m != 0 && n != 0 && a1 >= a2))
+        {
+            flint_printf("FAIL (addmul allocations): %wd, %wd\n", a1, a2);
+            abort();
+        }
+
+        /* ||A B - C|| */
+        d_mat_test_allocs = 0;
+        d_mat_test_count_allocs(1);
+        r1 = d_mat_mul_residual(A, B, C);
+        a1 = d_mat_test_allocs;
+        r2 = d_mat_mul_residual_naive(A, B, C);
+        a2 = d_mat_test_allocs - a1;
+        d_mat_test_count_allocs(0);
+        if (fabs(r1 - r2) > (k + 2) * (k + 2) * D_EPS * (1 + r2)
+            || a1 > 3 || (m != 0 && n != 0 && a1 >= a2))
+        {
+            flint_printf("FAIL (residual): %g, %g, %wd\n", r1, r2, a1);
+            abort();
+        }
+
+        /* with aliasing */
+        if (n == k)
+        {
+            d_mat_set(D, C);
+            d_mat_addmul_naive(D, C, B);
+            d_mat_addmul(C, C, B);
+            if (!d_mat_approx_equal(C, D, (k + 2) * (k + 2) * D_EPS))
+            {
+                flint_printf("FAIL (addmul aliasing):\n");
+                abort();
+            }
+        }
+
+        /* Q R - A vanishes */
+        if (m >= k)
+        {
+            d_mat_t Q, R, Z;
+
+            d_mat_init(Q, m, k);
+            d_mat_init(R, k, k);
+            d_mat_init(Z, m, k);
+            d_mat_zero(Z);
+            d_mat_zero(R);
+            d_mat_qr(Q, R, A);
+            r1 = d_mat_mul_residual(Q, R, A);
+            r2 = d_mat_mul_residual(Q, R, Z);
+            if (r1 > (m + k + 1) * (k + 1) * D_EPS * r2)
+            {
+                flint_printf("FAIL (Q R residual): %g\n", r1);
+                abort();
+            }
+            d_mat_clear(Q);
+            d_mat_clear(R);
+            d_mat_clear(Z);
+        }
+
         d_mat_clear(A);
-        d_mat_clear(Q);
-        d_mat_clear(R);
         d_mat_clear(B);
+        d_mat_clear(C);
+        d_mat_clear(D);
     }
 
     FLINT_TEST_CLEANUP(state);
@@ -583,10 +5691,615 @@ test_d_mat_qr(void)
 }
 
 
+/*
+    The tests of d_mat_mul, d_mat_qr and d_mat_gso for the matrices over
+    type T with unit roundoff EPS: products of small integers are exact in
+    every precision, and the bounds on Q R - A and on the orthonormality
+    of Q are scaled by EPS. Ill-conditioned matrices (a Hilbert matrix
+    times a random one) are included, on which Q must be orthonormal to
+    working precision all the same, and matrices scaled by TINY and by
+    1 / TINY, which for q_mat_t lie outside the range of double. Some
+    products are up to MUL larger in every dimension, to run through
+    several blocks of the float kernel.
+*/
+#define TEST_D_MAT_SCALAR(p, T, EPS, TINY, MUL)                             \
+int                                                                         \
+test_##p##_mat(void)                                                        \
+{                                                                           \
+    int i;                                                                  \
+    FLINT_TEST_INIT(state);                                                 \
+                                                                            \
+    flint_printf(#p "_mat....");                                            \
+    fflush(stdout);                                                         \
+                                                                            \
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)                     \
+    {                                                                       \
+        p##_mat_t A, B, C, Q, R;                                            \
+        d_mat_t a, b, c, d;                                                 \
+        slong m, n, k, mm, nn, h, j, l;                                     \
+        T dot, err, norm;                                                   \
+                                                                            \
+        m = n_randint(state, 40);                                           \
+        n = n_randint(state, m + 1);                                        \
+        k = n_randint(state, 40);                                           \
+                                                                            \
+        /* some products are up to MUL larger in every dimension */         \
+        mm = m + (i % 8 == 0 ? n_randint(state, MUL + 1) : 0);              \
+        nn = n + (i % 8 == 0 ? n_randint(state, MUL + 1) : 0);              \
+        k += i % 8 == 0 ? n_randint(state, MUL + 1) : 0;                    \
+                                                                            \
+        p##_mat_init(A, mm, k);                                             \
+        p##_mat_init(B, k, nn);                                             \
+        p##_mat_init(C, mm, nn);                                            \
+        d_mat_init(a, mm, k);                                               \
+        d_mat_init(b, k, nn);                                               \
+        d_mat_init(c, mm, nn);                                              \
+        d_mat_init(d, mm, nn);                                              \
+                                                                            \
+        for (h = 0; h < mm; h++)                                            \
+            for (j = 0; j < k; j++)                                         \
+                d_mat_entry(a, h, j) = (double) n_randint(state, 101) - 50; \
+        for (h = 0; h < k; h++)                                             \
+            for (j = 0; j < nn; j++)                                        \
+                d_mat_entry(b, h, j) = (double) n_randint(state, 101) - 50; \
+                                                                            \
+        p##_mat_set_d_mat(A, a);                                            \
+        p##_mat_set_d_mat(B, b);                                            \
+        p##_mat_mul(C, A, B);                                               \
+        p##_mat_get_d_mat(c, C);                                            \
+        d_mat_mul(d, a, b);                                                 \
+        if (!d_mat_equal(c, d))                                             \
+        {                                                                   \
+            flint_printf("FAIL (mul):\n");                                  \
+            d_mat_print(c);                                                 \
+            d_mat_print(d);                                                 \
+            abort();                                                        \
+        }                                                                   \
+                                                                            \
+        p##_mat_clear(A);                                                   \
+        p##_mat_clear(B);                                                   \
+        p##_mat_clear(C);                                                   \
+        d_mat_clear(a);                                                     \
+        d_mat_clear(b);                                                     \
+        d_mat_clear(c);                                                     \
+        d_mat_clear(d);                                                     \
+                                                                            \
+        /* Q R = A, with Q orthonormal */                                   \
+        p##_mat_init(A, m, n);                                              \
+        p##_mat_init(B, m, n);                                              \
+        p##_mat_init(Q, m, n);                                              \
+        p##_mat_init(R, n, n);                                              \
+        d_mat_init(a, m, n);                                                \
+        d_mat_randtest(a, state);                                           \
+        p##_mat_set_d_mat(A, a);                                            \
+                                                                            \
+        if (i % 4 == 0)                                                     \
+        {                                                                   \
+            /* rows of the Hilbert matrix of size m times A */              \
+            p##_mat_init(C, m, m);                                          \
+            for (h = 0; h < m; h++)                                         \
+                for (j = 0; j < m; j++)                                     \
+                    p##_mat_entry(C, h, j) = (T) 1 / (T) (h + j + 1);       \
+            p##_mat_mul(A, C, A);                                           \
+            p##_mat_clear(C);                                               \
+        }                                                                   \
+        else if (i % 4 != 3)                                                \
+        {                                                                   \
+            for (h = 0; h < m; h++)                                         \
+                for (j = 0; j < n; j++)                                     \
+                    p##_mat_entry(A, h, j) *= i % 4 == 1 ? (T) (TINY)       \
+                                                         : 1 / (T) (TINY);  \
+        }                                                                   \
+                                                                            \
+        p##_mat_zero(R);                                                    \
+        p##_mat_qr(Q, R, A);                                                \
+        p##_mat_mul(B, Q, R);                                               \
+                                                                            \
+        for (j = 0; j < n; j++)                                             \
+        {                                                                   \
+            norm = 0;                                                       \
+            for (h = 0; h < m; h++)                                         \
+                norm += p##_mat_entry(A, h, j) * p##_mat_entry(A, h, j);    \
+            for (h = 0; h < m; h++)                                         \
+            {                                                               \
+                err = p##_mat_entry(B, h, j) - p##_mat_entry(A, h, j);      \
+                if (!(err * err                                             \
+                      <= 4 * (m + 1) * (m + 1) * EPS * EPS * norm))         \
+                {                                                           \
+                    flint_printf("FAIL (Q R = A): %g\n", (double) err);     \
+                    abort();                                                \
+                }                                                           \
+            }                                                               \
+                                                                            \
+            for (l = j; l < n; l++)                                         \
+            {                                                               \
+                dot = 0;                                                    \
+                for (h = 0; h < m; h++)                                     \
+                    dot += p##_mat_entry(Q, h, j) * p##_mat_entry(Q, h, l); \
+                if (l == j && dot != 0)                                     \
+                    dot -= 1;                                               \
+                if (!(dot <= 2 * (m + 1) * EPS                              \
+                      && -dot <= 2 * (m + 1) * EPS))                        \
+                {                                                           \
+                    flint_printf("FAIL (orthonormality): %g\n",             \
+                                 (double) dot);                             \
+                    abort();                                                \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        p##_mat_gso(A, A);                                                  \
+        for (j = 0; j < n; j++)                                             \
+            for (h = 0; h < m; h++)                                         \
+                if (p##_mat_entry(A, h, j) != p##_mat_entry(Q, h, j))       \
+                {                                                           \
+                    flint_printf("FAIL (gso)\n");                           \
+                    abort();                                                \
+                }                                                           \
+                                                                            \
+        p##_mat_clear(A);                                                   \
+        p##_mat_clear(B);                                                   \
+        p##_mat_clear(Q);                                                   \
+        p##_mat_clear(R);                                                   \
+        d_mat_clear(a);                                                     \
+    }                                                                       \
+                                                                            \
+    FLINT_TEST_CLEANUP(state);                                              \
+                                                                            \
+    flint_printf("PASS\n");                                                 \
+    return EXIT_SUCCESS;                                                    \
+}
+
+#if defined(__SIZEOF_FLOAT128__)
+#define Q_TINY ((d_quad) 0x1p-700 * (d_quad) 0x1p-700)
+#else
+#define Q_TINY 1
+#endif
+
+TEST_D_MAT_SCALAR(s, float, S_EPS, 1, 300)
+TEST_D_MAT_SCALAR(q, d_quad, Q_EPS, Q_TINY, 0)
+
+
+/*
+    Compares d_mat_qr called on every matrix of a batch with d_mat_batch_qr,
+    in ns per matrix, on 256 matrices factored over and over in cache, and
+    once on a batch of about 2^22 entries streamed from memory.
+*/
+void
+profile_d_mat_batch(void)
+{
+    slong sizes[] = {3, 4, 6, 8, 12, 16};
+    slong i, j, k, n, count, reps;
+    double t1, t2, t3, t4;
+    timeit_t t;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("    n  cached: d_mat_qr   batch  speedup  "
+                 "streamed: d_mat_qr   batch  speedup\n");
+
+    for (i = 0; i < (slong) (sizeof(sizes) / sizeof(slong)); i++)
+    {
+        d_mat_struct *A, *Q, *R;
+        d_mat_batch_t BA, BQ, BR, CA, CQ, CR;
+
+        n = sizes[i];
+        count = (WORD(1) << 22) / (n * n);
+        reps = count / 256;
+
+        A = flint_malloc(count * sizeof(d_mat_struct));
+        Q = flint_malloc(count * sizeof(d_mat_struct));
+        R = flint_malloc(count * sizeof(d_mat_struct));
+        d_mat_batch_init(BA, count, n, n);
+        d_mat_batch_init(BQ, count, n, n);
+        d_mat_batch_init(BR, count, n, n);
+        d_mat_batch_init(CA, 256, n, n);
+        d_mat_batch_init(CQ, 256, n, n);
+        d_mat_batch_init(CR, 256, n, n);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_init(A + k, n, n);
+            d_mat_init(Q + k, n, n);
+            d_mat_init(R + k, n, n);
+            d_mat_randtest(A + k, state);
+            d_mat_batch_set_d_mat(BA, k, A + k);
+            if (k < 256)
+                d_mat_batch_set_d_mat(CA, k, A + k);
+        }
+
+        timeit_start(t);
+        for (j = 0; j < reps; j++)
+            for (k = 0; k < 256; k++)
+                d_mat_qr(Q + k, R + k, A + k);
+        timeit_stop(t);
+        t1 = 1e6 * t->wall / (reps * 256);
+
+        timeit_start(t);
+        for (j = 0; j < reps; j++)
+            d_mat_batch_qr(CQ, CR, CA);
+        timeit_stop(t);
+        t2 = 1e6 * FLINT_MAX(t->wall, 1) / (reps * 256);
+
+        timeit_start(t);
+        for (k = 0; k < count; k++)
+            d_mat_qr(Q + k, R + k, A + k);
+        timeit_stop(t);
+        t3 = 1e6 * t->wall / count;
+
+        timeit_start(t);
+        d_mat_batch_qr(BQ, BR, BA);
+        timeit_stop(t);
+        t4 = 1e6 * FLINT_MAX(t->wall, 1) / count;
+
+        flint_printf("%5d  %16.0f  %6.0f  %7.1f  %18.0f  %6.0f  %7.1f\n",
+                     (int) n, t1, t2, t1 / t2, t3, t4, t3 / t4);
+
+        for (k = 0; k < count; k++)
+        {
+            d_mat_clear(A + k);
+            d_mat_clear(Q + k);
+            d_mat_clear(R + k);
+        }
+        flint_free(A);
+        flint_free(Q);
+        flint_free(R);
+        d_mat_batch_clear(BA);
+        d_mat_batch_clear(BQ);
+        d_mat_batch_clear(BR);
+        d_mat_batch_clear(CA);
+        d_mat_batch_clear(CQ);
+        d_mat_batch_clear(CR);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+}
+
+
+/*
+    Latency in ns of the fixed-size n x n routines against d_mat_mul,
+    d_mat_gso and d_mat_qr_mgs on the same matrices, 256 of them used over
+    and over in cache.
+*/
+#define PROFILE_D_MAT_FIXED(n)                                              \
+do {                                                                        \
+    d_mat_##n##x##n##_struct *A, *B, *C;                                    \
+    d_mat_struct *a, *b, *c;                                                \
+    double t1, t2, t3, t4, t5, t6;                                          \
+    timeit_t t;                                                             \
+    slong j, k, reps = 4000 / n;                                            \
+                                                                            \
+    A = flint_malloc(256 * sizeof(d_mat_##n##x##n##_struct));               \
+    B = flint_malloc(256 * sizeof(d_mat_##n##x##n##_struct));               \
+    C = flint_malloc(256 * sizeof(d_mat_##n##x##n##_struct));               \
+    a = flint_malloc(256 * sizeof(d_mat_struct));                           \
+    b = flint_malloc(256 * sizeof(d_mat_struct));                           \
+    c = flint_malloc(256 * sizeof(d_mat_struct));                           \
+    for (k = 0; k < 256; k++)                                               \
+    {                                                                       \
+        d_mat_init(a + k, n, n);                                            \
+        d_mat_init(b + k, n, n);                                            \
+        d_mat_init(c + k, n, n);                                            \
+        d_mat_randtest(a + k, state);                                       \
+        d_mat_randtest(b + k, state);                                       \
+        d_mat_##n##x##n##_set_d_mat(A + k, a + k);                          \
+        d_mat_##n##x##n##_set_d_mat(B + k, b + k);                          \
+    }                                                                       \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+            d_mat_mul(c + k, a + k, b + (k ^ (j & 255)));                     \
+    timeit_stop(t);                                                         \
+    t1 = 1e6 * t->wall / (reps * 256);                                      \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+            d_mat_##n##x##n##_mul(C + k, A + k, B + (k ^ (j & 255)));         \
+    timeit_stop(t);                                                         \
+    t2 = 1e6 * FLINT_MAX(t->wall, 1) / (reps * 256);                        \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+            d_mat_gso(c + k, a + k);                                        \
+    timeit_stop(t);                                                         \
+    t3 = 1e6 * t->wall / (reps * 256);                                      \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+            d_mat_##n##x##n##_gso(C + k, A + k);                            \
+    timeit_stop(t);                                                         \
+    t4 = 1e6 * FLINT_MAX(t->wall, 1) / (reps * 256);                        \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+        {                                                                   \
+            d_mat_zero(b + k);                                              \
+            d_mat_qr_mgs(c + k, b + k, a + k);                              \
+        }                                                                   \
+    timeit_stop(t);                                                         \
+    t5 = 1e6 * t->wall / (reps * 256);                                      \
+                                                                            \
+    timeit_start(t);                                                        \
+    for (j = 0; j < reps; j++)                                              \
+        for (k = 0; k < 256; k++)                                           \
+            d_mat_##n##x##n##_qr(C + k, B + k, A + k);                      \
+    timeit_stop(t);                                                         \
+    t6 = 1e6 * FLINT_MAX(t->wall, 1) / (reps * 256);                        \
+                                                                            \
+    flint_printf("%5d  %8.0f %6.0f %5.1f  %8.0f %6.0f %5.1f"                \
+                 "  %8.0f %6.0f %5.1f\n", (int) n, t1, t2, t1 / t2,         \
+                 t3, t4, t3 / t4, t5, t6, t5 / t6);                         \
+                                                                            \
+    for (k = 0; k < 256; k++)                                               \
+    {                                                                       \
+        d_mat_clear(a + k);                                                 \
+        d_mat_clear(b + k);                                                 \
+        d_mat_clear(c + k);                                                 \
+    }                                                                       \
+    flint_free(A);                                                          \
+    flint_free(B);                                                          \
+    flint_free(C);                                                          \
+    flint_free(a);                                                          \
+    flint_free(b);                                                          \
+    flint_free(c);                                                          \
+} while (0)
+
+void
+profile_d_mat_fixed(void)
+{
+    FLINT_TEST_INIT(state);
+
+    flint_printf("    n       mul  fixed   gain       gso  fixed   gain"
+                 "        qr  fixed   gain\n");
+
+    PROFILE_D_MAT_FIXED(2);
+    PROFILE_D_MAT_FIXED(3);
+    PROFILE_D_MAT_FIXED(4);
+    PROFILE_D_MAT_FIXED(6);
+    PROFILE_D_MAT_FIXED(8);
+
+    FLINT_TEST_CLEANUP(state);
+}
+
+
+/*
+    Times d_mat_gram, d_mat_addmul and d_mat_mul_residual against the
+    explicit sequences (transpose then multiply, multiply then add,
+    multiply then subtract), in ms, with the number of allocations made.
+*/
+void
+profile_d_mat_fused(void)
+{
+    slong sizes[] = {16, 64, 256, 1024};
+    slong i, j, n, reps, a[6];
+    double t[6];
+    timeit_t T;
+    FLINT_TEST_INIT(state);
+
+    flint_printf("    n      A A^T  explicit    C += A B  explicit"
+                 "    |A B - C|  explicit\n");
+
+    for (i = 0; i < (slong) (sizeof(sizes) / sizeof(slong)); i++)
+    {
+        d_mat_t A, B, C;
+
+        n = sizes[i];
+        reps = FLINT_MAX(1, (WORD(1) << 27) / (n * n * n));
+
+        d_mat_init(A, n, n);
+        d_mat_init(B, n, n);
+        d_mat_init(C, n, n);
+        d_mat_randtest(A, state);
+        d_mat_randtest(B, state);
+        d_mat_randtest(C, state);
+
+#define PROFILE_D_MAT_FUSED(k, expr)                                \
+        do {                                                        \
+            d_mat_test_allocs = 0;                                  \
+            d_mat_test_count_allocs(1);                             \
+            expr;                                                   \
+            d_mat_test_count_allocs(0);                             \
+            a[k] = d_mat_test_allocs;                               \
+            timeit_start(T);                                        \
+            for (j = 0; j < reps; j++)                              \
+                expr;                                               \
+            timeit_stop(T);                                         \
+            t[k] = (double) T->wall / reps;                         \
+        } while (0)
+
+        PROFILE_D_MAT_FUSED(0, d_mat_gram(C, A));
+        PROFILE_D_MAT_FUSED(1, d_mat_gram_naive(C, A));
+        PROFILE_D_MAT_FUSED(2, d_mat_addmul(C, A, B));
+        PROFILE_D_MAT_FUSED(3, d_mat_addmul_naive(C, A, B));
+        PROFILE_D_MAT_FUSED(4, d_mat_mul_residual(A, B, C));
+        PROFILE_D_MAT_FUSED(5, d_mat_mul_residual_naive(A, B, C));
+
+#undef PROFILE_D_MAT_FUSED
+
+        flint_printf("%5d", (int) n);
+        for (j = 0; j < 6; j++)
+            flint_printf("  %7.3f (%d)", t[j], (int) a[j]);
+        flint_printf("\n");
+
+        d_mat_clear(A);
+        d_mat_clear(B);
+        d_mat_clear(C);
+    }
+
+    FLINT_TEST_CLEANUP(state);
+}
+
+
+/*
+    Throughput of the float, double and __float128 kernels: scalar products
+    of vectors of length 4096 held in L1/L2, in Gflop/s, and mul, gso and qr
+    of n x n matrices, in ms. The double products go through the packed
+    d_mat_mul, the float ones through the register tiles of s_mat_mul and
+    the others through the column updates of q_mat_mul.
+*/
+#define PROFILE_D_MAT_SCALAR_TIME(res, reps, expr)                  \
+    do {                                                            \
+        timeit_t T;                                                 \
+        slong r;                                                    \
+        timeit_start(T);                                            \
+        for (r = 0; r < (reps); r++)                                \
+            expr;                                                   \
+        timeit_stop(T);                                             \
+        res = (double) FLINT_MAX(T->wall, 1) / (reps);              \
+    } while (0)
+
+void
+profile_d_mat_scalar(void)
+{
+    slong sizes[] = {16, 64, 256};
+    slong i, j, n, len = 4096, reps;
+    double t[9], *dv;
+    float *sv;
+    d_quad *qv;
+    volatile double sink = 0;
+    FLINT_TEST_INIT(state);
+
+    dv = flint_malloc(len * sizeof(double));
+    sv = flint_malloc(len * sizeof(float));
+    qv = flint_malloc(len * sizeof(d_quad));
+    for (j = 0; j < len; j++)
+        qv[j] = sv[j] = dv[j] = d_randtest(state);
+
+    reps = 200000;
+    PROFILE_D_MAT_SCALAR_TIME(t[0], reps,
+                              sink += _s_vec_scalar_product(sv, sv, len));
+    PROFILE_D_MAT_SCALAR_TIME(t[1], reps,
+                              sink += _d_vec_scalar_product(dv, dv, len));
+    PROFILE_D_MAT_SCALAR_TIME(t[2], reps / 100,
+                    sink += (double) _q_vec_scalar_product(qv, qv, len));
+
+    flint_printf("scalar product, Gflop/s:  float %.2f  double %.2f  "
+                 "quad %.4f\n\n", 2e-6 * len / t[0], 2e-6 * len / t[1],
+                 2e-6 * len / t[2]);
+
+    flint_free(dv);
+    flint_free(sv);
+    flint_free(qv);
+
+    flint_printf("    n   mul: float   double     quad   "
+                 "gso: float   double     quad    "
+                 "qr: float   double     quad\n");
+
+    for (i = 0; i < (slong) (sizeof(sizes) / sizeof(slong)); i++)
+    {
+        d_mat_t a, b, c;
+        s_mat_t sa, sb, sc;
+        q_mat_t qa, qb, qc;
+
+        n = sizes[i];
+        reps = FLINT_MAX(1, (WORD(1) << 26) / (n * n * n));
+
+        d_mat_init(a, n, n);
+        d_mat_init(b, n, n);
+        d_mat_init(c, n, n);
+        s_mat_init(sa, n, n);
+        s_mat_init(sb, n, n);
+        s_mat_init(sc, n, n);
+        q_mat_init(qa, n, n);
+        q_mat_init(qb, n, n);
+        q_mat_init(qc, n, n);
+        d_mat_randtest(a, state);
+        d_mat_randtest(b, state);
+        s_mat_set_d_mat(sa, a);
+        s_mat_set_d_mat(sb, b);
+        q_mat_set_d_mat(qa, a);
+        q_mat_set_d_mat(qb, b);
+
+        PROFILE_D_MAT_SCALAR_TIME(t[0], reps, s_mat_mul(sc, sa, sb));
+        PROFILE_D_MAT_SCALAR_TIME(t[1], reps, d_mat_mul(c, a, b));
+        PROFILE_D_MAT_SCALAR_TIME(t[2], FLINT_MAX(1, reps / 64),
+                                  q_mat_mul(qc, qa, qb));
+        PROFILE_D_MAT_SCALAR_TIME(t[3], reps, s_mat_gso(sc, sa));
+        PROFILE_D_MAT_SCALAR_TIME(t[4], reps, d_mat_gso(c, a));
+        PROFILE_D_MAT_SCALAR_TIME(t[5], FLINT_MAX(1, reps / 64),
+                                  q_mat_gso(qc, qa));
+        PROFILE_D_MAT_SCALAR_TIME(t[6], reps,
+                                  (s_mat_zero(sb), s_mat_qr(sc, sb, sa)));
+        PROFILE_D_MAT_SCALAR_TIME(t[7], reps,
+                                  (d_mat_zero(b), d_mat_qr_mgs(c, b, a)));
+        PROFILE_D_MAT_SCALAR_TIME(t[8], FLINT_MAX(1, reps / 64),
+                                  (q_mat_zero(qb), q_mat_qr(qc, qb, qa)));
+
+        flint_printf("%5d", (int) n);
+        for (j = 0; j < 9; j++)
+            flint_printf(j % 3 == 0 ? "  %10.3f" : " %8.3f", t[j]);
+        flint_printf("\n");
+
+        d_mat_clear(a);
+        d_mat_clear(b);
+        d_mat_clear(c);
+        s_mat_clear(sa);
+        s_mat_clear(sb);
+        s_mat_clear(sc);
+        q_mat_clear(qa);
+        q_mat_clear(qb);
+        q_mat_clear(qc);
+    }
+
+    (void) sink;
+
+    FLINT_TEST_CLEANUP(state);
+}
+
+#undef PROFILE_D_MAT_SCALAR_TIME
+
+
 int
-main(void)
+main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "profile") == 0)
+    {
+        profile_d_mat_threads(argc > 2 ? atol(argv[2]) : 8);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "profile_batch") == 0)
+    {
+        profile_d_mat_batch();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "profile_fixed") == 0)
+    {
+        profile_d_mat_fixed();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "profile_fused") == 0)
+    {
+        profile_d_mat_fused();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "profile_scalar") == 0)
+    {
+        profile_d_mat_scalar();
+        return EXIT_SUCCESS;
+    }
+
+    test_d_vec();
+    test_d_mat_mul();
+    test_d_mat_layout();
+    test_d_mat_window();
+    test_d_mat_threads();
     test_d_mat_qr();
+    test_d_mat_qr_householder();
+    test_d_mat_qr_tsqr();
+    test_d_gso();
+    test_d_mat_batch();
+    test_d_mat_fixed();
+    test_d_mat_fused();
+    test_s_mat();
+    test_q_mat();
     int i;
     FLINT_TEST_INIT(state);
 
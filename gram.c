@@ -1,4 +1,518 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "flint/fmpz_mat.h"
+#include "thread_pool.c"
+
+/*
+    The Gram matrix is computed by tiles of FMPZ_MAT_GRAM_BLOCK rows and
+    columns. Only the tiles on or above the diagonal are computed, each
+    by one task, and mirrored below it. The inner products of a tile are
+    accumulated over FMPZ_MAT_GRAM_KBLOCK columns of A at a time, so that
+    the row segments of A it reads stay in cache while they are reused.
+*/
+#define FMPZ_MAT_GRAM_BLOCK 32
+#define FMPZ_MAT_GRAM_KBLOCK 256
+
+/*
+    When the entries of A are small enough the tiles are computed exactly
+    in double precision instead. Every entry is split into limbs signed
+    digits of shift bits (a = sum_l a_l 2^(shift l), with |a_l| < 2^shift),
+    shift chosen so that a sum of A->c products of two digits is below
+    2^53: then every partial sum of a dot product of digit vectors is an
+    integer that is exactly representable, whatever the order in which
+    they are added or whether the products are fused, and B is the sum
+    over pairs of digit positions of exact double products shifted into
+    place.
+
+    For larger entries, the same kernel computes the Gram matrix modulo
+    limbs primes just above 2^shift from the symmetric residues of A,
+    whose products are again exact, and the entries of B are recovered
+    by Chinese remaindering. That needs a number of primes linear in the
+    size of the entries, where splitting needs a number of digit products
+    quadratic in it; _fmpz_mat_gram_algorithm picks the cheapest of the
+    three methods by a simple cost model.
+
+    The digits are packed by panels of FMPZ_MAT_GRAM_MR rows of A,
+    column by column, with the rows of A padded with zeros to a multiple
+    of 2 FMPZ_MAT_GRAM_MR, which the micro kernel reads as a 4 x 8 outer
+    product per column.
+*/
+#define FMPZ_MAT_GRAM_MR 4
+
+#define FMPZ_MAT_GRAM_DIRECT 0
+#define FMPZ_MAT_GRAM_SPLIT 1
+#define FMPZ_MAT_GRAM_MULTI_MOD 2
+
+typedef struct
+{
+    fmpz_mat_struct * B;
+    const fmpz_mat_struct * A;
+    slong blocks;
+    int add;            /* add the Gram matrix to B instead of setting B */
+    double * planes;
+    slong limbs;
+    slong shift;
+    slong mpad;
+    ulong * primes;     /* NULL unless multimodular */
+    ulong * pinv;       /* precomputed inverses of the primes */
+    ulong * inv;        /* inv[i * limbs + l] = 1 / primes[i] mod primes[l] */
+    fmpz_t modulus;     /* product of the primes */
+    fmpz_t half;        /* half of it */
+} fmpz_mat_gram_arg_struct;
+
+/*
+    Costs of the three methods in units of one multiply-add of the double
+    kernel, for an m x n matrix A with entries of at most bits bits: a
+    multiprecision multiply-add of w-limb numbers is taken to cost
+    FMPZ_MAT_GRAM_COST_MP + 10 w^2 units, reducing or splitting an entry
+    4 + w units per prime or digit, and the Chinese remaindering of an
+    entry from P residues P (P + 8) units. Returns the cheapest method
+    and sets limbs to the number of digits or primes it needs.
+
+    Splitting sums up to L products of digit vectors, each below
+    n 2^(2 shift), into one slong, so it is only allowed while
+    L n 2^(2 shift) < 2^63.
+*/
+#define FMPZ_MAT_GRAM_COST_MP 60
+
+static int
+_fmpz_mat_gram_algorithm(slong * limbs, slong m, slong n, slong bits,
+                         slong shift)
+{
+    double prods = 0.5 * m * (m + 1) * n, entries = 0.5 * m * (m + 1);
+    double w = (bits + FLINT_BITS - 1) / FLINT_BITS;
+    double direct, split, multi_mod;
+    slong L, P;
+
+    L = FLINT_MAX(1, (bits + shift - 1) / shift);
+    P = (2 * bits + FLINT_CLOG2(n) + 1 + shift - 1) / shift;
+
+    direct = prods * (FMPZ_MAT_GRAM_COST_MP + 10 * w * w);
+    split = prods * L * L + (double) m * n * L * (4 + w)
+            + entries * 2 * L * (4 + w);
+    multi_mod = prods * P + (double) m * n * P * (4 + w)
+                + entries * P * (P + 8);
+
+    if (direct <= split && direct <= multi_mod)
+        return FMPZ_MAT_GRAM_DIRECT;
+
+    if (split <= multi_mod
+        && FLINT_CLOG2(L) + FLINT_CLOG2(n) + 2 * shift <= FLINT_BITS - 1)
+    {
+        *limbs = L;
+        return FMPZ_MAT_GRAM_SPLIT;
+    }
+
+    *limbs = P;
+    return FMPZ_MAT_GRAM_MULTI_MOD;
+}
+
+/*
+    Sets (or if add is set, adds to) the entries B[i][j] with i0 <= i < i1,
+    j0 <= j < j1 and i <= j the inner product of rows i and j of A, and
+    sets B[j][i] to the same value.
+*/
+static void
+_fmpz_mat_gram_tile(fmpz_mat_t B, const fmpz_mat_t A, int add,
+                    slong i0, slong i1, slong j0, slong j1)
+{
+    slong i, j, k, k0, k1;
+    const fmpz * a;
+    const fmpz * b;
+    fmpz * c;
+
+    for (i = i0; i < i1 && !add; i++)
+        for (j = FLINT_MAX(i, j0); j < j1; j++)
+            fmpz_zero(fmpz_mat_entry(B, i, j));
+
+    for (k0 = 0; k0 < A->c; k0 += FMPZ_MAT_GRAM_KBLOCK)
+    {
+        k1 = FLINT_MIN(k0 + FMPZ_MAT_GRAM_KBLOCK, A->c);
+
+        for (i = i0; i < i1; i++)
+        {
+            a = A->rows[i];
+
+            for (j = FLINT_MAX(i, j0); j < j1; j++)
+            {
+                b = A->rows[j];
+                c = fmpz_mat_entry(B, i, j);
+
+                for (k = k0; k < k1; k++)
+                    fmpz_addmul(c, a + k, b + k);
+            }
+        }
+    }
+
+    for (i = i0; i < i1; i++)
+        for (j = FLINT_MAX(i + 1, j0); j < j1; j++)
+            fmpz_set(fmpz_mat_entry(B, j, i), fmpz_mat_entry(B, i, j));
+}
+
+/*
+    Packs the digits of A as described above into planes, which has room
+    for limbs planes of mpad x A->c doubles.
+*/
+static void
+_fmpz_mat_gram_pack(double * planes, const fmpz_mat_t A,
+                    slong limbs, slong shift, slong mpad)
+{
+    slong i, k, l, n = A->c;
+    ulong mask = (UWORD(1) << shift) - 1, u;
+    double * d;
+    int sign;
+    fmpz_t t;
+
+    fmpz_init(t);
+
+    for (l = 0; l < limbs * mpad * n; l++)
+        planes[l] = 0.0;
+
+    for (i = 0; i < A->r; i++)
+    {
+        d = planes + (i / FMPZ_MAT_GRAM_MR) * FMPZ_MAT_GRAM_MR * n
+                   + i % FMPZ_MAT_GRAM_MR;
+
+        for (k = 0; k < n; k++, d += FMPZ_MAT_GRAM_MR)
+        {
+            const fmpz * a = fmpz_mat_entry(A, i, k);
+
+            sign = fmpz_sgn(a);
+
+            if (!COEFF_IS_MPZ(*a))
+            {
+                u = FLINT_ABS(*a);
+                for (l = 0; l < limbs; l++, u >>= shift)
+                    d[l * mpad * n] = (double) (sign * (slong) (u & mask));
+            }
+            else
+            {
+                fmpz_abs(t, a);
+                for (l = 0; l < limbs; l++)
+                {
+                    d[l * mpad * n] = (double) (sign * (slong) fmpz_fdiv_ui(t, mask + 1));
+                    fmpz_fdiv_q_2exp(t, t, shift);
+                }
+            }
+        }
+    }
+
+    fmpz_clear(t);
+}
+
+/*
+    Packs the symmetric residues of A modulo the limbs primes of arg into
+    its planes, laid out as for _fmpz_mat_gram_pack.
+*/
+static void
+_fmpz_mat_gram_pack_mod(fmpz_mat_gram_arg_struct * arg)
+{
+    const fmpz_mat_struct * A = arg->A;
+    slong i, k, l, n = A->c, plane = arg->mpad * n;
+    const fmpz * a;
+    ulong p, r;
+    double * d;
+
+    for (l = 0; l < arg->limbs * plane; l++)
+        arg->planes[l] = 0.0;
+
+    for (i = 0; i < A->r; i++)
+    {
+        d = arg->planes + (i / FMPZ_MAT_GRAM_MR) * FMPZ_MAT_GRAM_MR * n
+                        + i % FMPZ_MAT_GRAM_MR;
+
+        for (k = 0; k < n; k++, d += FMPZ_MAT_GRAM_MR)
+        {
+            a = fmpz_mat_entry(A, i, k);
+
+            for (l = 0; l < arg->limbs; l++)
+            {
+                p = arg->primes[l];
+                if (!COEFF_IS_MPZ(*a))
+                    r = (ulong) (*a % (slong) p + (slong) p) % p;
+                else
+                    r = fmpz_fdiv_ui(a, p);
+                d[l * plane] = r > p / 2 ? -(double) (p - r) : (double) r;
+            }
+        }
+    }
+}
+
+/*
+    Sets e to the integer of absolute value at most arg->half that is
+    congruent to r[l * stride] modulo primes[l] for all l, by Garner's
+    algorithm with the mixed radix digits in v.
+*/
+static void
+_fmpz_mat_gram_crt(fmpz_t e, const slong * r, slong stride, ulong * v,
+                   const fmpz_mat_gram_arg_struct * arg)
+{
+    const slong P = arg->limbs;
+    ulong p, t;
+    slong i, l;
+
+    for (l = 0; l < P; l++)
+    {
+        p = arg->primes[l];
+        t = (ulong) (r[l * stride] % (slong) p + (slong) p) % p;
+
+        for (i = 0; i < l; i++)
+            t = n_mulmod2_preinv(n_submod(t, v[i] % p, p),
+                                 arg->inv[i * P + l], p, arg->pinv[l]);
+
+        v[l] = t;
+    }
+
+    fmpz_set_ui(e, v[P - 1]);
+    for (l = P - 2; l >= 0; l--)
+    {
+        fmpz_mul_ui(e, e, arg->primes[l]);
+        fmpz_add_ui(e, e, v[l]);
+    }
+
+    if (fmpz_cmp(e, arg->half) > 0)
+        fmpz_sub(e, e, arg->modulus);
+}
+
+/*
+    Sets c to the 4 x 8 block of inner products of the len columns of the
+    panel a with those of the panels b0 and b1. The accumulators are
+    vectors of FMPZ_MAT_GRAM_VLEN doubles (GCC and Clang vector
+    extensions), as wide as the SIMD registers of the target.
+*/
+#if defined(__AVX__)
+#define FMPZ_MAT_GRAM_VLEN 4
+#else
+#define FMPZ_MAT_GRAM_VLEN 2
+#endif
+#define FMPZ_MAT_GRAM_NV (8 / FMPZ_MAT_GRAM_VLEN)
+
+typedef double fmpz_mat_gram_vec
+    __attribute__ ((vector_size (8 * FMPZ_MAT_GRAM_VLEN)));
+
+static void
+_fmpz_mat_gram_d_kernel(double * c, const double * a,
+                        const double * b0, const double * b1, slong len)
+{
+    fmpz_mat_gram_vec acc[4][FMPZ_MAT_GRAM_NV], u[FMPZ_MAT_GRAM_NV];
+    const slong half = FMPZ_MAT_GRAM_NV / 2;
+    slong k, x, y;
+
+    memset(acc, 0, sizeof(acc));
+
+    for (k = 0; k < len; k++, a += 4, b0 += 4, b1 += 4)
+    {
+        for (y = 0; y < half; y++)
+        {
+            memcpy(u + y, b0 + y * FMPZ_MAT_GRAM_VLEN, sizeof(u[0]));
+            memcpy(u + half + y, b1 + y * FMPZ_MAT_GRAM_VLEN, sizeof(u[0]));
+        }
+
+        for (x = 0; x < 4; x++)
+            for (y = 0; y < FMPZ_MAT_GRAM_NV; y++)
+                acc[x][y] += a[x] * u[y];
+    }
+
+    for (x = 0; x < 4; x++)
+        for (y = 0; y < FMPZ_MAT_GRAM_NV; y++)
+            memcpy(c + x * 8 + y * FMPZ_MAT_GRAM_VLEN, acc[x] + y, sizeof(u[0]));
+}
+
+/*
+    As _fmpz_mat_gram_tile, from the packed digits or residues. The inner
+    products of each pair of digit positions (l, l') are summed into
+    acc[l + l'], which then hold the value of each entry as
+    sum_d acc[d] 2^(shift d); those of the residues modulo the l-th prime
+    into acc[l], from which each entry is recovered by _fmpz_mat_gram_crt.
+*/
+static void
+_fmpz_mat_gram_tile_d(const fmpz_mat_gram_arg_struct * arg,
+                      slong i0, slong i1, slong j0, slong j1)
+{
+    const slong n = arg->A->c, L = arg->limbs, plane = arg->mpad * n;
+    const slong J0 = j0 / 8 * 8, J1 = FLINT_MIN((j1 + 7) / 8 * 8, arg->mpad);
+    const slong w = J1 - J0, h = i1 - i0;
+    slong i, j, k0, k1, l, l2, d, x, y;
+    const slong N = arg->primes != NULL ? L : 2 * L - 1;
+    slong * acc;
+    ulong * v = NULL;
+    double c[32];
+    fmpz * e;
+    fmpz * f;
+    fmpz_t t;
+
+    acc = flint_calloc(N * h * w, sizeof(slong));
+    fmpz_init(t);
+
+    for (k0 = 0; k0 < n; k0 += FMPZ_MAT_GRAM_KBLOCK)
+    {
+        k1 = FLINT_MIN(k0 + FMPZ_MAT_GRAM_KBLOCK, n);
+
+        for (l = 0; l < L; l++)
+        for (l2 = 0; l2 < L; l2++)
+        {
+            const double * P = arg->planes + l * plane;
+            const double * Q = arg->planes + l2 * plane;
+            slong * s = acc + (l + l2) * h * w;
+
+            if (arg->primes != NULL)
+            {
+                if (l2 != l)
+                    continue;
+                s = acc + l * h * w;
+            }
+
+            for (i = i0; i < i1; i += 4)
+            {
+                for (j = J0; j < J1; j += 8)
+                {
+                    if (j + 8 <= i)
+                        continue;
+
+                    _fmpz_mat_gram_d_kernel(c,
+                        P + (i / 4) * 4 * n + k0 * 4,
+                        Q + (j / 4) * 4 * n + k0 * 4,
+                        Q + (j / 4 + 1) * 4 * n + k0 * 4, k1 - k0);
+
+                    for (x = 0; x < 4 && i + x < i1; x++)
+                        for (y = 0; y < 8; y++)
+                            s[(i + x - i0) * w + j + y - J0] += (slong) c[x * 8 + y];
+                }
+            }
+        }
+    }
+
+    for (i = i0; i < i1; i++)
+    {
+        for (j = FLINT_MAX(i, j0); j < j1; j++)
+        {
+            e = fmpz_mat_entry(arg->B, i, j);
+            f = arg->add ? t : e;
+            x = (i - i0) * w + j - J0;
+
+            if (arg->primes != NULL)
+            {
+                if (v == NULL)
+                    v = flint_malloc(L * sizeof(ulong));
+                _fmpz_mat_gram_crt(f, acc + x, h * w, v, arg);
+            }
+            else
+            {
+                fmpz_set_si(f, acc[(N - 1) * h * w + x]);
+                for (d = N - 2; d >= 0; d--)
+                {
+                    fmpz_mul_2exp(f, f, arg->shift);
+                    if (acc[d * h * w + x] >= 0)
+                        fmpz_add_ui(f, f, acc[d * h * w + x]);
+                    else
+                        fmpz_sub_ui(f, f, -acc[d * h * w + x]);
+                }
+            }
+
+            if (arg->add)
+                fmpz_add(e, e, t);
+
+            if (j != i)
+                fmpz_set(fmpz_mat_entry(arg->B, j, i), e);
+        }
+    }
+
+    flint_free(acc);
+    flint_free(v);
+    fmpz_clear(t);
+}
+
+/* Task t computes the t-th tile on or above the diagonal, row by row. */
+static void
+_fmpz_mat_gram_worker(void * varg, slong t)
+{
+    fmpz_mat_gram_arg_struct * arg = varg;
+    slong bi, bj, i0, i1, j0, j1, m = arg->A->r;
+
+    for (bi = 0; t >= arg->blocks - bi; bi++)
+        t -= arg->blocks - bi;
+    bj = bi + t;
+
+    i0 = bi * FMPZ_MAT_GRAM_BLOCK;
+    i1 = FLINT_MIN(i0 + FMPZ_MAT_GRAM_BLOCK, m);
+    j0 = bj * FMPZ_MAT_GRAM_BLOCK;
+    j1 = FLINT_MIN(j0 + FMPZ_MAT_GRAM_BLOCK, m);
+
+    if (arg->planes != NULL)
+        _fmpz_mat_gram_tile_d(arg, i0, i1, j0, j1);
+    else
+        _fmpz_mat_gram_tile(arg->B, arg->A, arg->add, i0, i1, j0, j1);
+}
+
+/*
+    Sets B to A A^T, or adds A A^T to the symmetric matrix B if add is set.
+    B must not alias A, which must have at least one column.
+*/
+static void
+_fmpz_mat_gram(fmpz_mat_t B, const fmpz_mat_t A, int add)
+{
+	fmpz_mat_gram_arg_struct arg;
+	slong bits, i, l;
+	int algorithm;
+	
+	arg.B = B;
+	arg.A = A;
+	arg.add = add;
+	arg.blocks = (A->r + FMPZ_MAT_GRAM_BLOCK - 1) / FMPZ_MAT_GRAM_BLOCK;
+	arg.planes = NULL;
+	arg.primes = NULL;
+	arg.pinv = NULL;
+	arg.inv = NULL;
+	fmpz_init(arg.modulus);
+	fmpz_init(arg.half);
+	
+	bits = FLINT_ABS(fmpz_mat_max_bits(A));
+	arg.shift = (53 - FLINT_CLOG2(A->c)) / 2;
+	arg.mpad = (A->r + 7) / 8 * 8;
+	algorithm = _fmpz_mat_gram_algorithm(&arg.limbs, A->r, A->c, bits,
+	                                     arg.shift);
+	
+	if(algorithm != FMPZ_MAT_GRAM_DIRECT) {
+		arg.planes = flint_malloc(arg.limbs * arg.mpad * A->c * sizeof(double));
+	}
+	
+	if(algorithm == FMPZ_MAT_GRAM_SPLIT) {
+		_fmpz_mat_gram_pack(arg.planes, A, arg.limbs, arg.shift, arg.mpad);
+	} else if(algorithm == FMPZ_MAT_GRAM_MULTI_MOD) {
+		/* primes in (2^shift, 2^(shift + 1)), residues below 2^shift */
+		arg.primes = flint_malloc(arg.limbs * sizeof(ulong));
+		arg.pinv = flint_malloc(arg.limbs * sizeof(ulong));
+		arg.inv = flint_malloc(arg.limbs * arg.limbs * sizeof(ulong));
+		fmpz_one(arg.modulus);
+		for(l = 0; l < arg.limbs; l++) {
+			arg.primes[l] = n_nextprime(l == 0 ? UWORD(1) << arg.shift
+			                                   : arg.primes[l - 1], 1);
+			arg.pinv[l] = n_preinvert_limb(arg.primes[l]);
+			fmpz_mul_ui(arg.modulus, arg.modulus, arg.primes[l]);
+		}
+		for(i = 0; i < arg.limbs; i++) {
+			for(l = i + 1; l < arg.limbs; l++) {
+				arg.inv[i * arg.limbs + l] =
+					n_invmod(arg.primes[i] % arg.primes[l], arg.primes[l]);
+			}
+		}
+		fmpz_fdiv_q_2exp(arg.half, arg.modulus, 1);
+		_fmpz_mat_gram_pack_mod(&arg);
+	}
+	
+	thread_pool_parallel_for(arg.blocks * (arg.blocks + 1) / 2,
+	                         _fmpz_mat_gram_worker, &arg);
+	
+	flint_free(arg.planes);
+	flint_free(arg.primes);
+	flint_free(arg.pinv);
+	flint_free(arg.inv);
+	fmpz_clear(arg.modulus);
+	fmpz_clear(arg.half);
+}
 
 void fmpz_mat_gram(fmpz_mat_t B, const fmpz_mat_t A)
 /*
@@ -8,8 +522,6 @@ void fmpz_mat_gram(fmpz_mat_t B, const fmpz_mat_t A)
  *  Requires B to be a m x m matrix, else an exception raised
 */
 {
-	slong i, j, k;
-	
 	if(B->r != A->r || B->c != A->r) {
 		flint_printf("Exception (fmpz_mat_gram). Incompatible dimensions.\n");
 		abort();
@@ -29,19 +541,286 @@ void fmpz_mat_gram(fmpz_mat_t B, const fmpz_mat_t A)
 		return;
 	}
 	
-	for(i = 0; i < B->r; i++) {
-		for(j = 0; j < B->c; j++) {
-			fmpz_mul(fmpz_mat_entry(B, i, j),
-					 fmpz_mat_entry(A, i, 0),
-					 fmpz_mat_entry(A, j, 0));
-					 
-			for (k = 1; k < A->c; k++) {
-                fmpz_addmul(fmpz_mat_entry(B, i, j),
-                            fmpz_mat_entry(A, i, k),
-                            fmpz_mat_entry(A, j, k));
+	_fmpz_mat_gram(B, A, 0);
+}
+
+/*
+    Streaming Gram matrix. As A A^T is the sum of C C^T over any split of
+    the columns of A into blocks C, the Gram matrix of an m x n matrix can
+    be accumulated from blocks of columns fed one at a time, so that only
+    the m x m result and one m x k block are ever held in memory:
+
+        fmpz_mat_gram_stream_init(S, m);
+        fmpz_mat_gram_stream_add(S, C);     (for every block C)
+        fmpz_mat_gram_stream_final(B, S);
+        fmpz_mat_gram_stream_clear(S);
+
+    fmpz_mat_gram_stream_add_file feeds all columns of a matrix stored on
+    disk in the following format, which keeps the columns contiguous so
+    that each block is a contiguous range of the file: the four bytes
+    "FMG\1", then m, n and the entries of A column by column, every number
+    encoded as a zigzag LEB128 varint (7 bits per byte, least significant
+    first, high bit set on all but the last byte, of 2x for x >= 0 and of
+    -2x - 1 for x < 0). The file is memory mapped and the pages of every
+    block are released once it has been added.
+*/
+#define FMPZ_MAT_GRAM_FILE_MAGIC "FMG\1"
+
+typedef struct
+{
+    fmpz_mat_t G;
+    slong n;
+} fmpz_mat_gram_stream_struct;
+
+typedef fmpz_mat_gram_stream_struct fmpz_mat_gram_stream_t[1];
+
+void
+fmpz_mat_gram_stream_init(fmpz_mat_gram_stream_t S, slong m)
+{
+    fmpz_mat_init(S->G, m, m);
+    S->n = 0;
+}
+
+void
+fmpz_mat_gram_stream_clear(fmpz_mat_gram_stream_t S)
+{
+    fmpz_mat_clear(S->G);
+}
+
+/* Adds the columns of the m x k matrix C to those seen by S. */
+void
+fmpz_mat_gram_stream_add(fmpz_mat_gram_stream_t S, const fmpz_mat_t C)
+{
+    if (C->r != S->G->r)
+    {
+        flint_printf("Exception (fmpz_mat_gram_stream_add). "
+                     "Incompatible dimensions.\n");
+        abort();
+    }
+
+    if (C->c == 0 || C->r == 0)
+        return;
+
+    _fmpz_mat_gram(S->G, C, 1);
+    S->n += C->c;
+}
+
+/* Sets B to the Gram matrix of all columns added to S so far. */
+void
+fmpz_mat_gram_stream_final(fmpz_mat_t B, const fmpz_mat_gram_stream_t S)
+{
+    if (B->r != S->G->r || B->c != S->G->r)
+    {
+        flint_printf("Exception (fmpz_mat_gram_stream_final). "
+                     "Incompatible dimensions.\n");
+        abort();
+    }
+
+    fmpz_mat_set(B, S->G);
+}
+
+static void
+_fmpz_mat_gram_write_varint(FILE * f, const fmpz_t x, fmpz_t z)
+{
+    fmpz_mul_2exp(z, x, 1);
+    if (fmpz_sgn(z) < 0)
+    {
+        fmpz_neg(z, z);
+        fmpz_sub_ui(z, z, 1);
+    }
+
+    while (fmpz_cmp_ui(z, 0x80) >= 0)
+    {
+        putc((int) (fmpz_fdiv_ui(z, 0x80) | 0x80), f);
+        fmpz_fdiv_q_2exp(z, z, 7);
+    }
+    putc((int) fmpz_get_ui(z), f);
+}
+
+/*
+    Reads a varint from *p (before end) into x and advances *p past it.
+    Returns 0 if the data ends first.
+*/
+static int
+_fmpz_mat_gram_read_varint(fmpz_t x, const unsigned char ** p,
+                           const unsigned char * end, fmpz_t z)
+{
+    const unsigned char * q = *p;
+    ulong v = 0;
+    slong shift = 0;
+
+    /* up to 8 bytes fit a word */
+    while (q < end && shift < 56)
+    {
+        v |= (ulong) (*q & 0x7f) << shift;
+        shift += 7;
+        if (!(*q++ & 0x80))
+        {
+            *p = q;
+            if (v & 1)
+                fmpz_neg_ui(x, (v >> 1) + 1);
+            else
+                fmpz_set_ui(x, v >> 1);
+            return 1;
+        }
+    }
+
+    fmpz_set_ui(x, v);
+    while (q < end)
+    {
+        fmpz_set_ui(z, *q & 0x7f);
+        fmpz_mul_2exp(z, z, shift);
+        fmpz_add(x, x, z);
+        shift += 7;
+        if (!(*q++ & 0x80))
+        {
+            *p = q;
+            fmpz_fdiv_q_2exp(z, x, 1);
+            if (fmpz_is_odd(x))
+            {
+                fmpz_add_ui(z, z, 1);
+                fmpz_neg(z, z);
             }
-		}
-	}
+            fmpz_swap(x, z);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes A to the file at path in the format described above. Returns 1
+    on success and 0 if the file cannot be written.
+*/
+int
+fmpz_mat_gram_file_write(const char * path, const fmpz_mat_t A)
+{
+    FILE * f;
+    fmpz_t x, z;
+    slong i, k;
+    int ok;
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return 0;
+
+    fmpz_init(x);
+    fmpz_init(z);
+
+    fputs(FMPZ_MAT_GRAM_FILE_MAGIC, f);
+    fmpz_set_si(x, A->r);
+    _fmpz_mat_gram_write_varint(f, x, z);
+    fmpz_set_si(x, A->c);
+    _fmpz_mat_gram_write_varint(f, x, z);
+
+    for (k = 0; k < A->c; k++)
+        for (i = 0; i < A->r; i++)
+            _fmpz_mat_gram_write_varint(f, fmpz_mat_entry(A, i, k), z);
+
+    ok = !ferror(f);
+    ok &= fclose(f) == 0;
+
+    fmpz_clear(x);
+    fmpz_clear(z);
+
+    return ok;
+}
+
+/*
+    Adds all columns of the matrix stored in the file at path to S, in
+    blocks of chunk columns. Returns 1 on success and 0 if the file cannot
+    be read, is not in the format above or does not have S->G->r rows, in
+    which case S is left unchanged.
+*/
+int
+fmpz_mat_gram_stream_add_file(fmpz_mat_gram_stream_t S, const char * path,
+                              slong chunk)
+{
+    const unsigned char * data, * p, * end, * done;
+    struct stat st;
+    fmpz_mat_gram_stream_t T;
+    fmpz_mat_t C;
+    fmpz_t x, z;
+    slong m = 0, n = 0, i, k, k0, page, width = 0;
+    int fd, ok = 1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) != 0 || st.st_size < 4)
+    {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    page = sysconf(_SC_PAGESIZE);
+    p = data + 4;
+    end = data + st.st_size;
+    done = data;
+
+    fmpz_init(x);
+    fmpz_init(z);
+
+    ok = memcmp(data, FMPZ_MAT_GRAM_FILE_MAGIC, 4) == 0
+         && _fmpz_mat_gram_read_varint(x, &p, end, z) && fmpz_fits_si(x)
+         && (m = fmpz_get_si(x)) == S->G->r
+         && _fmpz_mat_gram_read_varint(x, &p, end, z) && fmpz_fits_si(x)
+         && (n = fmpz_get_si(x)) >= 0
+         && (m == 0 || n <= (end - p) / m);  /* entries take >= 1 byte */
+
+    chunk = FLINT_MAX(chunk, 1);
+
+    /* blocks go to T, so that S only sees the columns if all of them parse */
+    fmpz_mat_gram_stream_init(T, m);
+
+    for (k0 = 0; ok && m != 0 && k0 < n; k0 += chunk)
+    {
+        if (width != FLINT_MIN(chunk, n - k0))
+        {
+            if (width != 0)
+                fmpz_mat_clear(C);
+            width = FLINT_MIN(chunk, n - k0);
+            fmpz_mat_init(C, m, width);
+        }
+
+        for (k = 0; ok && k < C->c; k++)
+            for (i = 0; ok && i < m; i++)
+                ok = _fmpz_mat_gram_read_varint(fmpz_mat_entry(C, i, k),
+                                                &p, end, z);
+
+        if (ok)
+            fmpz_mat_gram_stream_add(T, C);
+
+        /* drop the pages of the block from memory */
+        if (p - done >= page)
+        {
+            madvise((void *) done, (p - done) / page * page, MADV_DONTNEED);
+            done += (p - done) / page * page;
+        }
+    }
+
+    if (ok)
+    {
+        fmpz_mat_add(S->G, S->G, T->G);
+        S->n += T->n;
+    }
+
+    if (width != 0)
+        fmpz_mat_clear(C);
+    fmpz_mat_gram_stream_clear(T);
+    fmpz_clear(x);
+    fmpz_clear(z);
+    munmap((void *) data, st.st_size);
+
+    return ok;
 }
 
 int main(void)
@@ -85,6 +864,271 @@ int main(void)
         fmpz_mat_clear(D);
     }
 
+    /* several tiles and column blocks, threads, aliasing */
+    for (i = 0; i < 10; i++)
+    {
+        slong m, n, threads;
+
+        m = n_randint(state, 100) + 1;
+        n = n_randint(state, 600);
+        threads = n_randint(state, 4) + 1;
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(B, n, m);
+        fmpz_mat_init(C, m, m);
+        fmpz_mat_init(D, m, m);
+
+        fmpz_mat_randtest(A, state, n_randint(state, 100) + 1);
+
+        fmpz_mat_transpose(B, A);
+        fmpz_mat_mul(C, A, B);
+        thread_pool_set_num_threads(threads);
+        fmpz_mat_gram(D, A);
+        thread_pool_set_num_threads(1);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: results not equal\n");
+            flint_printf("m = %wd, n = %wd, threads = %wd\n", m, n, threads);
+            abort();
+        }
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(B);
+
+        fmpz_mat_init(A, m, m);
+        fmpz_mat_randtest(A, state, n_randint(state, 100) + 1);
+        fmpz_mat_gram(C, A);
+        fmpz_mat_gram(A, A);
+
+        if (!fmpz_mat_equal(A, C))
+        {
+            flint_printf("FAIL: aliasing\n");
+            flint_printf("m = %wd\n", m);
+            abort();
+        }
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(C);
+        fmpz_mat_clear(D);
+    }
+
+    /* large entries, for the multimodular and direct methods */
+    for (i = 0; i < 50; i++)
+    {
+        slong m, n;
+
+        m = n_randint(state, 20) + 1;
+        n = n_randint(state, 20) + 1;
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(B, n, m);
+        fmpz_mat_init(C, m, m);
+        fmpz_mat_init(D, m, m);
+
+        fmpz_mat_randtest(A, state, n_randint(state, 3000) + 1);
+
+        fmpz_mat_transpose(B, A);
+        fmpz_mat_mul(C, A, B);
+        fmpz_mat_gram(D, A);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: large entries\n");
+            flint_printf("m = %wd, n = %wd\n", m, n);
+            abort();
+        }
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(B);
+        fmpz_mat_clear(C);
+        fmpz_mat_clear(D);
+    }
+
+    /* wide entries and few columns, splitting into many digits */
+    for (i = 0; i < 8; i++)
+    {
+        slong m, n, j, bits, limbs;
+
+        /* about 1000 digits of 26 bits, on both sides of the limit */
+        m = n_randint(state, 8) + 4;
+        n = 2;
+        bits = n_randint(state, 4000) + 25000;
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(B, n, m);
+        fmpz_mat_init(C, m, m);
+        fmpz_mat_init(D, m, m);
+
+        /* all digits maximal, for the largest sums of digit products */
+        for (j = 0; j < m * n; j++)
+        {
+            fmpz_one(A->entries + j);
+            fmpz_mul_2exp(A->entries + j, A->entries + j, bits);
+            fmpz_sub_ui(A->entries + j, A->entries + j, 1);
+        }
+
+        if (i == 0 && _fmpz_mat_gram_algorithm(&limbs, 50, 2, 26000,
+                               (53 - FLINT_CLOG2(2)) / 2) != FMPZ_MAT_GRAM_SPLIT)
+        {
+            flint_printf("FAIL: split method not chosen\n");
+            abort();
+        }
+
+        fmpz_mat_transpose(B, A);
+        fmpz_mat_mul(C, A, B);
+        fmpz_mat_gram(D, A);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: wide entries\n");
+            flint_printf("m = %wd, n = %wd, bits = %wd\n", m, n, bits);
+            abort();
+        }
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(B);
+        fmpz_mat_clear(C);
+        fmpz_mat_clear(D);
+    }
+
+    /* streaming, from blocks in memory and from a file */
+    for (i = 0; i < 20; i++)
+    {
+        fmpz_mat_gram_stream_t S;
+        char path[] = "/tmp/gram_stream_XXXXXX";
+        slong m, n, j, k, k0, chunk;
+        int fd;
+
+        m = n_randint(state, 40);
+        n = n_randint(state, 300);
+        chunk = n_randint(state, 50) + 1;
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(C, m, m);
+        fmpz_mat_init(D, m, m);
+
+        fmpz_mat_randtest(A, state, n_randint(state, 200) + 1);
+        fmpz_mat_gram(C, A);
+
+        fmpz_mat_gram_stream_init(S, m);
+        for (k0 = 0; k0 < n; k0 += chunk)
+        {
+            fmpz_mat_init(B, m, FLINT_MIN(chunk, n - k0));
+            for (j = 0; j < m; j++)
+                for (k = 0; k < B->c; k++)
+                    fmpz_set(fmpz_mat_entry(B, j, k),
+                             fmpz_mat_entry(A, j, k0 + k));
+            fmpz_mat_gram_stream_add(S, B);
+            fmpz_mat_clear(B);
+        }
+        fmpz_mat_gram_stream_final(D, S);
+        fmpz_mat_gram_stream_clear(S);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: stream\n");
+            flint_printf("m = %wd, n = %wd, chunk = %wd\n", m, n, chunk);
+            abort();
+        }
+
+        fd = mkstemp(path);
+        close(fd);
+
+        fmpz_mat_zero(D);
+        fmpz_mat_gram_stream_init(S, m);
+        if (!fmpz_mat_gram_file_write(path, A)
+            || !fmpz_mat_gram_stream_add_file(S, path, chunk))
+        {
+            flint_printf("FAIL: stream file %s\n", path);
+            abort();
+        }
+        fmpz_mat_gram_stream_final(D, S);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: stream file\n");
+            flint_printf("m = %wd, n = %wd, chunk = %wd\n", m, n, chunk);
+            abort();
+        }
+
+        /* a truncated file must be rejected and leave S as it was */
+        if (m != 0 && n != 0)
+        {
+            struct stat st;
+
+            if (stat(path, &st) != 0
+                || truncate(path, st.st_size - 1 - n_randint(state,
+                                                  st.st_size - 4)) != 0)
+            {
+                flint_printf("FAIL: truncate %s\n", path);
+                abort();
+            }
+
+            if (fmpz_mat_gram_stream_add_file(S, path, chunk))
+            {
+                flint_printf("FAIL: stream truncated file\n");
+                flint_printf("m = %wd, n = %wd, chunk = %wd\n", m, n, chunk);
+                abort();
+            }
+
+            fmpz_mat_gram_stream_final(D, S);
+            if (!fmpz_mat_equal(C, D))
+            {
+                flint_printf("FAIL: stream truncated file, S changed\n");
+                flint_printf("m = %wd, n = %wd, chunk = %wd\n", m, n, chunk);
+                abort();
+            }
+        }
+
+        fmpz_mat_gram_stream_clear(S);
+        unlink(path);
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(C);
+        fmpz_mat_clear(D);
+    }
+
+    /* entries of maximal size for the double precision path */
+    for (i = 0; i < 20; i++)
+    {
+        slong m, n, j, bits;
+
+        m = n_randint(state, 40) + 1;
+        n = n_randint(state, 2000) + 1;
+        bits = n_randint(state, 4 * ((53 - FLINT_CLOG2(n)) / 2)) + 1;
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(B, n, m);
+        fmpz_mat_init(C, m, m);
+        fmpz_mat_init(D, m, m);
+
+        for (j = 0; j < m * n; j++)
+        {
+            fmpz_one(A->entries + j);
+            fmpz_mul_2exp(A->entries + j, A->entries + j, bits);
+            fmpz_sub_ui(A->entries + j, A->entries + j, 1);
+            if (n_randint(state, 4) == 0)
+                fmpz_neg(A->entries + j, A->entries + j);
+        }
+
+        fmpz_mat_transpose(B, A);
+        fmpz_mat_mul(C, A, B);
+        fmpz_mat_gram(D, A);
+
+        if (!fmpz_mat_equal(C, D))
+        {
+            flint_printf("FAIL: maximal entries\n");
+            flint_printf("m = %wd, n = %wd, bits = %wd\n", m, n, bits);
+            abort();
+        }
+
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(B);
+        fmpz_mat_clear(C);
+        fmpz_mat_clear(D);
+    }
+
     FLINT_TEST_CLEANUP(state);
     
     flint_printf("PASS\n");    
@@ -1,4 +1,10 @@
+#include <math.h>
+#include <string.h>
 #include "flint/fmpq_mat.h"
+#include "flint/fmpq_vec.h"
+#include "flint/fmpz_mat.h"
+#include "flint/fmpz_vec.h"
+#include "flint/profiler.h"
 #include "test_helpers.c"
 
 void fmpq_mat_gso(fmpq_mat_t B, const fmpq_mat_t A)
@@ -7,9 +13,9 @@ void fmpq_mat_gso(fmpq_mat_t B, const fmpq_mat_t A)
 */
 {
 	slong i, j, k;
-	fmpq_t num, den, mu;
+	fmpq_t num, mu;
+	fmpq * den;
 	fmpq_init(num);
-	fmpq_init(den);
 	fmpq_init(mu);
 	
 	if(B->r != A->r || B->c != A->c) {
@@ -28,12 +34,23 @@ void fmpq_mat_gso(fmpq_mat_t B, const fmpq_mat_t A)
 			}
 		}
 		fmpq_mat_clear(t);
+		fmpq_clear(num);
+		fmpq_clear(mu);
+		return;
 	}
 	
 	if(!A->r)
 	{
+		fmpq_clear(num);
+		fmpq_clear(mu);
 		return;
 	}
+	
+	/* den[j] is the squared norm of column j of B, once it is final */
+	den = flint_malloc(A->c * sizeof(fmpq));
+	for(j = 0; j < A->c; j++) {
+		fmpq_init(den + j);
+	}
 				
 	for(i = 0; i < A->c; i++) {
 		for(j = 0; j < A->r; j++) {
@@ -52,19 +69,9 @@ void fmpq_mat_gso(fmpq_mat_t B, const fmpq_mat_t A)
 							fmpq_mat_entry(B, k, j));
 			}
 			
-			fmpq_mul(den,
-					 fmpq_mat_entry(B, 0, j),
-					 fmpq_mat_entry(B, 0, j));
-										
-			for(k = 1; k < A->r; k++) {
-				fmpq_addmul(den,
-							fmpq_mat_entry(B, k, j),
-							fmpq_mat_entry(B, k, j));
-			}
-			
-			if(!fmpq_is_zero(den))
+			if(!fmpq_is_zero(den + j))
 			{
-				fmpq_div(mu, num, den);
+				fmpq_div(mu, num, den + j);
 			
 				for(k = 0; k < A->r; k++) {
 					fmpq_submul(fmpq_mat_entry(B, k, i),
@@ -73,16 +80,817 @@ void fmpq_mat_gso(fmpq_mat_t B, const fmpq_mat_t A)
 				}
 			}
 		}
+		
+		fmpq_mul(den + i,
+				 fmpq_mat_entry(B, 0, i),
+				 fmpq_mat_entry(B, 0, i));
+		
+		for(k = 1; k < A->r; k++) {
+			fmpq_addmul(den + i,
+						fmpq_mat_entry(B, k, i),
+						fmpq_mat_entry(B, k, i));
+		}
 	}
 	
+	for(j = 0; j < A->c; j++) {
+		fmpq_clear(den + j);
+	}
+	flint_free(den);
 	fmpq_clear(num);
-	fmpq_clear(den);
 	fmpq_clear(mu);
 }
 
-int main(void)
+int fmpz_mat_gso_gram(fmpz_mat_t L, fmpz * d, const fmpz_mat_t G)
+/* Integral Gram-Schmidt orthogonalisation (Cohen, Algorithm 2.6.7).
+ * Input: the m x m Gram matrix G of vectors b_0, ..., b_{m-1}
+ * Output: d[0] = 1 and d[i + 1] = d[i] |b*_i|^2, the Gram determinant of
+ *	b_0, ..., b_i, and the lower triangular m x m matrix L with
+ *	L[i][j] = d[j + 1] mu_ij for j < i and L[i][i] = d[i + 1], where the
+ *	b*_i and mu_ij are the Gram-Schmidt vectors and coefficients. All of
+ *	them are integers, and every division below is exact, so no rational
+ *	number is ever formed. Every squared norm enters once, through d.
+ * Returns 1 if the vectors are linearly independent. Otherwise returns 0
+ *	and stops at the first i with d[i + 1] = 0, leaving the later rows of
+ *	L and entries of d undefined.
+ */
+{
+	slong i, j, k, m = G->r;
+	fmpz_t u;
+	
+	if(G->c != m || L->r != m || L->c != m) {
+		flint_printf("Exception (fmpz_mat_gso_gram). Incompatible dimensions.\n");
+		abort();
+	}
+	
+	fmpz_init(u);
+	fmpz_one(d);
+	fmpz_mat_zero(L);
+	
+	for(k = 0; k < m; k++) {
+		for(j = 0; j <= k; j++) {
+			fmpz_set(u, fmpz_mat_entry(G, k, j));
+			
+			for(i = 0; i < j; i++) {
+				fmpz_mul(u, u, d + i + 1);
+				fmpz_submul(u, fmpz_mat_entry(L, k, i),
+							fmpz_mat_entry(L, j, i));
+				fmpz_divexact(u, u, d + i);
+			}
+			
+			fmpz_set(fmpz_mat_entry(L, k, j), u);
+		}
+		
+		fmpz_set(d + k + 1, u);
+		
+		if(fmpz_is_zero(u)) {
+			fmpz_clear(u);
+			return 0;
+		}
+	}
+	
+	fmpz_clear(u);
+	return 1;
+}
+
+int fmpz_mat_gso_integral(fmpz_mat_t L, fmpz * d, const fmpz_mat_t A)
+/* As fmpz_mat_gso_gram, for the vectors given as the rows of the m x n
+ * matrix A, whose Gram matrix is computed first by fmpz_mat_gram.
+ * d must have room for m + 1 entries.
+ */
+{
+	fmpz_mat_t G;
+	int r;
+	
+	if(L->r != A->r || L->c != A->r) {
+		flint_printf("Exception (fmpz_mat_gso_integral). Incompatible dimensions.\n");
+		abort();
+	}
+	
+	fmpz_mat_init(G, A->r, A->r);
+	fmpz_mat_gram(G, A);
+	r = fmpz_mat_gso_gram(L, d, G);
+	fmpz_mat_clear(G);
+	
+	return r;
+}
+
+/* Incremental Gram-Schmidt data of a sequence of m vectors of length n.
+ * b[i] is the i-th vector, r[i] = |b*_i|^2 and mu[i][j] = <b_i, b*_j> / r[j]
+ * for j < i, taken to be 0 when r[j] = 0 as in fmpq_mat_gso. Only the
+ * vectors, mu and r are stored; the b*_i are formed on request by
+ * fmpq_gso_get_mat. Rows of mu have room for alloc entries, so that moving
+ * a vector only exchanges pointers.
+ */
+typedef struct
+{
+	fmpq ** b;
+	fmpq ** mu;
+	fmpq * r;
+	slong n;
+	slong m;
+	slong alloc;
+} fmpq_gso_struct;
+
+typedef fmpq_gso_struct fmpq_gso_t[1];
+
+#define fmpq_gso_mu(G, i, j) ((G)->mu[i] + (j))
+#define fmpq_gso_r(G, i) ((G)->r + (i))
+#define fmpq_gso_vec(G, i) ((G)->b[i])
+
+void fmpq_gso_init(fmpq_gso_t G, slong n)
+{
+	G->b = NULL;
+	G->mu = NULL;
+	G->r = NULL;
+	G->n = n;
+	G->m = 0;
+	G->alloc = 0;
+}
+
+void fmpq_gso_clear(fmpq_gso_t G)
+{
+	slong i;
+	
+	for(i = 0; i < G->alloc; i++) {
+		_fmpq_vec_clear(G->b[i], G->n);
+		_fmpq_vec_clear(G->mu[i], G->alloc);
+	}
+	
+	if(G->alloc) {
+		_fmpq_vec_clear(G->r, G->alloc);
+		flint_free(G->b);
+		flint_free(G->mu);
+	}
+}
+
+static void _fmpq_gso_fit_length(fmpq_gso_t G, slong m)
+{
+	slong i, j, alloc;
+	
+	if(m <= G->alloc)
+		return;
+	
+	alloc = FLINT_MAX(m, 2 * G->alloc);
+	
+	G->b = flint_realloc(G->b, alloc * sizeof(fmpq *));
+	G->mu = flint_realloc(G->mu, alloc * sizeof(fmpq *));
+	G->r = flint_realloc(G->r, alloc * sizeof(fmpq));
+	
+	for(i = 0; i < G->alloc; i++) {
+		G->mu[i] = flint_realloc(G->mu[i], alloc * sizeof(fmpq));
+		for(j = G->alloc; j < alloc; j++) {
+			fmpq_init(G->mu[i] + j);
+		}
+	}
+	
+	for(i = G->alloc; i < alloc; i++) {
+		G->b[i] = _fmpq_vec_init(G->n);
+		G->mu[i] = _fmpq_vec_init(alloc);
+		fmpq_init(G->r + i);
+	}
+	
+	G->alloc = alloc;
+}
+
+void fmpq_gso_swap(fmpq_gso_t G, slong k)
+/* Exchanges the vectors k and k + 1, updating mu and r in O(m) operations
+ * with the formulas of Cohen, Algorithm 2.6.3. The new b*_k is
+ * b*_{k+1} + mu b*_k, where mu = mu[k+1][k], and the new b*_{k+1} is zero
+ * exactly when the new r[k + 1] is, in which case its column of mu is set
+ * to zero.
+ */
+{
+	slong i, l = k + 1;
+	fmpq * p;
+	fmpq_t mu, B, t;
+	
+	if(k < 0 || l >= G->m) {
+		flint_printf("Exception (fmpq_gso_swap). Index out of range.\n");
+		abort();
+	}
+	
+	fmpq_init(mu);
+	fmpq_init(B);
+	fmpq_init(t);
+	
+	fmpq_set(mu, G->mu[l] + k);
+	fmpq_mul(B, mu, mu);
+	fmpq_mul(B, B, G->r + k);
+	fmpq_add(B, B, G->r + l);
+	
+	/* the coefficients against b*_0, ..., b*_{k-1} move with the vectors */
+	p = G->b[k]; G->b[k] = G->b[l]; G->b[l] = p;
+	p = G->mu[k]; G->mu[k] = G->mu[l]; G->mu[l] = p;
+	fmpq_zero(G->mu[k] + k);
+	
+	if(fmpq_is_zero(B)) {
+		/* the new b*_k is zero and the new b*_{k+1} is the old b*_k */
+		fmpq_swap(G->r + k, G->r + l);
+		fmpq_zero(G->mu[l] + k);
+		for(i = l + 1; i < G->m; i++) {
+			fmpq_swap(G->mu[i] + k, G->mu[i] + l);
+		}
+	} else {
+		fmpq_mul(t, mu, G->r + k);
+		fmpq_div(G->mu[l] + k, t, B);
+		fmpq_mul(t, G->r + k, G->r + l);
+		fmpq_div(G->r + l, t, B);
+		fmpq_swap(G->r + k, B);
+		
+		for(i = l + 1; i < G->m; i++) {
+			fmpq_set(t, G->mu[i] + l);
+			fmpq_mul(G->mu[i] + l, mu, t);
+			fmpq_sub(G->mu[i] + l, G->mu[i] + k, G->mu[i] + l);
+			fmpq_set(G->mu[i] + k, t);
+			fmpq_addmul(G->mu[i] + k, G->mu[l] + k, G->mu[i] + l);
+		}
+		
+		if(fmpq_is_zero(G->r + l)) {
+			for(i = l + 1; i < G->m; i++) {
+				fmpq_zero(G->mu[i] + l);
+			}
+		}
+	}
+	
+	fmpq_clear(mu);
+	fmpq_clear(B);
+	fmpq_clear(t);
+}
+
+void fmpq_gso_size_reduce(fmpq_gso_t G, slong k, slong j, const fmpq_t q)
+/* Replaces vector k by b_k - q b_j for j < k. The b*_i are unchanged, and
+ * only row k of mu is updated, in O(n + j) operations.
+ */
+{
+	slong i;
+	
+	if(j < 0 || j >= k || k >= G->m) {
+		flint_printf("Exception (fmpq_gso_size_reduce). Index out of range.\n");
+		abort();
+	}
+	
+	for(i = 0; i < G->n; i++) {
+		fmpq_submul(G->b[k] + i, q, G->b[j] + i);
+	}
+	
+	for(i = 0; i < j; i++) {
+		fmpq_submul(G->mu[k] + i, q, G->mu[j] + i);
+	}
+	
+	if(!fmpq_is_zero(G->r + j)) {
+		fmpq_sub(G->mu[k] + j, G->mu[k] + j, q);
+	}
+}
+
+static void _fmpq_gso_append(fmpq_gso_t G, const fmpq * v)
+/* Appends v in O(n m + m^2) operations. With s_j = <v, b*_j>, which row m
+ * of mu holds until the end, s_j = <v, b_j> - sum_{l < j} mu[j][l] s_l and
+ * r[m] = |v|^2 - sum_j s_j^2 / r[j].
+ */
+{
+	slong i, j, m = G->m;
+	fmpq * s;
+	fmpq_t t;
+	
+	_fmpq_gso_fit_length(G, m + 1);
+	s = G->mu[m];
+	fmpq_init(t);
+	
+	for(i = 0; i < G->n; i++) {
+		fmpq_set(G->b[m] + i, v + i);
+	}
+	
+	for(j = 0; j < m; j++) {
+		fmpq_zero(s + j);
+		for(i = 0; i < G->n; i++) {
+			fmpq_addmul(s + j, v + i, G->b[j] + i);
+		}
+		for(i = 0; i < j; i++) {
+			fmpq_submul(s + j, G->mu[j] + i, s + i);
+		}
+	}
+	
+	fmpq_zero(G->r + m);
+	for(i = 0; i < G->n; i++) {
+		fmpq_addmul(G->r + m, v + i, v + i);
+	}
+	
+	for(j = 0; j < m; j++) {
+		if(fmpq_is_zero(G->r + j)) {
+			fmpq_zero(s + j);
+		} else {
+			fmpq_set(t, s + j);
+			fmpq_div(s + j, s + j, G->r + j);
+			fmpq_submul(G->r + m, s + j, t);
+		}
+	}
+	
+	fmpq_clear(t);
+	G->m = m + 1;
+}
+
+void fmpq_gso_insert(fmpq_gso_t G, slong k, const fmpq * v)
+/* Inserts v before vector k (0 <= k <= m), by appending it and moving it
+ * down with m - k swaps: O(n m + m^2) operations in all.
+ */
+{
+	slong i;
+	
+	if(k < 0 || k > G->m) {
+		flint_printf("Exception (fmpq_gso_insert). Index out of range.\n");
+		abort();
+	}
+	
+	_fmpq_gso_append(G, v);
+	
+	for(i = G->m - 2; i >= k; i--) {
+		fmpq_gso_swap(G, i);
+	}
+}
+
+void fmpq_gso_delete(fmpq_gso_t G, slong k)
+/* Removes vector k, moving it up to the end with m - 1 - k swaps. */
+{
+	slong i;
+	
+	if(k < 0 || k >= G->m) {
+		flint_printf("Exception (fmpq_gso_delete). Index out of range.\n");
+		abort();
+	}
+	
+	for(i = k; i < G->m - 1; i++) {
+		fmpq_gso_swap(G, i);
+	}
+	
+	G->m--;
+}
+
+void fmpq_gso_set_fmpq_mat(fmpq_gso_t G, const fmpq_mat_t A)
+/* Sets G to the columns of A, which must have n rows. */
+{
+	slong i, j;
+	fmpq * v;
+	
+	if(A->r != G->n) {
+		flint_printf("Exception (fmpq_gso_set_fmpq_mat). Incompatible dimensions.\n");
+		abort();
+	}
+	
+	v = _fmpq_vec_init(A->r);
+	G->m = 0;
+	
+	for(j = 0; j < A->c; j++) {
+		for(i = 0; i < A->r; i++) {
+			fmpq_set(v + i, fmpq_mat_entry(A, i, j));
+		}
+		_fmpq_gso_append(G, v);
+	}
+	
+	_fmpq_vec_clear(v, A->r);
+}
+
+void fmpq_gso_get_mat(fmpq_mat_t B, const fmpq_gso_t G)
+/* Sets the columns of the n x m matrix B to b*_0, ..., b*_{m-1}, which is
+ * what fmpq_mat_gso returns for the matrix with columns b_0, ..., b_{m-1}.
+ */
+{
+	slong i, j, k;
+	
+	if(B->r != G->n || B->c != G->m) {
+		flint_printf("Exception (fmpq_gso_get_mat). Incompatible dimensions.\n");
+		abort();
+	}
+	
+	for(i = 0; i < G->m; i++) {
+		for(k = 0; k < G->n; k++) {
+			fmpq_set(fmpq_mat_entry(B, k, i), G->b[i] + k);
+		}
+		for(j = 0; j < i; j++) {
+			if(fmpq_is_zero(G->mu[i] + j))
+				continue;
+			for(k = 0; k < G->n; k++) {
+				fmpq_submul(fmpq_mat_entry(B, k, i),
+							G->mu[i] + j,
+							fmpq_mat_entry(B, k, j));
+			}
+		}
+	}
+}
+
+int fmpz_mat_is_lll_reduced(const fmpz_mat_t B, const fmpq_t delta,
+							const fmpq_t eta)
+/* Returns 1 if the rows of B are linearly independent and
+ * (delta, eta)-LLL-reduced, that is |mu_kj| <= eta for j < k and
+ * r_k >= (delta - mu_{k,k-1}^2) r_{k-1}, and 0 otherwise. The test is exact:
+ * with the d and L of fmpz_mat_gso_integral the conditions read
+ * |L[k][j]| <= eta d[j + 1] and d[k + 1] d[k - 1] + L[k][k-1]^2 >= delta d[k]^2.
+ */
+{
+	slong j, k, m = B->r;
+	fmpz_mat_t L;
+	fmpz * d;
+	fmpz_t s, t;
+	int r;
+	
+	fmpz_mat_init(L, m, m);
+	d = _fmpz_vec_init(m + 1);
+	fmpz_init(s);
+	fmpz_init(t);
+	
+	r = fmpz_mat_gso_integral(L, d, B);
+	
+	for(k = 1; r && k < m; k++) {
+		for(j = 0; r && j < k; j++) {
+			fmpz_mul(s, fmpz_mat_entry(L, k, j), fmpq_denref(eta));
+			fmpz_mul(t, d + j + 1, fmpq_numref(eta));
+			r = fmpz_cmpabs(s, t) <= 0;
+		}
+		
+		fmpz_mul(s, d + k + 1, d + k - 1);
+		fmpz_addmul(s, fmpz_mat_entry(L, k, k - 1),
+					fmpz_mat_entry(L, k, k - 1));
+		fmpz_mul(s, s, fmpq_denref(delta));
+		fmpz_mul(t, d + k, d + k);
+		fmpz_mul(t, t, fmpq_numref(delta));
+		r = r && fmpz_cmp(s, t) >= 0;
+	}
+	
+	fmpz_mat_clear(L);
+	_fmpz_vec_clear(d, m + 1);
+	fmpz_clear(s);
+	fmpz_clear(t);
+	
+	return r;
+}
+
+void fmpz_mat_lll_exact(fmpz_mat_t B, const fmpq_t delta)
+/* LLL reduction of the rows of B, which must be linearly independent, with
+ * parameters delta (1/4 < delta <= 1) and eta = 1/2 in exact rational
+ * arithmetic, keeping the Gram-Schmidt data in an fmpq_gso_t. This is the
+ * reference path, and the fallback of fmpz_mat_lll.
+ */
+{
+	slong i, j, k, m = B->r, n = B->c;
+	fmpq_gso_t G;
+	fmpq * v;
+	fmpq_t t;
+	fmpz_t q, u;
+	
+	fmpq_gso_init(G, n);
+	v = _fmpq_vec_init(n);
+	fmpq_init(t);
+	fmpz_init(q);
+	fmpz_init(u);
+	
+	for(i = 0; i < m; i++) {
+		for(j = 0; j < n; j++) {
+			fmpq_set_fmpz(v + j, fmpz_mat_entry(B, i, j));
+		}
+		_fmpq_gso_append(G, v);
+	}
+	
+	k = 1;
+	while(k < m) {
+		/* size reduction, q = round(mu_kj) = floor((2 p + r) / 2 r) */
+		for(j = k - 1; j >= 0; j--) {
+			fmpq * mu = fmpq_gso_mu(G, k, j);
+			
+			fmpz_mul_2exp(q, fmpq_numref(mu), 1);
+			if(fmpz_cmpabs(q, fmpq_denref(mu)) <= 0)
+				continue;
+			
+			fmpz_add(q, q, fmpq_denref(mu));
+			fmpz_mul_2exp(u, fmpq_denref(mu), 1);
+			fmpz_fdiv_qr(q, u, q, u);
+			fmpq_set_fmpz(t, q);
+			fmpq_gso_size_reduce(G, k, j, t);
+		}
+		
+		/* Lovasz condition r_k >= (delta - mu_{k,k-1}^2) r_{k-1} */
+		fmpq_mul(t, fmpq_gso_mu(G, k, k - 1), fmpq_gso_mu(G, k, k - 1));
+		fmpq_sub(t, delta, t);
+		fmpq_mul(t, t, fmpq_gso_r(G, k - 1));
+		
+		if(fmpq_cmp(fmpq_gso_r(G, k), t) >= 0) {
+			k++;
+		} else {
+			fmpq_gso_swap(G, k - 1);
+			k = FLINT_MAX(k - 1, 1);
+		}
+	}
+	
+	for(i = 0; i < m; i++) {
+		for(j = 0; j < n; j++) {
+			fmpz_set(fmpz_mat_entry(B, i, j), fmpq_numref(fmpq_gso_vec(G, i) + j));
+		}
+	}
+	
+	fmpq_gso_clear(G);
+	_fmpq_vec_clear(v, n);
+	fmpq_clear(t);
+	fmpz_clear(q);
+	fmpz_clear(u);
+}
+
+/* Bases whose Gram matrix has entries of more bits than this are left to the
+ * exact path, as they come close to the range of a double.
+ */
+#define FMPZ_MAT_LLL_D_MAX_BITS 1000
+
+static int _fmpz_mat_lll_d_size_reduce(fmpz_mat_t B, fmpz_mat_t G,
+	double * g, double * r, double * mu, slong k, double eta)
+/* Size-reduces row k of B against rows 0, ..., k - 1, keeping the exact
+ * Gram matrix G and its approximation g in step, and sets row k of the
+ * Cholesky data r (r[kj] = <b_k, b*_j> for j < k) and of mu.
+ * As in L2 the reduction is lazy: row k of r is recomputed from g after
+ * every pass, which only subtracts the rounded mu_kj, until all of them are
+ * at most eta. Returns 0 if the floating-point data is too inaccurate for
+ * this to make progress, leaving B and G a valid basis and its Gram matrix.
+ */
+{
+	slong i, j, l, d = B->r;
+	double x, max, prev = INFINITY;
+	fmpz_t X, t;
+	
+	fmpz_init(X);
+	fmpz_init(t);
+	
+	while(1) {
+		max = 0;
+		for(j = 0; j < k; j++) {
+			x = g[k * d + j];
+			for(i = 0; i < j; i++) {
+				x -= mu[j * d + i] * r[k * d + i];
+			}
+			r[k * d + j] = x;
+			mu[k * d + j] = x / r[j * d + j];
+			max = FLINT_MAX(max, fabs(mu[k * d + j]));
+		}
+		
+		if(max <= eta)
+			break;
+		
+		/* also catches a NaN */
+		if(!(max < prev)) {
+			fmpz_clear(X);
+			fmpz_clear(t);
+			return 0;
+		}
+		prev = max;
+		
+		for(j = k - 1; j >= 0; j--) {
+			x = rint(mu[k * d + j]);
+			if(x == 0)
+				continue;
+			
+			for(i = 0; i < j; i++) {
+				mu[k * d + i] -= x * mu[j * d + i];
+			}
+			
+			/* b_k -= X b_j, G_kk -= X (2 G_kj - X G_jj), G_ki -= X G_ji */
+			fmpz_set_d(X, x);
+			for(l = 0; l < B->c; l++) {
+				fmpz_submul(fmpz_mat_entry(B, k, l), X, fmpz_mat_entry(B, j, l));
+			}
+			fmpz_mul_2exp(t, fmpz_mat_entry(G, k, j), 1);
+			fmpz_submul(t, X, fmpz_mat_entry(G, j, j));
+			fmpz_submul(fmpz_mat_entry(G, k, k), X, t);
+			for(i = 0; i < d; i++) {
+				if(i != k) {
+					fmpz_submul(fmpz_mat_entry(G, k, i), X, fmpz_mat_entry(G, j, i));
+					fmpz_set(fmpz_mat_entry(G, i, k), fmpz_mat_entry(G, k, i));
+				}
+			}
+		}
+		
+		if(fmpz_bits(fmpz_mat_entry(G, k, k)) > FMPZ_MAT_LLL_D_MAX_BITS) {
+			fmpz_clear(X);
+			fmpz_clear(t);
+			return 0;
+		}
+		
+		for(i = 0; i < d; i++) {
+			g[k * d + i] = g[i * d + k] = fmpz_get_d(fmpz_mat_entry(G, k, i));
+		}
+	}
+	
+	fmpz_clear(X);
+	fmpz_clear(t);
+	
+	return 1;
+}
+
+static int _fmpz_mat_lll_d(fmpz_mat_t B, fmpz_mat_t G, double delta, double eta)
+/* The L2 algorithm of Nguyen and Stehle with double precision Cholesky
+ * factorisation of the exact Gram matrix G of the rows of B. Returns 1 if
+ * B was reduced, and 0 if the double precision data became too inaccurate,
+ * in which case B and G hold a basis of the same lattice and its Gram
+ * matrix.
+ */
+{
+	slong i, j, k, d = B->r;
+	double * g, * r, * mu, x;
+	int ok = 1;
+	
+	if(d < 2)
+		return 1;
+	
+	if(FLINT_ABS(fmpz_mat_max_bits(G)) > FMPZ_MAT_LLL_D_MAX_BITS)
+		return 0;
+	
+	g = flint_malloc(3 * d * d * sizeof(double));
+	r = g + d * d;
+	mu = r + d * d;
+	
+	for(i = 0; i < d; i++) {
+		for(j = 0; j < d; j++) {
+			g[i * d + j] = fmpz_get_d(fmpz_mat_entry(G, i, j));
+		}
+	}
+	
+	r[0] = g[0];
+	k = 1;
+	while(k < d) {
+		if(!_fmpz_mat_lll_d_size_reduce(B, G, g, r, mu, k, eta)) {
+			ok = 0;
+			break;
+		}
+		
+		/* Lovasz condition delta r_{k-1} <= s = r_k + mu_{k,k-1}^2 r_{k-1}.
+		 * s is the squared norm of the projection of b_k orthogonally to
+		 * b_0, ..., b_{k-2}, computed without the cancellation that r_k
+		 * suffers when b_k is nearly parallel to b_{k-1}; once the
+		 * condition holds, r_k >= (delta - eta^2) r_{k-1} is accurate.
+		 */
+		x = g[k * d + k];
+		for(j = 0; j < k - 1; j++) {
+			x -= mu[k * d + j] * r[k * d + j];
+		}
+		if(delta * r[(k - 1) * d + k - 1] <= x) {
+			r[k * d + k] = x - mu[k * d + k - 1] * r[k * d + k - 1];
+			if(!(r[k * d + k] > 0)) {
+				ok = 0;
+				break;
+			}
+			k++;
+			continue;
+		}
+		
+		/* also catches a NaN */
+		if(!(x >= 0)) {
+			ok = 0;
+			break;
+		}
+		
+		fmpz_mat_swap_rows(B, NULL, k - 1, k);
+		fmpz_mat_swap_rows(G, NULL, k - 1, k);
+		for(i = 0; i < d; i++) {
+			fmpz_swap(fmpz_mat_entry(G, i, k - 1), fmpz_mat_entry(G, i, k));
+		}
+		for(i = 0; i < d; i++) {
+			x = g[(k - 1) * d + i];
+			g[(k - 1) * d + i] = g[k * d + i];
+			g[k * d + i] = x;
+		}
+		for(i = 0; i < d; i++) {
+			x = g[i * d + k - 1];
+			g[i * d + k - 1] = g[i * d + k];
+			g[i * d + k] = x;
+		}
+		
+		if(k > 1) {
+			k--;
+		} else {
+			r[0] = g[0];
+		}
+	}
+	
+	flint_free(g);
+	
+	return ok;
+}
+
+int fmpz_mat_lll(fmpz_mat_t B, double delta, double eta)
+/* LLL reduction of the rows of B, which must be linearly independent, with
+ * parameters 1/4 < delta < 1 and 1/2 < eta < sqrt(delta), for example 0.99
+ * and 0.51. The basis stays exact; the Gram-Schmidt data is computed in
+ * double precision from the Gram matrix given by fmpz_mat_gram, as in L2.
+ * Should this data become too inaccurate to make progress, the reduction
+ * is finished by fmpz_mat_lll_exact from the current basis.
+ * Returns 1 if the double precision path completed, 0 if the exact
+ * fallback was needed.
+ */
+{
+	fmpz_mat_t G;
+	fmpq_t dq;
+	fmpz_t p, q;
+	int r;
+	
+	if(!(delta > 0.25 && delta < 1 && eta > 0.5 && eta * eta < delta)) {
+		flint_printf("Exception (fmpz_mat_lll). Invalid parameters.\n");
+		abort();
+	}
+	
+	if(B->r <= 1)
+		return 1;
+	
+	fmpz_mat_init(G, B->r, B->r);
+	fmpz_mat_gram(G, B);
+	r = _fmpz_mat_lll_d(B, G, delta, eta);
+	fmpz_mat_clear(G);
+	
+	if(!r) {
+		/* delta = p / q exactly, with q a power of 2 */
+		fmpq_init(dq);
+		fmpz_init(p);
+		fmpz_init(q);
+		fmpz_set_d(p, ldexp(delta, 52 - ilogb(delta)));
+		fmpz_one(q);
+		fmpz_mul_2exp(q, q, 52 - ilogb(delta));
+		fmpq_set_fmpz_frac(dq, p, q);
+		fmpz_mat_lll_exact(B, dq);
+		fmpq_clear(dq);
+		fmpz_clear(p);
+		fmpz_clear(q);
+	}
+	
+	return r;
+}
+
+static void _fmpz_mat_knapsack(fmpz_mat_t B, flint_rand_t state, slong bits)
+/* Rows (w_i, e_i) with random weights w_i of the given number of bits. */
+{
+	slong i;
+	
+	fmpz_mat_zero(B);
+	for(i = 0; i < B->r; i++) {
+		fmpz_randbits(fmpz_mat_entry(B, i, 0), state, bits);
+		fmpz_abs(fmpz_mat_entry(B, i, 0), fmpz_mat_entry(B, i, 0));
+		fmpz_one(fmpz_mat_entry(B, i, i + 1));
+	}
+}
+
+void profile_fmpz_mat_lll(void)
+/* Knapsack bases of dimension d with d-bit weights. The exact path is only
+ * timed in the smaller dimensions.
+ */
+{
+	slong d, sizes[] = {10, 20, 30, 40, 60, 100, 150, 200};
+	slong i;
+	fmpz_mat_t A, B;
+	fmpq_t delta;
+	timeit_t t;
+	double td, te;
+	int r;
+	FLINT_TEST_INIT(state);
+	
+	fmpq_init(delta);
+	fmpq_set_si(delta, 99, 100);
+	
+	flint_printf("    d  double (ms)  path    exact (ms)  speedup\n");
+	
+	for(i = 0; i < (slong) (sizeof(sizes) / sizeof(slong)); i++) {
+		d = sizes[i];
+		fmpz_mat_init(A, d, d + 1);
+		fmpz_mat_init(B, d, d + 1);
+		_fmpz_mat_knapsack(A, state, d);
+		
+		fmpz_mat_set(B, A);
+		timeit_start(t);
+		r = fmpz_mat_lll(B, 0.99, 0.51);
+		timeit_stop(t);
+		td = FLINT_MAX(t->wall, 1);
+		
+		if(d <= 40) {
+			fmpz_mat_set(B, A);
+			timeit_start(t);
+			fmpz_mat_lll_exact(B, delta);
+			timeit_stop(t);
+			te = FLINT_MAX(t->wall, 1);
+			flint_printf("%5d  %11.0f  %-6s  %10.0f  %7.1f\n", (int) d, td,
+						 r ? "double" : "exact", te, te / td);
+		} else {
+			flint_printf("%5d  %11.0f  %-6s\n", (int) d, td,
+						 r ? "double" : "exact");
+		}
+		
+		fmpz_mat_clear(A);
+		fmpz_mat_clear(B);
+	}
+	
+	fmpq_clear(delta);
+	FLINT_TEST_CLEANUP(state);
+}
+
+int main(int argc, char **argv)
 {
 	int i;
+	
+	if(argc > 1 && strcmp(argv[1], "profile") == 0) {
+		profile_fmpz_mat_lll();
+		return EXIT_SUCCESS;
+	}
+	
     FLINT_TEST_INIT(state);
     
 
@@ -135,6 +943,316 @@ int main(void)
         fmpq_clear(dot);
     }
 
+    /* integral GSO against fmpq_mat_gso of the transpose */
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        fmpz_mat_t A, L;
+        fmpq_mat_t Q, B;
+        fmpz * d;
+        fmpq_t x, y;
+        slong m, n, bits, j, k, l;
+
+        n = n_randint(state, 12);
+        m = n_randint(state, n + 1);
+        bits = 1 + n_randint(state, 100);
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(L, m, m);
+        fmpq_mat_init(Q, n, m);
+        fmpq_mat_init(B, n, m);
+        d = _fmpz_vec_init(m + 1);
+        fmpq_init(x);
+        fmpq_init(y);
+
+        fmpz_mat_randtest(A, state, bits);
+        for (j = 0; j < m; j++)
+            for (k = 0; k < n; k++)
+                fmpq_set_fmpz(fmpq_mat_entry(Q, k, j), fmpz_mat_entry(A, j, k));
+        fmpq_mat_gso(B, Q);
+
+        if (m > 0 && n_randint(state, 4) == 0)
+        {
+            /* a dependent row */
+            j = n_randint(state, m);
+            k = n_randint(state, m);
+            if (j != k)
+            {
+                for (l = 0; l < n; l++)
+                    fmpz_set(fmpz_mat_entry(A, j, l), fmpz_mat_entry(A, k, l));
+                if (fmpz_mat_gso_integral(L, d, A))
+                {
+                    flint_printf("FAIL (dependent rows not detected):\n");
+                    abort();
+                }
+                goto cleanup;
+            }
+        }
+
+        if (!fmpz_mat_gso_integral(L, d, A))
+        {
+            /* must then have a zero Gram-Schmidt vector */
+            for (j = 0; j < m; j++)
+            {
+                fmpq_zero(x);
+                for (l = 0; l < n; l++)
+                    fmpq_addmul(x, fmpq_mat_entry(B, l, j),
+                                fmpq_mat_entry(B, l, j));
+                if (fmpq_is_zero(x))
+                    break;
+            }
+            if (j == m)
+            {
+                flint_printf("FAIL (independent rows reported dependent):\n");
+                abort();
+            }
+            goto cleanup;
+        }
+
+        for (j = 0; j < m; j++)
+        {
+            /* y = |b*_j|^2, check d[j + 1] = d[j] y */
+            fmpq_zero(y);
+            for (l = 0; l < n; l++)
+                fmpq_addmul(y, fmpq_mat_entry(B, l, j), fmpq_mat_entry(B, l, j));
+            fmpq_mul_fmpz(x, y, d + j);
+            if (!fmpz_is_one(fmpq_denref(x))
+                || !fmpz_equal(fmpq_numref(x), d + j + 1)
+                || !fmpz_equal(fmpz_mat_entry(L, j, j), d + j + 1))
+            {
+                flint_printf("FAIL (d):\n");
+                flint_printf("m = %wd, n = %wd, j = %wd\n", m, n, j);
+                abort();
+            }
+
+            /* L[k][j] = d[j + 1] <a_k, b*_j> / |b*_j|^2 */
+            for (k = j + 1; k < m; k++)
+            {
+                fmpq_zero(x);
+                for (l = 0; l < n; l++)
+                    fmpq_addmul(x, fmpq_mat_entry(Q, l, k),
+                                fmpq_mat_entry(B, l, j));
+                fmpq_div(x, x, y);
+                fmpq_mul_fmpz(x, x, d + j + 1);
+                if (!fmpz_is_one(fmpq_denref(x))
+                    || !fmpz_equal(fmpq_numref(x), fmpz_mat_entry(L, k, j)))
+                {
+                    flint_printf("FAIL (lambda):\n");
+                    flint_printf("m = %wd, n = %wd, k = %wd, j = %wd\n",
+                                 m, n, k, j);
+                    abort();
+                }
+            }
+        }
+
+    cleanup:
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(L);
+        fmpq_mat_clear(Q);
+        fmpq_mat_clear(B);
+        _fmpz_vec_clear(d, m + 1);
+        fmpq_clear(x);
+        fmpq_clear(y);
+    }
+
+    /* incremental updates against a full recomputation */
+    for (i = 0; i < 100 * flint_test_multiplier(); i++)
+    {
+        fmpq_gso_t G, H;
+        fmpq_mat_t A, B, C;
+        fmpq * v;
+        fmpq_t q;
+        slong m, n, bits, j, k, l, op;
+
+        n = 1 + n_randint(state, 8);
+        m = n_randint(state, n + 2);
+        bits = 1 + n_randint(state, 20);
+
+        fmpq_gso_init(G, n);
+        fmpq_gso_init(H, n);
+        v = _fmpq_vec_init(n);
+        fmpq_init(q);
+
+        fmpq_mat_init(A, n, m);
+        fmpq_mat_randtest(A, state, bits);
+        fmpq_gso_set_fmpq_mat(G, A);
+        fmpq_mat_clear(A);
+
+        for (op = 0; op < 20; op++)
+        {
+            switch (n_randint(state, 4))
+            {
+            case 0:
+                if (G->m >= 2)
+                    fmpq_gso_swap(G, n_randint(state, G->m - 1));
+                break;
+            case 1:
+                if (G->m >= 2)
+                {
+                    k = 1 + n_randint(state, G->m - 1);
+                    j = n_randint(state, k);
+                    fmpq_randtest(q, state, bits);
+                    fmpq_gso_size_reduce(G, k, j, q);
+                }
+                break;
+            case 2:
+                if (G->m > 0 && n_randint(state, 2))
+                {
+                    /* a vector in the span of the others */
+                    j = n_randint(state, G->m);
+                    fmpq_randtest(q, state, bits);
+                    for (l = 0; l < n; l++)
+                        fmpq_mul(v + l, q, fmpq_gso_vec(G, j) + l);
+                }
+                else
+                {
+                    for (l = 0; l < n; l++)
+                        fmpq_randtest(v + l, state, bits);
+                }
+                fmpq_gso_insert(G, n_randint(state, G->m + 1), v);
+                break;
+            default:
+                if (G->m > 0)
+                    fmpq_gso_delete(G, n_randint(state, G->m));
+            }
+
+            m = G->m;
+            fmpq_mat_init(A, n, m);
+            fmpq_mat_init(B, n, m);
+            fmpq_mat_init(C, n, m);
+
+            for (j = 0; j < m; j++)
+                for (l = 0; l < n; l++)
+                    fmpq_set(fmpq_mat_entry(A, l, j), fmpq_gso_vec(G, j) + l);
+
+            fmpq_gso_set_fmpq_mat(H, A);
+            fmpq_mat_gso(B, A);
+            fmpq_gso_get_mat(C, G);
+
+            for (j = 0; j < m; j++)
+            {
+                if (!fmpq_equal(fmpq_gso_r(G, j), fmpq_gso_r(H, j)))
+                {
+                    flint_printf("FAIL (r):\n");
+                    flint_printf("n = %wd, m = %wd, j = %wd\n", n, m, j);
+                    abort();
+                }
+                for (k = 0; k < j; k++)
+                {
+                    if (!fmpq_equal(fmpq_gso_mu(G, j, k), fmpq_gso_mu(H, j, k)))
+                    {
+                        flint_printf("FAIL (mu):\n");
+                        flint_printf("n = %wd, m = %wd, j = %wd, k = %wd\n",
+                                     n, m, j, k);
+                        abort();
+                    }
+                }
+            }
+
+            if (!fmpq_mat_equal(B, C))
+            {
+                flint_printf("FAIL (incremental gso):\n");
+                fmpq_mat_print(B);
+                fmpq_mat_print(C);
+                abort();
+            }
+
+            fmpq_mat_clear(A);
+            fmpq_mat_clear(B);
+            fmpq_mat_clear(C);
+        }
+
+        fmpq_gso_clear(G);
+        fmpq_gso_clear(H);
+        _fmpq_vec_clear(v, n);
+        fmpq_clear(q);
+    }
+
+    /* LLL, double precision and exact */
+    for (i = 0; i < 50 * flint_test_multiplier(); i++)
+    {
+        fmpz_mat_t A, B, L;
+        fmpz * d, * e;
+        fmpq_t delta, eta, delta2, eta2;
+        slong m, n, bits;
+        int r;
+
+        m = 1 + n_randint(state, 12);
+        n = m + n_randint(state, 4);
+        bits = 1 + n_randint(state, 60);
+
+        fmpz_mat_init(A, m, n);
+        fmpz_mat_init(B, m, n);
+        fmpz_mat_init(L, m, m);
+        d = _fmpz_vec_init(m + 1);
+        e = _fmpz_vec_init(m + 1);
+        fmpq_init(delta);
+        fmpq_init(eta);
+        fmpq_init(delta2);
+        fmpq_init(eta2);
+        fmpq_set_si(delta, 99, 100);
+        fmpq_set_si(eta, 1, 2);
+        fmpq_set_si(delta2, 98, 100);
+        fmpq_set_si(eta2, 52, 100);
+
+        if (n_randint(state, 2))
+        {
+            fmpz_mat_clear(A);
+            fmpz_mat_clear(B);
+            n = m + 1;
+            fmpz_mat_init(A, m, n);
+            fmpz_mat_init(B, m, n);
+            _fmpz_mat_knapsack(A, state, 1 + n_randint(state, 100));
+        }
+        else if (m <= 4 && n_randint(state, 4) == 0)
+        {
+            /* too large for the double precision path */
+            fmpz_mat_randtest(A, state, 600);
+        }
+        else
+        {
+            fmpz_mat_randtest(A, state, bits);
+        }
+
+        if (!fmpz_mat_gso_integral(L, d, A))
+            goto lll_cleanup;
+
+        fmpz_mat_set(B, A);
+        r = fmpz_mat_lll(B, 0.99, 0.51);
+
+        if (!fmpz_mat_is_lll_reduced(B, delta2, eta2)
+            || !fmpz_mat_gso_integral(L, e, B) || !fmpz_equal(d + m, e + m)
+            || (r == 1 && fmpz_mat_max_bits(A) > 500))
+        {
+            flint_printf("FAIL (fmpz_mat_lll):\n");
+            fmpz_mat_print_pretty(A);
+            fmpz_mat_print_pretty(B);
+            abort();
+        }
+
+        fmpz_mat_set(B, A);
+        fmpz_mat_lll_exact(B, delta);
+
+        if (!fmpz_mat_is_lll_reduced(B, delta, eta)
+            || !fmpz_mat_gso_integral(L, e, B) || !fmpz_equal(d + m, e + m))
+        {
+            flint_printf("FAIL (fmpz_mat_lll_exact):\n");
+            fmpz_mat_print_pretty(A);
+            fmpz_mat_print_pretty(B);
+            abort();
+        }
+
+    lll_cleanup:
+        fmpz_mat_clear(A);
+        fmpz_mat_clear(B);
+        fmpz_mat_clear(L);
+        _fmpz_vec_clear(d, m + 1);
+        _fmpz_vec_clear(e, m + 1);
+        fmpq_clear(delta);
+        fmpq_clear(eta);
+        fmpq_clear(delta2);
+        fmpq_clear(eta2);
+    }
+
     FLINT_TEST_CLEANUP(state);
     
     flint_printf("PASS\n");
@@ -23,246 +23,1678 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "flint/fmpz.h"
+#include "flint/fmpz_vec.h"
+#include "flint/ulong_extras.h"
+#include "thread_pool.c"
 
+/*
+ * Elimination engines: RREF_FRACTION is the original rational
+ * Gauss-Jordan, RREF_BAREISS and RREF_MULTI_MOD work on integers only.
+ * RREF_AUTO (the default) uses Bareiss for small matrices and the
+ * multimodular engine from RREF_MULTI_MOD_CUTOFF rows on.
+ */
+#define RREF_AUTO 0
+#define RREF_FRACTION 1
+#define RREF_BAREISS 2
+#define RREF_MULTI_MOD 3
+
+#define RREF_MULTI_MOD_CUTOFF 20
+
+int rref_algorithm = RREF_AUTO;
+
+/*
+ * A rational number num/den in lowest terms with den > 0. An fmpz holds
+ * any value of at most FLINT_BITS - 2 bits inline in a machine word, so
+ * a Fraction only touches the heap once an entry outgrows that.
+ *
+ * The arithmetic below works directly on those words, with checked
+ * 128-bit products and a binary gcd, and only falls back to the generic
+ * fmpz functions when an operand is a multi-limb integer or the result
+ * would not fit a word.
+ */
 typedef struct frac_struct {
 	fmpz_t num;
 	fmpz_t den;
 } Fraction;
 
-Fraction frac_divide(Fraction res, Fraction a, Fraction b)
+/* True if both parts of f are stored inline; *f->num is then the value. */
+#define FRAC_IS_SMALL(f) (!COEFF_IS_MPZ(*(f)->num) && !COEFF_IS_MPZ(*(f)->den))
+
+/*
+ * Scratch space for one elimination, set up before it starts so that
+ * the inner loops never initialise or free a temporary: integer
+ * temporaries pre-sized to the expected size of the intermediate
+ * products, the pivot and multiplier of the rational engine, and the
+ * row permutation through which pivot rows are exchanged instead of
+ * moving their entries. The matrix is put back in order once, at the
+ * end, by rref_workspace_unpermute.
+ */
+typedef struct rref_workspace_struct {
+	fmpz_t t;
+	fmpz_t e;
+	fmpz_t g;
+	Fraction p;
+	Fraction f;
+	int *row;	/* row[i] is the storage row of row i */
+	int *at;	/* at[k] is the row held by storage row k */
+	int rows;
+} RrefWorkspace;
+
+void frac_init(Fraction *f)
+{
+	fmpz_init(f->num);
+	fmpz_init_set_ui(f->den, 1);
+}
+
+void frac_clear(Fraction *f)
+{
+	fmpz_clear(f->num);
+	fmpz_clear(f->den);
+}
+
+void frac_set(Fraction *res, const Fraction *a)
+{
+	fmpz_set(res->num, a->num);
+	fmpz_set(res->den, a->den);
+}
+
+ulong frac_gcd_ui(ulong a, ulong b)
+{
+	int s;
+	if(a == 0 || b == 0) {
+		return a | b;
+	}
+	s = __builtin_ctzl(a | b);
+	a >>= __builtin_ctzl(a);
+	while(b != 0) {
+		b >>= __builtin_ctzl(b);
+		if(a > b) {
+			ulong t = a;
+			a = b;
+			b = t;
+		}
+		b -= a;
+	}
+	return a << s;
+}
+
+/* Sets res to n/d if both fit inline, which the caller has reduced. */
+int frac_set_si128(Fraction *res, __int128 n, __int128 d)
+{
+	if(d < 0) {
+		n = -n;
+		d = -d;
+	}
+	if(n > COEFF_MAX || n < COEFF_MIN || d > COEFF_MAX) {
+		return 0;
+	}
+	fmpz_set_si(res->num, (slong) n);
+	fmpz_set_si(res->den, (slong) d);
+	return 1;
+}
+
+void frac_canonicalise(Fraction *res, RrefWorkspace *ws)
+{
+	fmpz_gcd(ws->g, res->num, res->den);
+	if(fmpz_sgn(res->den) < 0) {
+		fmpz_neg(ws->g, ws->g);
+	}
+	if(!fmpz_is_one(ws->g)) {
+		fmpz_divexact(res->num, res->num, ws->g);
+		fmpz_divexact(res->den, res->den, ws->g);
+	}
+}
+
+/*
+ * The slow paths of the operations below use the temporaries of ws and
+ * so never allocate one of their own.
+ */
+
+/* Sets res to a/b; res may alias either operand. */
+void frac_div(Fraction *res, const Fraction *a, const Fraction *b,
+	RrefWorkspace *ws)
+{
+	if(FRAC_IS_SMALL(a) && FRAC_IS_SMALL(b)) {
+		slong x = *a->num, y = *a->den, u = *b->num, v = *b->den;
+		ulong g1 = frac_gcd_ui(FLINT_ABS(x), FLINT_ABS(u));
+		ulong g2 = frac_gcd_ui(y, v);
+		if(frac_set_si128(res, (__int128) (x / (slong) g1) * (v / (slong) g2),
+			(__int128) (y / (slong) g2) * (u / (slong) g1))) {
+			return;
+		}
+	}
+	fmpz_mul(ws->t, a->num, b->den);
+	fmpz_mul(res->den, a->den, b->num);
+	fmpz_set(res->num, ws->t);
+	frac_canonicalise(res, ws);
+}
+
+/* Sets res to a*b; res may alias either operand. */
+void frac_mul(Fraction *res, const Fraction *a, const Fraction *b,
+	RrefWorkspace *ws)
+{
+	if(FRAC_IS_SMALL(a) && FRAC_IS_SMALL(b)) {
+		slong x = *a->num, y = *a->den, u = *b->num, v = *b->den;
+		ulong g1 = frac_gcd_ui(FLINT_ABS(x), v);
+		ulong g2 = frac_gcd_ui(FLINT_ABS(u), y);
+		if(frac_set_si128(res, (__int128) (x / (slong) g1) * (u / (slong) g2),
+			(__int128) (y / (slong) g2) * (v / (slong) g1))) {
+			return;
+		}
+	}
+	fmpz_mul(res->num, a->num, b->num);
+	fmpz_mul(res->den, a->den, b->den);
+	frac_canonicalise(res, ws);
+}
+
+/*
+ * Sets res to res - a*b. On the fast path a*b = p/q is formed with cross
+ * cancellation and res - p/q with Henrici's trick, so that the only
+ * gcds taken are of single words.
+ */
+void frac_submul(Fraction *res, const Fraction *a, const Fraction *b,
+	RrefWorkspace *ws)
+{
+	if(fmpz_is_zero(a->num) || fmpz_is_zero(b->num)) {
+		return;
+	}
+	if(FRAC_IS_SMALL(res) && FRAC_IS_SMALL(a) && FRAC_IS_SMALL(b)) {
+		slong x = *res->num, y = *res->den;
+		slong s = *a->num, t = *a->den, u = *b->num, v = *b->den;
+		ulong g1 = frac_gcd_ui(FLINT_ABS(s), v);
+		ulong g2 = frac_gcd_ui(FLINT_ABS(u), t);
+		__int128 p = (__int128) (s / (slong) g1) * (u / (slong) g2);
+		__int128 q = (__int128) (t / (slong) g2) * (v / (slong) g1);
+		ulong g = frac_gcd_ui(y, (ulong) (q % y));
+		__int128 n1, n2, n, d;
+		if(!__builtin_mul_overflow((__int128) x, q / (slong) g, &n1)
+			&& !__builtin_mul_overflow(p, (__int128) (y / (slong) g), &n2)
+			&& !__builtin_sub_overflow(n1, n2, &n)
+			&& !__builtin_mul_overflow(q, (__int128) (y / (slong) g), &d)) {
+			ulong h = frac_gcd_ui((ulong) ((n < 0 ? -n : n) % g), g);
+			if(frac_set_si128(res, n / (slong) h, d / (slong) h)) {
+				return;
+			}
+		}
+	}
+	fmpz_mul(ws->t, a->num, b->num);
+	fmpz_mul(res->num, res->num, a->den);
+	fmpz_mul(res->num, res->num, b->den);
+	fmpz_submul(res->num, ws->t, res->den);
+	fmpz_mul(res->den, res->den, a->den);
+	fmpz_mul(res->den, res->den, b->den);
+	frac_canonicalise(res, ws);
+}
+
+/*
+ * All results go through a ResultWriter: text is formatted into one
+ * reusable buffer, which is emitted with a single write() whenever it
+ * fills up, so printing a matrix costs no stdio calls and no allocations
+ * per entry. Integers that fit a word are converted to decimal directly;
+ * larger ones are converted in one go by fmpz_get_str into the buffer.
+ *
+ * With binary set, results are written instead as a stream starting
+ * with "RRR\1" in which every number is a zigzag LEB128 varint (the
+ * encoding of the batch input format), per matrix: rows, cols, a kind
+ * (0 for a non-square matrix, 1 for a non-singular and 2 for a singular
+ * square one), the RREF as numerator, denominator pairs, then for kind 1
+ * the inverse as pairs and for kinds 1 and 2 the determinant.
+ */
+#define RESULT_MAGIC "RRR\1"
+#define RESULT_BUFFER (1 << 20)
+
+typedef struct result_writer_struct {
+	char *buf;
+	size_t len;
+	size_t alloc;
+	int fd;
+	int binary;
+} ResultWriter;
+
+ResultWriter result_out = { NULL, 0, 0, 1, 0 };
+
+void writer_flush(ResultWriter *w)
+{
+	size_t done = 0;
+	ssize_t k;
+	while(done < w->len) {
+		k = write(w->fd, w->buf + done, w->len - done);
+		if(k <= 0) {
+			break;
+		}
+		done += k;
+	}
+	w->len = 0;
+}
+
+/* Makes room for n more bytes. */
+void writer_reserve(ResultWriter *w, size_t n)
+{
+	if(w->len + n <= w->alloc) {
+		return;
+	}
+	writer_flush(w);
+	if(n > w->alloc) {
+		w->alloc = FLINT_MAX(n, RESULT_BUFFER);
+		w->buf = realloc(w->buf, w->alloc);
+	}
+}
+
+void writer_puts(ResultWriter *w, const char *s)
 {
-	fmpz_mul(res.num, a.num, b.den);
-	fmpz_mul(res.den, a.den, b.num);
-	return res;
+	size_t n = strlen(s);
+	writer_reserve(w, n);
+	memcpy(w->buf + w->len, s, n);
+	w->len += n;
 }
 
-Fraction frac_subtract(Fraction res, Fraction a, Fraction b)
+void writer_putc(ResultWriter *w, char c)
 {
-	fmpz_mul(res.num, a.num, b.den);
-	fmpz_submul(res.num, b.num, a.den);
-	fmpz_mul(res.den, a.den, b.den);
-	return res;
+	writer_reserve(w, 1);
+	w->buf[w->len++] = c;
 }
 
-Fraction frac_multiply(Fraction res, Fraction a, Fraction b)
+void writer_ui(ResultWriter *w, ulong x)
 {
-	fmpz_mul(res.num, a.num, b.num);
-	fmpz_mul(res.den, a.den, b.den);
-	return res;
+	char d[24];
+	int n = 0;
+	do {
+		d[n++] = '0' + x % 10;
+		x /= 10;
+	} while(x != 0);
+	writer_reserve(w, n);
+	while(n > 0) {
+		w->buf[w->len++] = d[--n];
+	}
+}
+
+/* Writes |x| in decimal. */
+void writer_fmpz_abs(ResultWriter *w, const fmpz_t x)
+{
+	size_t n;
+	char *s;
+	if(!COEFF_IS_MPZ(*x)) {
+		writer_ui(w, FLINT_ABS(*x));
+		return;
+	}
+	writer_reserve(w, fmpz_sizeinbase(x, 10) + 2);
+	s = w->buf + w->len;
+	fmpz_get_str(s, 10, x);
+	n = strlen(s);
+	if(s[0] == '-') {
+		memmove(s, s + 1, n--);
+	}
+	w->len += n;
 }
 
-void inverse(Fraction *m, int rows, int cols)
+void writer_fmpz(ResultWriter *w, const fmpz_t x)
+{
+	if(fmpz_sgn(x) < 0) {
+		writer_putc(w, '-');
+	}
+	writer_fmpz_abs(w, x);
+}
+
+/* Writes x as a zigzag LEB128 varint. */
+void writer_varint(ResultWriter *w, const fmpz_t x)
+{
+	fmpz_t z;
+	ulong v;
+	if(!COEFF_IS_MPZ(*x)) {
+		v = *x < 0 ? 2 * (ulong) (-*x) - 1 : 2 * (ulong) *x;
+		writer_reserve(w, 10);
+		while(v >= 0x80) {
+			w->buf[w->len++] = (char) (v | 0x80);
+			v >>= 7;
+		}
+		w->buf[w->len++] = (char) v;
+		return;
+	}
+	fmpz_init(z);
+	fmpz_mul_2exp(z, x, 1);
+	if(fmpz_sgn(z) < 0) {
+		fmpz_neg(z, z);
+		fmpz_sub_ui(z, z, 1);
+	}
+	writer_reserve(w, fmpz_bits(z) / 7 + 1);
+	while(fmpz_cmp_ui(z, 0x80) >= 0) {
+		w->buf[w->len++] = (char) (fmpz_fdiv_ui(z, 0x80) | 0x80);
+		fmpz_fdiv_q_2exp(z, z, 7);
+	}
+	w->buf[w->len++] = (char) fmpz_get_ui(z);
+	fmpz_clear(z);
+}
+
+void writer_si(ResultWriter *w, slong x)
+{
+	fmpz_t t;
+	fmpz_init(t);
+	fmpz_set_si(t, x);
+	writer_varint(w, t);
+	fmpz_clear(t);
+}
+
+/*
+ * Writes num/den, which must be in lowest terms, as an integer if den is
+ * +-1 and as a fraction with positive denominator otherwise (or as a
+ * pair in binary mode, with the sign moved to the numerator).
+ */
+void writer_frac(ResultWriter *w, const fmpz_t num, const fmpz_t den)
+{
+	if(w->binary) {
+		if(fmpz_sgn(den) < 0) {
+			fmpz_t n, d;
+			fmpz_init(n);
+			fmpz_init(d);
+			fmpz_neg(n, num);
+			fmpz_neg(d, den);
+			writer_varint(w, n);
+			writer_varint(w, d);
+			fmpz_clear(n);
+			fmpz_clear(d);
+		} else {
+			writer_varint(w, num);
+			writer_varint(w, den);
+		}
+		return;
+	}
+	if(fmpz_sgn(num) * fmpz_sgn(den) < 0) {
+		writer_putc(w, '-');
+	}
+	writer_fmpz_abs(w, num);
+	if(!fmpz_is_pm1(den)) {
+		writer_putc(w, '/');
+		writer_fmpz_abs(w, den);
+	}
+}
+
+/*
+ * Sets up ws for an elimination of a matrix with the given number of
+ * rows, with the integer temporaries pre-sized to limbs limbs.
+ */
+void rref_workspace_init(RrefWorkspace *ws, int rows, ulong limbs)
+{
+	int i;
+	fmpz_init2(ws->t, limbs);
+	fmpz_init2(ws->e, limbs);
+	fmpz_init2(ws->g, limbs);
+	frac_init(&ws->p);
+	frac_init(&ws->f);
+	ws->row = (int *) malloc(sizeof(int) * rows);
+	ws->at = (int *) malloc(sizeof(int) * rows);
+	for(i = 0; i < rows; i++) {
+		ws->row[i] = ws->at[i] = i;
+	}
+	ws->rows = rows;
+}
+
+void rref_workspace_clear(RrefWorkspace *ws)
+{
+	fmpz_clear(ws->t);
+	fmpz_clear(ws->e);
+	fmpz_clear(ws->g);
+	frac_clear(&ws->p);
+	frac_clear(&ws->f);
+	free(ws->row);
+	free(ws->at);
+}
+
+/*
+ * Returns the number of limbs of a product of two minors of size n of a
+ * matrix with entries of at most bits bits, by Hadamard's bound, which is
+ * what the temporaries of an elimination have to hold.
+ */
+ulong rref_workspace_limbs(ulong bits, int n)
+{
+	bits = n * (bits + FLINT_BIT_COUNT(n) / 2 + 1);
+	return 2 * bits / FLINT_BITS + 1;
+}
+
+/* Exchanges rows i and l of the matrix being eliminated. */
+void rref_workspace_swap(RrefWorkspace *ws, int i, int l)
+{
+	int k = ws->row[i];
+	ws->row[i] = ws->row[l];
+	ws->row[l] = k;
+	ws->at[ws->row[i]] = i;
+	ws->at[ws->row[l]] = l;
+}
+
+/*
+ * Moves the rows of the rows x cols matrix m, or if a is not NULL of a,
+ * into the order recorded in ws, with at most one exchange of storage
+ * rows per row.
+ */
+void rref_workspace_unpermute(RrefWorkspace *ws, Fraction *m, fmpz *a,
+	int cols)
+{
+	int i, k, l, j;
+	for(i = 0; i < ws->rows; i++) {
+		k = ws->row[i];
+		if(k == i) {
+			continue;
+		}
+		for(j = 0; j < cols; j++) {
+			if(a != NULL) {
+				fmpz_swap(a + i*cols+j, a + k*cols+j);
+			} else {
+				fmpz_swap(m[i*cols+j].num, m[k*cols+j].num);
+				fmpz_swap(m[i*cols+j].den, m[k*cols+j].den);
+			}
+		}
+		/* the row that was stored in row i now lives in row k */
+		l = ws->at[i];
+		ws->row[l] = k;
+		ws->at[k] = l;
+		ws->row[i] = ws->at[i] = i;
+	}
+}
+
+/*
+ * Memory statistics, enabled by -stats: the GMP and FLINT allocators are
+ * replaced by counting wrappers, and every elimination reports on stderr
+ * the number of heap allocations it made and the peak resident set size
+ * of the process so far.
+ */
+typedef struct rref_stats_struct {
+	int enabled;
+	long allocs;
+	long bytes;
+} RrefStats;
+
+RrefStats rref_stats = { 0, 0, 0 };
+
+void rref_stats_count(size_t n)
+{
+	__atomic_add_fetch(&rref_stats.allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&rref_stats.bytes, (long) n, __ATOMIC_RELAXED);
+}
+
+void *rref_stats_malloc(size_t n)
+{
+	rref_stats_count(n);
+	return malloc(n);
+}
+
+void *rref_stats_calloc(size_t k, size_t n)
+{
+	rref_stats_count(k * n);
+	return calloc(k, n);
+}
+
+void *rref_stats_realloc(void *p, size_t n)
+{
+	rref_stats_count(n);
+	return realloc(p, n);
+}
+
+void *rref_stats_gmp_realloc(void *p, size_t old, size_t n)
+{
+	(void) old;
+	rref_stats_count(n);
+	return realloc(p, n);
+}
+
+void rref_stats_gmp_free(void *p, size_t n)
+{
+	(void) n;
+	free(p);
+}
+
+void rref_stats_enable(void)
+{
+	rref_stats.enabled = 1;
+	__flint_set_memory_functions(rref_stats_malloc, rref_stats_calloc,
+		rref_stats_realloc, free);
+	mp_set_memory_functions(rref_stats_malloc, rref_stats_gmp_realloc,
+		rref_stats_gmp_free);
+}
+
+/*
+ * Reports the allocations made since the counters were at allocs and
+ * bytes by the elimination of a rows x cols matrix.
+ */
+void rref_stats_report(int rows, int cols, long allocs, long bytes)
+{
+	struct rusage u;
+	if(!rref_stats.enabled) {
+		return;
+	}
+	getrusage(RUSAGE_SELF, &u);
+	fprintf(stderr, "stats: %d x %d: %ld allocations, %ld bytes, "
+		"peak RSS %ld kB\n", rows, cols, rref_stats.allocs - allocs,
+		rref_stats.bytes - bytes, (long) u.ru_maxrss);
+}
+
+/*
+ * Rational Gauss-Jordan elimination of m in place, returning the rank.
+ * If det is not NULL it is multiplied by the pivots, with the sign of
+ * the row swaps. ws must have been set up for rows rows.
+ */
+int frac_rref(Fraction *m, int rows, int cols, Fraction *det,
+	RrefWorkspace *ws)
 {
 	int r = 0;
 	int i, j, k, l;
-	Fraction temp, det;
-	fmpz_init_set_ui(det.num, 1);
-	fmpz_init_set_ui(det.den, 1);
-	fmpz_t g;
-	for(j = 0; j < 2 * cols; j++) {
+	Fraction *pr, *mi;
+	for(j = 0; j < cols; j++) {
 		l = -1;
 		i = r;
 		while(l == -1 && i < rows) {
-			if(!fmpz_is_zero(m[i*2*cols+j].num)) {
+			if(!fmpz_is_zero(m[ws->row[i]*cols+j].num)) {
 				l = i;
 			}
 			i++;
 		}
 		if(l != -1) {
 			if(l != r) {
-				for(k = 0; k < 2 * cols; k++) {
-					temp = m[r*2*cols+k];
-					m[r*2*cols+k] = m[l*2*cols+k];
-					m[l*2*cols+k] = temp;
+				rref_workspace_swap(ws, r, l);
+				if(det != NULL) {
+					fmpz_neg(det->num, det->num);
 				}
-				fmpz_mul_si(det.num, det.num, -1);
-			}
-			temp = m[r*2*cols+j];
-			det = frac_multiply(det, det, temp);
-			fmpz_gcd(g, det.num, det.den);
-			fmpz_divexact(det.num, det.num, g);
-			fmpz_divexact(det.den, det.den, g);
-			for(k = 0; k < 2 * cols; k++) {
-				m[r*2*cols+k] = frac_divide(m[r*2*cols+k], m[r*2*cols+k], temp);
-				fmpz_gcd(g, m[r*2*cols+k].num, m[r*2*cols+k].den);
-				fmpz_divexact(m[r*2*cols+k].num, m[r*2*cols+k].num, g);
-				fmpz_divexact(m[r*2*cols+k].den, m[r*2*cols+k].den, g);
+			}
+			pr = m + ws->row[r]*cols;
+			frac_set(&ws->p, &pr[j]);
+			if(det != NULL) {
+				frac_mul(det, det, &ws->p, ws);
+			}
+			for(k = 0; k < cols; k++) {
+				frac_div(&pr[k], &pr[k], &ws->p, ws);
 			}
 			for(i = 0; i < rows; i++) {
-				temp = m[i*2*cols+j];
-				if(i != r) {
-					for(k = 0; k < 2 * cols; k++) {
-						m[i*2*cols+k] = frac_subtract(m[i*2*cols+k], m[i*2*cols+k], frac_multiply(temp, temp, m[r*2*cols+k]));
-						fmpz_gcd(g, m[i*2*cols+k].num, m[i*2*cols+k].den);
-						fmpz_divexact(m[i*2*cols+k].num, m[i*2*cols+k].num, g);
-						fmpz_divexact(m[i*2*cols+k].den, m[i*2*cols+k].den, g);
+				mi = m + ws->row[i]*cols;
+				if(i != r && !fmpz_is_zero(mi[j].num)) {
+					frac_set(&ws->f, &mi[j]);
+					for(k = 0; k < cols; k++) {
+						frac_submul(&mi[k], &ws->f, &pr[k], ws);
 					}
 				}
 			}
 			r++;
 		}
 	}
-	for(i = 0; i < rows; i++) {
-		for(j = cols; j < 2 * cols; j++) {
-			if(fmpz_equal_si(m[i*2*cols+j].den, -1)) {
-				fmpz_neg(m[i*2*cols+j].num, m[i*2*cols+j].num);
-				fmpz_print(m[i*2*cols+j].num);
-				printf("\t");
-			} else if(fmpz_equal_ui(m[i*2*cols+j].den, 1)) {
-				fmpz_print(m[i*2*cols+j].num);
-				printf("\t");
-			} else if(fmpz_cmp_si(m[i*2*cols+j].den, 0) < 0) {
-				fmpz_neg(m[i*2*cols+j].num, m[i*2*cols+j].num);
-				fmpz_neg(m[i*2*cols+j].den, m[i*2*cols+j].den);
-				fmpz_print(m[i*2*cols+j].num);
-				printf("/");
-				fmpz_print(m[i*2*cols+j].den);
-				printf("\t");
-			} else {
-				fmpz_print(m[i*2*cols+j].num);
-				printf("/");
-				fmpz_print(m[i*2*cols+j].den);
-				printf("\t");
+	rref_workspace_unpermute(ws, m, NULL, cols);
+	return r;
+}
+
+/*
+ * Fraction-free Gauss-Jordan elimination (Bareiss) of the integer matrix
+ * a with the given number of rows and columns, stored row by row, in
+ * place. Every update a_ik = (p a_ik - a_ij a_rk) / d, with p the
+ * current and d the previous pivot, is an exact division, so no gcds are
+ * taken and all entries stay minors of the input.
+ *
+ * Returns the rank. On return a / den is the reduced row echelon form of
+ * the input, with den equal to the determinant of the rows and pivot
+ * columns of the echelon form; if the input is square and non-singular,
+ * den is its determinant and the matrix of non-pivot entries is the
+ * adjugate times the pivot part. ws must have been set up for rows rows.
+ */
+int bareiss_rref(fmpz *a, fmpz_t den, int rows, int cols, RrefWorkspace *ws)
+{
+	int r = 0, sign = 1;
+	int i, j, k, l;
+	fmpz *ar, *ai;
+	fmpz_one(den);
+	for(j = 0; j < cols && r < rows; j++) {
+		l = -1;
+		for(i = r; i < rows && l == -1; i++) {
+			if(!fmpz_is_zero(a + ws->row[i]*cols+j)) {
+				l = i;
 			}
 		}
-		printf("\n");
+		if(l == -1) {
+			continue;
+		}
+		if(l != r) {
+			rref_workspace_swap(ws, r, l);
+			sign = -sign;
+		}
+		ar = a + ws->row[r]*cols;
+		for(i = 0; i < rows; i++) {
+			if(i == r) {
+				continue;
+			}
+			ai = a + ws->row[i]*cols;
+			fmpz_swap(ws->e, ai + j);
+			for(k = 0; k < cols; k++) {
+				if(k == j) {
+					continue;
+				}
+				fmpz_mul(ws->t, ar + j, ai + k);
+				fmpz_submul(ws->t, ws->e, ar + k);
+				fmpz_divexact(ai + k, ws->t, den);
+			}
+			fmpz_zero(ws->e);
+		}
+		fmpz_set(den, ar + j);
+		r++;
 	}
-	if(fmpz_equal_si(det.den, -1)) {
-		fmpz_neg(det.num, det.num);
+	rref_workspace_unpermute(ws, NULL, a, cols);
+	if(sign < 0) {
+		fmpz_neg(den, den);
+		for(k = 0; k < r * cols; k++) {
+			fmpz_neg(a + k, a + k);
+		}
 	}
-	printf("Its determinant is:\n");
-	fmpz_print(det.num);
-	printf("\n");
-	free(m);
-	return;
+	return r;
 }
 
-int rref(Fraction *m, int rows, int cols)
+/*
+ * Sets the integer row a to L times the row m of length n of fractions,
+ * with L the lcm of their denominators, so that both rows span the same
+ * space.
+ */
+void frac_row_get_fmpz(fmpz *a, Fraction *m, int n)
+{
+	int k;
+	fmpz_t L, t;
+	fmpz_init_set_ui(L, 1);
+	fmpz_init(t);
+	for(k = 0; k < n; k++) {
+		fmpz_lcm(L, L, m[k].den);
+	}
+	for(k = 0; k < n; k++) {
+		fmpz_divexact(t, L, m[k].den);
+		fmpz_mul(a + k, m[k].num, t);
+	}
+	fmpz_clear(L);
+	fmpz_clear(t);
+}
+
+/*
+ * Image of an integer matrix modulo the word-size prime p: its reduced
+ * row echelon form a, the pivot columns piv[0..rank) and the determinant
+ * of the pivot rows and columns, with the sign of the row swaps.
+ */
+typedef struct mod_image_struct {
+	ulong p;
+	ulong *a;
+	int *piv;
+	int rank;
+	ulong det;
+} ModImage;
+
+typedef struct mod_batch_struct {
+	const fmpz *a;
+	int rows;
+	int cols;
+	ModImage *img;
+} ModBatch;
+
+/* Gauss-Jordan elimination of img->a modulo img->p in place. */
+void mod_image_rref(ModImage *img, int rows, int cols)
 {
+	ulong p = img->p, pinv = n_preinvert_limb(img->p);
+	ulong *a = img->a;
+	ulong f, det = 1;
 	int r = 0;
 	int i, j, k, l;
-	Fraction temp;
-	fmpz_t g;
-	for(j = 0; j < cols; j++) {
+	for(j = 0; j < cols && r < rows; j++) {
 		l = -1;
-		i = r;
-		while(l == -1 && i < rows) {
-			if(!fmpz_is_zero(m[i*cols+j].num)) {
+		for(i = r; i < rows && l == -1; i++) {
+			if(a[i*cols+j] != 0) {
 				l = i;
 			}
-			i++;
 		}
-		if(l != -1) {
-			if(l != r) {
-				for(k = 0; k < cols; k++) {
-					temp = m[r*cols+k];
-					m[r*cols+k] = m[l*cols+k];
-					m[l*cols+k] = temp;
+		if(l == -1) {
+			continue;
+		}
+		if(l != r) {
+			for(k = j; k < cols; k++) {
+				f = a[r*cols+k];
+				a[r*cols+k] = a[l*cols+k];
+				a[l*cols+k] = f;
+			}
+			det = n_negmod(det, p);
+		}
+		det = n_mulmod2_preinv(det, a[r*cols+j], p, pinv);
+		f = n_invmod(a[r*cols+j], p);
+		for(k = j; k < cols; k++) {
+			a[r*cols+k] = n_mulmod2_preinv(a[r*cols+k], f, p, pinv);
+		}
+		for(i = 0; i < rows; i++) {
+			f = a[i*cols+j];
+			if(i == r || f == 0) {
+				continue;
+			}
+			for(k = j; k < cols; k++) {
+				a[i*cols+k] = n_submod(a[i*cols+k],
+					n_mulmod2_preinv(f, a[r*cols+k], p, pinv), p);
+			}
+		}
+		img->piv[r++] = j;
+	}
+	img->rank = r;
+	img->det = det;
+}
+
+void mod_batch_worker(void *arg, slong t)
+{
+	ModBatch *b = arg;
+	ModImage *img = b->img + t;
+	int k, n = b->rows * b->cols;
+	for(k = 0; k < n; k++) {
+		img->a[k] = fmpz_fdiv_ui(b->a + k, img->p);
+	}
+	mod_image_rref(img, b->rows, b->cols);
+}
+
+/*
+ * Compares the rank profiles of two images. Reduction modulo p can only
+ * lose rank or move pivots to the right, so the image with the higher
+ * rank, or the same rank and lexicographically smaller pivots, is the
+ * better one. Returns a positive value if x is better than y.
+ */
+int mod_image_cmp(const ModImage *x, const ModImage *y)
+{
+	int t;
+	if(x->rank != y->rank) {
+		return x->rank - y->rank;
+	}
+	for(t = 0; t < x->rank; t++) {
+		if(x->piv[t] != y->piv[t]) {
+			return y->piv[t] - x->piv[t];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Lifts the residues x[0..len) modulo M (in [0, M)) to the residues
+ * modulo M p that are congruent to r modulo p, with a single modular
+ * inverse for the whole vector.
+ */
+void crt_ui_vec(fmpz *x, int len, const fmpz_t M, const ulong *r, ulong p)
+{
+	ulong pinv = n_preinvert_limb(p);
+	ulong c = n_invmod(fmpz_fdiv_ui(M, p), p);
+	ulong d;
+	int k;
+	for(k = 0; k < len; k++) {
+		d = n_submod(r[k], fmpz_fdiv_ui(x + k, p), p);
+		fmpz_addmul_ui(x + k, M, n_mulmod2_preinv(d, c, p, pinv));
+	}
+}
+
+/* Sets y to the residue of x modulo M of least absolute value. */
+void fmpz_mod_sym(fmpz_t y, const fmpz_t x, const fmpz_t M, const fmpz_t half)
+{
+	fmpz_mod(y, x, M);
+	if(fmpz_cmp(y, half) > 0) {
+		fmpz_sub(y, y, M);
+	}
+}
+
+/*
+ * Finds n / d = a mod M with |n|, d <= B by the half-extended Euclidean
+ * algorithm. Returns 0 if there is no such fraction.
+ */
+int frac_reconstruct(fmpz_t n, fmpz_t d, const fmpz_t a, const fmpz_t M,
+	const fmpz_t B)
+{
+	int ok;
+	fmpz_t r0, r1, s0, s1, q;
+	fmpz_init_set(r0, M);
+	fmpz_init(r1);
+	fmpz_init(s0);
+	fmpz_init_set_ui(s1, 1);
+	fmpz_init(q);
+	fmpz_mod(r1, a, M);
+	while(fmpz_cmp(r1, B) > 0) {
+		fmpz_fdiv_q(q, r0, r1);
+		fmpz_submul(r0, q, r1);
+		fmpz_swap(r0, r1);
+		fmpz_submul(s0, q, s1);
+		fmpz_swap(s0, s1);
+	}
+	ok = fmpz_cmpabs(s1, B) <= 0;
+	if(ok) {
+		if(fmpz_sgn(s1) < 0) {
+			fmpz_neg(r1, r1);
+			fmpz_neg(s1, s1);
+		}
+		fmpz_swap(n, r1);
+		fmpz_swap(d, s1);
+	}
+	fmpz_clear(r0);
+	fmpz_clear(r1);
+	fmpz_clear(s0);
+	fmpz_clear(s1);
+	fmpz_clear(q);
+	return ok;
+}
+
+/*
+ * Writes the residues x[0..len) modulo M as num / den with a common
+ * denominator. Entries are only reconstructed when x times the
+ * denominator found so far is not already small, so most of them cost a
+ * single multiplication. Returns 0 as soon as one entry fails.
+ */
+int frac_reconstruct_vec(fmpz *num, fmpz_t den, const fmpz *x, int len,
+	const fmpz_t M)
+{
+	int k, ok = 1;
+	fmpz_t B, half, y, n, d;
+	fmpz_init(B);
+	fmpz_init(half);
+	fmpz_init(y);
+	fmpz_init(n);
+	fmpz_init(d);
+	fmpz_fdiv_q_2exp(half, M, 1);
+	fmpz_sqrt(B, half);
+	fmpz_one(den);
+	for(k = 0; k < len && ok; k++) {
+		fmpz_mul(y, x + k, den);
+		fmpz_mod_sym(y, y, M, half);
+		if(fmpz_cmpabs(y, B) > 0) {
+			ok = frac_reconstruct(n, d, y, M, B);
+			fmpz_mul(den, den, d);
+		}
+	}
+	for(k = 0; k < len && ok; k++) {
+		fmpz_mul(y, x + k, den);
+		fmpz_mod_sym(num + k, y, M, half);
+	}
+	fmpz_clear(B);
+	fmpz_clear(half);
+	fmpz_clear(y);
+	fmpz_clear(n);
+	fmpz_clear(d);
+	return ok;
+}
+
+/*
+ * Checks that num / den, in reduced row echelon form with the given
+ * pivots, is the RREF of a: the rank of a is at least rank (it is so
+ * modulo some prime), so it suffices that every row of a is the
+ * combination of the rows of num / den given by its pivot entries.
+ * This holds trivially in the pivot columns, which are skipped.
+ */
+int rref_verify(const fmpz *a, const fmpz *num, const fmpz_t den,
+	const int *piv, int rank, int rows, int cols)
+{
+	int i, k, t, ok = 1;
+	char *is_piv = calloc(cols + 1, 1);
+	fmpz_t s, u;
+	fmpz_init(s);
+	fmpz_init(u);
+	for(t = 0; t < rank; t++) {
+		is_piv[piv[t]] = 1;
+	}
+	for(i = 0; i < rows && ok; i++) {
+		for(k = 0; k < cols && ok; k++) {
+			if(is_piv[k]) {
+				continue;
+			}
+			fmpz_zero(s);
+			for(t = 0; t < rank; t++) {
+				fmpz_addmul(s, a + i*cols+piv[t], num + t*cols+k);
+			}
+			fmpz_mul(u, den, a + i*cols+k);
+			ok = fmpz_equal(s, u);
+		}
+	}
+	free(is_piv);
+	fmpz_clear(s);
+	fmpz_clear(u);
+	return ok;
+}
+
+/*
+ * Multimodular RREF of the integer matrix a. Images modulo word-size
+ * primes are computed in batches, one prime per thread, and combined by
+ * CRT; after every prime the RREF is rationally reconstructed. Once two
+ * consecutive reconstructions agree the result is verified against a,
+ * and the loop stops as soon as that succeeds.
+ *
+ * Sets num (rows x cols) and den so that num / den is the RREF and
+ * returns the rank. If det is not NULL it is set to the determinant of
+ * the first rows columns of a, which must be at least as many as the
+ * rows; it is recovered as den times the CRT of det / den, which is
+ * small, continuing with more primes if the modulus does not yet cover
+ * its Hadamard bound.
+ */
+int multi_mod_rref(fmpz *num, fmpz_t den, fmpz_t det, const fmpz *a,
+	int rows, int cols)
+{
+	int i, k, t, rank = 0, n = rows * cols;
+	int nt = thread_pool_get_num_threads();
+	int stable = 0, done = 0;
+	slong hbits = 0;
+	ulong p = UWORD(1) << (FLINT_BITS - 1);
+	ModImage *img = malloc(sizeof(ModImage) * nt);
+	ModImage best;
+	ModBatch batch;
+	fmpz *res = _fmpz_vec_init(n);
+	fmpz *prev = _fmpz_vec_init(n);
+	fmpz_t M, detres, pden, q, half;
+	fmpz_init(M);
+	fmpz_init(detres);
+	fmpz_init(pden);
+	fmpz_init(q);
+	fmpz_init(half);
+	best.piv = malloc(sizeof(int) * (rows + 1));
+	best.rank = -1;
+	for(t = 0; t < nt; t++) {
+		img[t].a = malloc(sizeof(ulong) * (n + 1));
+		img[t].piv = malloc(sizeof(int) * (rows + 1));
+	}
+	if(det != NULL) {
+		/* log2 of the Hadamard bound of the leading square block */
+		for(i = 0; i < rows; i++) {
+			fmpz_zero(q);
+			for(k = 0; k < rows; k++) {
+				fmpz_addmul(q, a + i*cols+k, a + i*cols+k);
+			}
+			hbits += (fmpz_bits(q) + 1) / 2;
+		}
+	}
+	batch.a = a;
+	batch.rows = rows;
+	batch.cols = cols;
+	batch.img = img;
+	while(!done) {
+		for(t = 0; t < nt; t++) {
+			p = n_nextprime(p, 0);
+			img[t].p = p;
+		}
+		thread_pool_parallel_for(nt, mod_batch_worker, &batch);
+		for(t = 0; t < nt && !done; t++) {
+			ModImage *g = img + t;
+			k = best.rank < 0 ? 1 : mod_image_cmp(g, &best);
+			if(k < 0) {
+				continue;
+			}
+			if(k > 0) {
+				/* first or better rank profile: restart the CRT */
+				best.rank = rank = g->rank;
+				memcpy(best.piv, g->piv, sizeof(int) * rank);
+				fmpz_one(M);
+				fmpz_zero(detres);
+				stable = 0;
+			}
+			if(fmpz_is_one(M)) {
+				for(k = 0; k < rank * cols; k++) {
+					fmpz_set_ui(res + k, g->a[k]);
 				}
+				fmpz_set_ui(detres, g->det);
+			} else {
+				crt_ui_vec(res, rank * cols, M, g->a, g->p);
+				crt_ui_vec(detres, 1, M, &g->det, g->p);
 			}
-			temp = m[r*cols+j];
-			for(k = 0; k < cols; k++) {
-				m[r*cols+k] = frac_divide(m[r*cols+k], m[r*cols+k], temp);
-				fmpz_gcd(g, m[r*cols+k].num, m[r*cols+k].den);
-				fmpz_divexact(m[r*cols+k].num, m[r*cols+k].num, g);
-				fmpz_divexact(m[r*cols+k].den, m[r*cols+k].den, g);
+			fmpz_mul_ui(M, M, g->p);
+			if(stable < 2) {
+				if(!frac_reconstruct_vec(num, den, res, rank * cols, M)) {
+					stable = 0;
+				} else if(stable == 1 && fmpz_equal(den, pden)
+					&& _fmpz_vec_equal(num, prev, rank * cols)
+					&& rref_verify(a, num, den, best.piv, rank, rows, cols)) {
+					stable = 2;
+				} else {
+					stable = 1;
+					fmpz_set(pden, den);
+					_fmpz_vec_set(prev, num, rank * cols);
+				}
 			}
-			for(i = 0; i < rows; i++) {
-				temp = m[i*cols+j];
-				if(i != r) {
-					for(k = 0; k < cols; k++) {
-						m[i*cols+k] = frac_subtract(m[i*cols+k], m[i*cols+k], frac_multiply(temp, temp, m[r*cols+k]));
-						fmpz_gcd(g, m[i*cols+k].num, m[i*cols+k].den);
-						fmpz_divexact(m[i*cols+k].num, m[i*cols+k].num, g);
-						fmpz_divexact(m[i*cols+k].den, m[i*cols+k].den, g);
+			if(stable == 2) {
+				done = 1;
+				if(det != NULL) {
+					for(k = 0; k < rows && k < rank && best.piv[k] == k; k++) ;
+					if(k < rows) {
+						fmpz_zero(det);
+					} else if((slong) fmpz_bits(M) > hbits - (slong) fmpz_bits(den) + 2
+						&& fmpz_invmod(q, den, M)) {
+						fmpz_mul(q, q, detres);
+						fmpz_fdiv_q_2exp(half, M, 1);
+						fmpz_mod_sym(q, q, M, half);
+						fmpz_mul(det, q, den);
+					} else {
+						done = 0;
 					}
 				}
 			}
-			r++;
 		}
 	}
-	int flag = 1;
+	for(k = rank * cols; k < n; k++) {
+		fmpz_zero(num + k);
+	}
+	for(t = 0; t < nt; t++) {
+		free(img[t].a);
+		free(img[t].piv);
+	}
+	free(img);
+	free(best.piv);
+	_fmpz_vec_clear(res, n);
+	_fmpz_vec_clear(prev, n);
+	fmpz_clear(M);
+	fmpz_clear(detres);
+	fmpz_clear(pden);
+	fmpz_clear(q);
+	fmpz_clear(half);
+	return rank;
+}
+
+/*
+ * Sets a / den to the RREF of the integer matrix a with the selected
+ * integer engine and returns the rank. If det is not NULL it is set to
+ * the determinant of the leading rows x rows block. ws must have been set
+ * up for rows rows.
+ */
+int fmpz_rref(fmpz *a, fmpz_t den, fmpz_t det, int rows, int cols,
+	RrefWorkspace *ws)
+{
+	int rank, k;
+	fmpz *num;
+	if(rref_algorithm == RREF_BAREISS || (rref_algorithm == RREF_AUTO
+		&& rows < RREF_MULTI_MOD_CUTOFF)) {
+		rank = bareiss_rref(a, den, rows, cols, ws);
+		if(det != NULL) {
+			/* the pivot minor is the leading block iff it is non-singular */
+			for(k = 0; k < rows && !fmpz_is_zero(a + k*cols+k); k++) ;
+			if(k < rows) {
+				fmpz_zero(det);
+			} else {
+				fmpz_set(det, den);
+			}
+		}
+		return rank;
+	}
+	num = _fmpz_vec_init(rows * cols);
+	rank = multi_mod_rref(num, den, det, a, rows, cols);
+	_fmpz_vec_swap(a, num, rows * cols);
+	_fmpz_vec_clear(num, rows * cols);
+	return rank;
+}
+
+/*
+ * Writes columns c0 <= k < c1 of a rows x cols result, held either in m
+ * or, if a is not NULL, as a / den, in lowest terms. In text mode every
+ * entry is followed by a tab and every row by a newline.
+ */
+void rref_print_rows(Fraction *m, fmpz *a, fmpz_t den, int rows, int cols,
+	int c0, int c1)
+{
+	ResultWriter *w = &result_out;
+	int i, k;
+	fmpz_t g, num, d;
+	fmpz_init(g);
+	fmpz_init(num);
+	fmpz_init(d);
 	for(i = 0; i < rows; i++) {
-		for(j = 0; j < cols; j++) {
-			if(fmpz_equal_si(m[i*cols+j].den, -1)) {
-				fmpz_neg(m[i*cols+j].num, m[i*cols+j].num);
-				fmpz_print(m[i*cols+j].num);
-				printf("\t");
-			} else if(fmpz_equal_ui(m[i*cols+j].den, 1)) {
-				fmpz_print(m[i*cols+j].num);
-				printf("\t");
-			} else if(fmpz_cmp_si(m[i*cols+j].den, 0) < 0) {
-				fmpz_neg(m[i*cols+j].num, m[i*cols+j].num);
-				fmpz_neg(m[i*cols+j].den, m[i*cols+j].den);
-				fmpz_print(m[i*cols+j].num);
-				printf("/");
-				fmpz_print(m[i*cols+j].den);
-				printf("\t");
+		for(k = c0; k < c1; k++) {
+			if(a == NULL) {
+				writer_frac(w, m[i*cols+k].num, m[i*cols+k].den);
+			} else if(fmpz_is_zero(a + i*cols+k)) {
+				fmpz_one(d);
+				writer_frac(w, a + i*cols+k, d);
 			} else {
-				fmpz_print(m[i*cols+j].num);
-				printf("/");
-				fmpz_print(m[i*cols+j].den);
-				printf("\t");
+				fmpz_gcd(g, a + i*cols+k, den);
+				fmpz_divexact(num, a + i*cols+k, g);
+				fmpz_divexact(d, den, g);
+				writer_frac(w, num, d);
 			}
-			if(rows == cols) {
-				if(i == j) {
-					if(!fmpz_equal_ui(m[i*cols+j].num, 1)) {
-						flag = 0;
-					}
-				}
+			if(!w->binary) {
+				writer_putc(w, '\t');
 			}
 		}
-		printf("\n");
+		if(!w->binary) {
+			writer_putc(w, '\n');
+		}
+	}
+	fmpz_clear(g);
+	fmpz_clear(num);
+	fmpz_clear(d);
+}
+
+/* Clears the len entries of m and frees it. */
+void frac_mat_clear(Fraction *m, int len)
+{
+	int k;
+	for(k = 0; k < len; k++) {
+		frac_clear(&m[k]);
 	}
 	free(m);
-	return flag;
+}
+
+/*
+ * Sets the integer matrix a to the rows of m cleared of denominators,
+ * which have the same RREF.
+ */
+fmpz *frac_mat_get_fmpz(Fraction *m, int rows, int cols)
+{
+	int i;
+	fmpz *a = _fmpz_vec_init(rows * cols);
+	for(i = 0; i < rows; i++) {
+		frac_row_get_fmpz(a + i*cols, m + i*cols, cols);
+	}
+	return a;
+}
+
+/*
+ * Starts the results for a rows x cols matrix of the given kind (see
+ * ResultWriter).
+ */
+void rref_print_header(int rows, int cols, int kind)
+{
+	ResultWriter *w = &result_out;
+	if(w->binary) {
+		writer_si(w, rows);
+		writer_si(w, cols);
+		writer_si(w, kind);
+	} else {
+		writer_puts(w, "The reduced row echelon form of the given matrix is:\n");
+	}
+}
+
+/*
+ * Sets up ws for the elimination of the rows x cols matrix m, or if a is
+ * not NULL of a.
+ */
+void rref_workspace_init_for(RrefWorkspace *ws, Fraction *m, fmpz *a,
+	int rows, int cols)
+{
+	ulong bits = 0;
+	int k;
+	for(k = 0; k < rows * cols; k++) {
+		bits = FLINT_MAX(bits, fmpz_bits(a != NULL ? a + k : m[k].num));
+	}
+	rref_workspace_init(ws, rows,
+		rref_workspace_limbs(bits, FLINT_MIN(rows, cols)));
+}
+
+/* Prints the RREF of m and frees m. */
+void rref(Fraction *m, int rows, int cols)
+{
+	fmpz *a = NULL;
+	fmpz_t den;
+	RrefWorkspace ws;
+	long allocs = rref_stats.allocs, bytes = rref_stats.bytes;
+	fmpz_init(den);
+	if(rref_algorithm == RREF_FRACTION) {
+		rref_workspace_init_for(&ws, m, NULL, rows, cols);
+		frac_rref(m, rows, cols, NULL, &ws);
+	} else {
+		a = frac_mat_get_fmpz(m, rows, cols);
+		rref_workspace_init_for(&ws, NULL, a, rows, cols);
+		fmpz_rref(a, den, NULL, rows, cols, &ws);
+	}
+	rref_workspace_clear(&ws);
+	rref_stats_report(rows, cols, allocs, bytes);
+	rref_print_header(rows, cols, 0);
+	rref_print_rows(m, a, den, rows, cols, 0, cols);
+	if(a != NULL) {
+		_fmpz_vec_clear(a, rows * cols);
+	}
+	fmpz_clear(den);
+	frac_mat_clear(m, rows * cols);
+}
+
+/*
+ * Prints the RREF of the n x n matrix A, whether it is singular, its
+ * inverse and its determinant, all from a single elimination of the
+ * augmented n x 2n matrix m = [A | I]: the left half of its RREF is the
+ * RREF of A, and if A is non-singular the right half is its inverse.
+ * Frees m.
+ */
+void rref_inverse(Fraction *m, int n)
+{
+	int singular;
+	fmpz *a = NULL;
+	fmpz_t den, det;
+	Fraction fdet;
+	RrefWorkspace ws;
+	long allocs = rref_stats.allocs, bytes = rref_stats.bytes;
+	fmpz_init(den);
+	fmpz_init(det);
+	if(rref_algorithm == RREF_FRACTION) {
+		rref_workspace_init_for(&ws, m, NULL, n, 2 * n);
+		frac_init(&fdet);
+		fmpz_one(fdet.num);
+		frac_rref(m, n, 2 * n, &fdet, &ws);
+		/* the empty matrix is non-singular, with determinant 1 */
+		singular = n > 0 && fmpz_is_zero(m[(n-1)*2*n+n-1].num);
+		fmpz_set(det, fdet.num);
+		frac_clear(&fdet);
+	} else {
+		a = frac_mat_get_fmpz(m, n, 2 * n);
+		rref_workspace_init_for(&ws, NULL, a, n, 2 * n);
+		fmpz_rref(a, den, det, n, 2 * n, &ws);
+		singular = fmpz_is_zero(det);
+	}
+	rref_workspace_clear(&ws);
+	rref_stats_report(n, n, allocs, bytes);
+	if(singular) {
+		fmpz_zero(det);
+	}
+	rref_print_header(n, n, singular ? 2 : 1);
+	rref_print_rows(m, a, den, n, 2 * n, 0, n);
+	if(result_out.binary) {
+		if(!singular) {
+			rref_print_rows(m, a, den, n, 2 * n, n, 2 * n);
+		}
+		writer_varint(&result_out, det);
+	} else {
+		writer_puts(&result_out, "The given matrix is square.\n");
+		if(singular) {
+			writer_puts(&result_out,
+				"However, it is singular and hence not invertible.\n");
+		} else {
+			writer_puts(&result_out, "It is non-singular and its inverse is:\n");
+			rref_print_rows(m, a, den, n, 2 * n, n, 2 * n);
+		}
+		writer_puts(&result_out, "Its determinant is:\n");
+		writer_fmpz(&result_out, det);
+		writer_putc(&result_out, '\n');
+	}
+	if(a != NULL) {
+		_fmpz_vec_clear(a, n * 2 * n);
+	}
+	fmpz_clear(den);
+	fmpz_clear(det);
+	frac_mat_clear(m, n * 2 * n);
+}
+
+/*
+ * Batch mode reads a stream of matrices from a file (mapped into memory)
+ * or from stdin (read in large chunks). A text stream is a sequence of
+ * matrices, each given by its number of rows and columns followed by its
+ * entries, all separated by white space. A binary stream starts with the
+ * four bytes "RRB\1", followed by the same numbers encoded as zigzag
+ * LEB128 varints, so that entries of any size take as few bytes as
+ * possible.
+ */
+#define BATCH_MAGIC "RRB\1"
+#define BATCH_CHUNK (1 << 20)
+
+typedef struct batch_reader_struct {
+	int fd;
+	unsigned char *buf;
+	size_t len;
+	size_t pos;
+	size_t alloc;
+	int mapped;
+	int eof;
+	int binary;
+} BatchReader;
+
+/*
+ * Makes more input available after r->pos, keeping the unread bytes.
+ * Returns 0 at the end of the input.
+ */
+int batch_fill(BatchReader *r)
+{
+	ssize_t got;
+	if(r->mapped || r->eof) {
+		return 0;
+	}
+	if(r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	if(r->alloc - r->len < BATCH_CHUNK) {
+		r->alloc = 2 * r->alloc + BATCH_CHUNK;
+		r->buf = realloc(r->buf, r->alloc);
+	}
+	got = read(r->fd, r->buf + r->len, r->alloc - r->len);
+	if(got <= 0) {
+		r->eof = 1;
+		return 0;
+	}
+	r->len += got;
+	return 1;
+}
+
+/* Returns the next byte without consuming it, or -1 at the end. */
+int batch_peek(BatchReader *r)
+{
+	if(r->pos == r->len && !batch_fill(r)) {
+		return -1;
+	}
+	return r->buf[r->pos];
+}
+
+/*
+ * Returns 1 if at least n more bytes of input remain, reading a stream
+ * only as far as needed to tell.
+ */
+int batch_available(BatchReader *r, size_t n)
+{
+	while(r->len - r->pos < n && batch_fill(r)) ;
+	return r->len - r->pos >= n;
+}
+
+/* Opens path, or stdin if path is NULL or "-". Returns 0 on failure. */
+int batch_open(BatchReader *r, const char *path)
+{
+	struct stat st;
+	memset(r, 0, sizeof(BatchReader));
+	r->fd = 0;
+	if(path != NULL && strcmp(path, "-") != 0) {
+		r->fd = open(path, O_RDONLY);
+		if(r->fd < 0) {
+			return 0;
+		}
+		if(fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			r->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+			if(r->buf != MAP_FAILED) {
+				madvise(r->buf, st.st_size, MADV_SEQUENTIAL);
+				r->len = st.st_size;
+				r->mapped = 1;
+			} else {
+				r->buf = NULL;
+			}
+		}
+	}
+	while(r->len - r->pos < 4 && batch_fill(r)) ;
+	if(r->len - r->pos >= 4 && memcmp(r->buf + r->pos, BATCH_MAGIC, 4) == 0) {
+		r->binary = 1;
+		r->pos += 4;
+	}
+	return 1;
+}
+
+void batch_close(BatchReader *r)
+{
+	if(r->mapped) {
+		munmap(r->buf, r->len);
+	} else {
+		free(r->buf);
+	}
+	if(r->fd != 0) {
+		close(r->fd);
+	}
+}
+
+/*
+ * Reads a decimal integer, in chunks of 19 digits accumulated in a word,
+ * so that word-size entries never touch an fmpz function except the
+ * final set. Returns 0 at the end of the input or on malformed input.
+ */
+int batch_read_text(BatchReader *r, fmpz_t x)
+{
+	static const ulong pow10[20] = { UWORD(1), UWORD(10), UWORD(100),
+		UWORD(1000), UWORD(10000), UWORD(100000), UWORD(1000000),
+		UWORD(10000000), UWORD(100000000), UWORD(1000000000),
+		UWORD(10000000000), UWORD(100000000000), UWORD(1000000000000),
+		UWORD(10000000000000), UWORD(100000000000000),
+		UWORD(1000000000000000), UWORD(10000000000000000),
+		UWORD(100000000000000000), UWORD(1000000000000000000),
+		UWORD(10000000000000000000) };
+	int c, neg = 0, nd = 0, big = 0, any = 0;
+	ulong v = 0;
+	while((c = batch_peek(r)) == ' ' || c == '\n' || c == '\t' || c == '\r') {
+		r->pos++;
+	}
+	if(c == '-' || c == '+') {
+		neg = c == '-';
+		r->pos++;
+	}
+	while((c = batch_peek(r)) >= '0' && c <= '9') {
+		v = 10 * v + (c - '0');
+		any = 1;
+		r->pos++;
+		if(++nd == 19) {
+			if(big) {
+				fmpz_mul_ui(x, x, pow10[19]);
+				fmpz_add_ui(x, x, v);
+			} else {
+				fmpz_set_ui(x, v);
+			}
+			big = 1;
+			v = 0;
+			nd = 0;
+		}
+	}
+	if(!any) {
+		return 0;
+	}
+	if(big) {
+		fmpz_mul_ui(x, x, pow10[nd]);
+		fmpz_add_ui(x, x, v);
+	} else {
+		fmpz_set_ui(x, v);
+	}
+	if(neg) {
+		fmpz_neg(x, x);
+	}
+	return 1;
+}
+
+/* Reads a zigzag LEB128 varint. Returns 0 at the end of the input. */
+int batch_read_binary(BatchReader *r, fmpz_t x)
+{
+	int c, shift = 0;
+	ulong v = 0;
+	fmpz_t t;
+	while((c = batch_peek(r)) != -1) {
+		r->pos++;
+		if(shift < FLINT_BITS - 7) {
+			v |= (ulong) (c & 0x7f) << shift;
+			if(c < 0x80) {
+				fmpz_set_ui(x, v >> 1);
+				if(v & 1) {
+					fmpz_neg(x, x);
+					fmpz_sub_ui(x, x, 1);
+				}
+				return 1;
+			}
+			if(shift + 7 >= FLINT_BITS - 7) {
+				fmpz_set_ui(x, v);
+			}
+		} else {
+			fmpz_init_set_ui(t, c & 0x7f);
+			fmpz_mul_2exp(t, t, shift);
+			fmpz_add(x, x, t);
+			fmpz_clear(t);
+			if(c < 0x80) {
+				v = fmpz_fdiv_ui(x, 2);
+				fmpz_fdiv_q_2exp(x, x, 1);
+				if(v) {
+					fmpz_neg(x, x);
+					fmpz_sub_ui(x, x, 1);
+				}
+				return 1;
+			}
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+int batch_read_fmpz(BatchReader *r, fmpz_t x)
+{
+	return r->binary ? batch_read_binary(r, x) : batch_read_text(r, x);
+}
+
+/*
+ * Skips the white space before the next number of a text stream. Returns
+ * 1 if the input ends there, which is the only clean end of a stream.
+ */
+int batch_at_end(BatchReader *r)
+{
+	int c;
+	while(!r->binary && ((c = batch_peek(r)) == ' ' || c == '\n'
+			|| c == '\t' || c == '\r')) {
+		r->pos++;
+	}
+	return batch_peek(r) == -1;
+}
+
+/* Reads a number of rows or columns, which must lie in [1, INT_MAX]. */
+int batch_read_dim(BatchReader *r, fmpz_t x, int *d)
+{
+	if(!batch_read_fmpz(r, x) || fmpz_cmp_si(x, 1) < 0
+		|| fmpz_cmp_si(x, INT_MAX) > 0) {
+		return 0;
+	}
+	*d = fmpz_get_si(x);
+	return 1;
+}
+
+/*
+ * Processes every matrix of the stream at path (stdin if NULL), printing
+ * for each the same results as interactive mode, or, if to_binary is
+ * set, rewriting the stream in the binary format. The throughput is
+ * reported on stderr.
+ */
+int batch_run(const char *path, int to_binary)
+{
+	BatchReader r;
+	struct timespec t0, t1;
+	double secs;
+	long count = 0;
+	int rows, cols, w, i, j, k, ok = 1, oom = 0;
+	Fraction *m;
+	fmpz_t x;
+	if(!batch_open(&r, path)) {
+		fprintf(stderr, "batch: cannot open %s\n", path);
+		return 1;
+	}
+	fmpz_init(x);
+	if(to_binary) {
+		writer_puts(&result_out, BATCH_MAGIC);
+	} else if(result_out.binary) {
+		writer_puts(&result_out, RESULT_MAGIC);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(!batch_at_end(&r)) {
+		/* entries are indexed by int, so rows * w must fit in one */
+		if(!batch_read_dim(&r, x, &rows) || !batch_read_dim(&r, x, &cols)
+			|| (slong) rows * (rows == cols ? 2 * (slong) cols : cols)
+				> INT_MAX) {
+			ok = 0;
+			break;
+		}
+		/* every entry takes at least one byte of the input */
+		if(!batch_available(&r, (size_t) rows * cols)) {
+			ok = 0;
+			break;
+		}
+		w = rows == cols ? 2 * cols : cols;
+		m = (Fraction *) malloc(sizeof(Fraction)*rows*w);
+		if(m == NULL) {
+			fprintf(stderr, "batch: cannot allocate a %d x %d matrix\n",
+				rows, cols);
+			ok = 0;
+			oom = 1;
+			break;
+		}
+		/* k counts the initialised entries, which stop at a failed read */
+		for(i = 0, k = 0; ok && i < rows; i++) {
+			for(j = 0; ok && j < w; j++, k++) {
+				frac_init(&m[k]);
+				if(j >= cols) {
+					fmpz_set_ui(m[k].num, j == i + cols);
+				} else {
+					ok = batch_read_fmpz(&r, m[k].num);
+				}
+			}
+		}
+		if(!ok) {
+			frac_mat_clear(m, k);
+			break;
+		}
+		if(to_binary) {
+			writer_si(&result_out, rows);
+			writer_si(&result_out, cols);
+			for(i = 0; i < rows; i++) {
+				for(j = 0; j < cols; j++) {
+					writer_varint(&result_out, m[i*w+j].num);
+				}
+			}
+			frac_mat_clear(m, rows * w);
+		} else {
+			if(rows == cols) {
+				rref_inverse(m, rows);
+			} else {
+				rref(m, rows, cols);
+			}
+		}
+		count++;
+	}
+	writer_flush(&result_out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+	if(!ok && !oom) {
+		fprintf(stderr, "batch: malformed input after %ld matrices\n", count);
+	}
+	fprintf(stderr, "batch: %ld matrices in %.3f s (%.1f matrices/s)\n",
+		count, secs, secs > 0 ? count / secs : 0.0);
+	fmpz_clear(x);
+	batch_close(&r);
+	return !ok;
 }
 
 int main(int argc, char **argv)
 {
 	int rows, cols;
+	int opt, batch = 0;
+	const char *path = NULL;
+	for(opt = 1; opt < argc; opt++) {
+		if(strcmp(argv[opt], "-fraction") == 0) {
+			rref_algorithm = RREF_FRACTION;
+		} else if(strcmp(argv[opt], "-bareiss") == 0) {
+			rref_algorithm = RREF_BAREISS;
+		} else if(strcmp(argv[opt], "-multimod") == 0) {
+			rref_algorithm = RREF_MULTI_MOD;
+		} else if(strcmp(argv[opt], "-stats") == 0) {
+			rref_stats_enable();
+		} else if(strcmp(argv[opt], "-binout") == 0) {
+			result_out.binary = 1;
+		} else if(strcmp(argv[opt], "-threads") == 0 && opt + 1 < argc) {
+			thread_pool_set_num_threads(atoi(argv[++opt]));
+		} else if(strcmp(argv[opt], "-batch") == 0
+			|| strcmp(argv[opt], "-tobinary") == 0) {
+			batch = argv[opt][1] == 'b' ? 1 : 2;
+			if(opt + 1 < argc && (argv[opt+1][0] != '-' || argv[opt+1][1] == '\0')) {
+				path = argv[++opt];
+			}
+		}
+	}
+	if(batch) {
+		return batch_run(path, batch == 2);
+	}
 	printf("Enter number of rows:\n");
 	scanf("%d", &rows);
 	printf("Enter number of columns:\n");
 	scanf("%d", &cols);
-	Fraction *m = (Fraction *) malloc(sizeof(Fraction)*rows*cols);
-	Fraction *mi = (Fraction *) malloc(sizeof(Fraction)*rows*2*cols);
-    int i, j;
-    printf("Enter the elements:\n");
-    for(i = 0; i < rows; i++) {
+	/* square input is stored directly as [A | I] */
+	int w = rows == cols ? 2 * cols : cols;
+	Fraction *m = (Fraction *) malloc(sizeof(Fraction)*rows*w);
+	int i, j;
+	printf("Enter the elements:\n");
+	for(i = 0; i < rows; i++) {
 		for(j = 0; j < cols; j++) {
-			fmpz_read(m[i*cols+j].num);
-			fmpz_init_set_ui(m[i*cols+j].den, 1);
-			if(rows == cols) {
-				mi[i*2*cols+j] = m[i*cols+j];
-			}
+			fmpz_init(m[i*w+j].num);
+			fmpz_read(m[i*w+j].num);
+			fmpz_init_set_ui(m[i*w+j].den, 1);
 		}
-	}
-	printf("The reduced row echelon form of the given matrix is:\n");
-    int f = rref(m, rows, cols);
-    if(rows == cols) {
-		printf("The given matrix is square.\n");
-		if(f == 0) {
-			printf("However, it is singular and hence not invertible.\n");
-			free(mi);
-		} else {
-			for(i = 0; i < rows; i++) {
-				for(j = cols; j < 2 * cols; j++) {
-					if(j == i + cols) {
-						fmpz_init_set_ui(mi[i*2*cols+j].num, 1);
-					} else {
-						fmpz_init(mi[i*2*cols+j].num);
-					}
-					fmpz_init_set_ui(mi[i*2*cols+j].den, 1);
-				}
-			}
-			printf("It is non-singular and its inverse is:\n");
-			inverse(mi, rows, cols);
+		for(j = cols; j < w; j++) {
+			fmpz_init_set_ui(m[i*w+j].num, j == i + cols);
+			fmpz_init_set_ui(m[i*w+j].den, 1);
 		}
+	}
+	fflush(stdout);
+	if(result_out.binary) {
+		writer_puts(&result_out, RESULT_MAGIC);
+	}
+	if(rows == cols) {
+		rref_inverse(m, rows);
 	} else {
-		free(mi);
+		rref(m, rows, cols);
 	}
+	writer_flush(&result_out);
 	return 0;
 }
-
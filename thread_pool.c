@@ -0,0 +1,311 @@
+/*=============================================================================
+
+    This file is part of FLINT.
+
+    FLINT is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    FLINT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FLINT; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+
+=============================================================================*/
+
+/*
+    A small library-wide thread pool shared by the matrix routines.
+
+    thread_pool_parallel_for(n, fn, arg) calls fn(arg, i) for 0 <= i < n.
+    The index range is split evenly between the participating threads (the
+    calling thread is one of them), each of which owns a deque of indices.
+    A thread takes indices from the front of its own deque and, once that
+    is empty, steals the back half of the deque of another thread.
+
+    Calls made from inside a task, or while another thread is using the
+    pool, run serially in the calling thread, so nested parallelism is
+    safe. With one thread (the default) no threads are ever created.
+*/
+
+#ifndef THREAD_POOL_C
+#define THREAD_POOL_C
+
+#include <pthread.h>
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    slong lo;
+    slong hi;
+} thread_pool_deque_struct;
+
+/*
+    What a worker is started with: its index, and the generation of the
+    pool at that time, so that it waits for the next call rather than
+    running the last one again.
+*/
+typedef struct
+{
+    slong id;
+    ulong generation;
+} thread_pool_worker_struct;
+
+typedef struct
+{
+    slong num_threads;
+    pthread_t * threads;
+    thread_pool_deque_struct * deques;
+    thread_pool_worker_struct * workers;
+
+    pthread_mutex_t busy;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    ulong generation;
+    slong active;
+    int shutdown;
+
+    void (*fn)(void * arg, slong i);
+    void * arg;
+} thread_pool_struct;
+
+static thread_pool_struct _thread_pool = {
+    1, NULL, NULL, NULL,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, 0, 0, NULL, NULL };
+
+static __thread int _thread_pool_in_task = 0;
+
+static int
+_thread_pool_take(thread_pool_deque_struct * d, slong * i)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->lo < d->hi)
+    {
+        *i = d->lo++;
+        r = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return r;
+}
+
+static int
+_thread_pool_steal(slong id, slong * i)
+{
+    thread_pool_struct * P = &_thread_pool;
+    slong v, lo, hi, mid;
+
+    for (v = 1; v < P->num_threads; v++)
+    {
+        thread_pool_deque_struct * d = P->deques + (id + v) % P->num_threads;
+
+        pthread_mutex_lock(&d->lock);
+        lo = d->lo;
+        hi = d->hi;
+        mid = lo + (hi - lo) / 2;
+        if (lo < hi)
+            d->hi = mid;
+        pthread_mutex_unlock(&d->lock);
+
+        if (lo < hi)
+        {
+            /* keep [mid + 1, hi) for ourselves, run index mid now */
+            pthread_mutex_lock(&P->deques[id].lock);
+            P->deques[id].lo = mid + 1;
+            P->deques[id].hi = hi;
+            pthread_mutex_unlock(&P->deques[id].lock);
+            *i = mid;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+_thread_pool_work(slong id)
+{
+    thread_pool_struct * P = &_thread_pool;
+    slong i;
+
+    _thread_pool_in_task = 1;
+
+    while (_thread_pool_take(P->deques + id, &i) || _thread_pool_steal(id, &i))
+        P->fn(P->arg, i);
+
+    _thread_pool_in_task = 0;
+}
+
+static void *
+_thread_pool_worker(void * arg)
+{
+    thread_pool_struct * P = &_thread_pool;
+    thread_pool_worker_struct * W = arg;
+    slong id = W->id;
+    ulong seen = W->generation;
+
+    while (1)
+    {
+        pthread_mutex_lock(&P->lock);
+        while (P->generation == seen && !P->shutdown)
+            pthread_cond_wait(&P->start, &P->lock);
+        if (P->shutdown)
+        {
+            pthread_mutex_unlock(&P->lock);
+            return NULL;
+        }
+        seen = P->generation;
+        pthread_mutex_unlock(&P->lock);
+
+        _thread_pool_work(id);
+
+        pthread_mutex_lock(&P->lock);
+        if (--P->active == 0)
+            pthread_cond_signal(&P->done);
+        pthread_mutex_unlock(&P->lock);
+    }
+}
+
+static void
+_thread_pool_stop(void)
+{
+    thread_pool_struct * P = &_thread_pool;
+    slong i;
+
+    if (P->threads == NULL)
+        return;
+
+    pthread_mutex_lock(&P->lock);
+    P->shutdown = 1;
+    pthread_cond_broadcast(&P->start);
+    pthread_mutex_unlock(&P->lock);
+
+    for (i = 1; i < P->num_threads; i++)
+        pthread_join(P->threads[i], NULL);
+
+    for (i = 0; i < P->num_threads; i++)
+        pthread_mutex_destroy(&P->deques[i].lock);
+
+    flint_free(P->threads);
+    flint_free(P->deques);
+    flint_free(P->workers);
+    P->threads = NULL;
+    P->deques = NULL;
+    P->workers = NULL;
+    P->shutdown = 0;
+}
+
+static void
+_thread_pool_start(void)
+{
+    thread_pool_struct * P = &_thread_pool;
+    ulong generation;
+    slong i;
+
+    P->threads = flint_malloc(P->num_threads * sizeof(pthread_t));
+    P->deques = flint_malloc(P->num_threads * sizeof(thread_pool_deque_struct));
+    P->workers = flint_malloc(P->num_threads
+                              * sizeof(thread_pool_worker_struct));
+
+    for (i = 0; i < P->num_threads; i++)
+    {
+        pthread_mutex_init(&P->deques[i].lock, NULL);
+        P->deques[i].lo = P->deques[i].hi = 0;
+    }
+
+    /* workers created after earlier calls must not take them as new */
+    pthread_mutex_lock(&P->lock);
+    generation = P->generation;
+    pthread_mutex_unlock(&P->lock);
+
+    for (i = 1; i < P->num_threads; i++)
+    {
+        P->workers[i].id = i;
+        P->workers[i].generation = generation;
+        pthread_create(P->threads + i, NULL, _thread_pool_worker,
+                       P->workers + i);
+    }
+}
+
+/*
+    Sets the number of threads (including the caller) used by subsequent
+    parallel calls. Must not be called from inside a task.
+*/
+void
+thread_pool_set_num_threads(slong num_threads)
+{
+    thread_pool_struct * P = &_thread_pool;
+
+    if (num_threads < 1)
+        num_threads = 1;
+
+    pthread_mutex_lock(&P->busy);
+    if (num_threads != P->num_threads)
+    {
+        _thread_pool_stop();
+        P->num_threads = num_threads;
+    }
+    pthread_mutex_unlock(&P->busy);
+}
+
+slong
+thread_pool_get_num_threads(void)
+{
+    return _thread_pool.num_threads;
+}
+
+void
+thread_pool_parallel_for(slong n, void (*fn)(void * arg, slong i), void * arg)
+{
+    thread_pool_struct * P = &_thread_pool;
+    slong i, p;
+
+    if (n <= 0)
+        return;
+
+    if (n == 1 || P->num_threads == 1 || _thread_pool_in_task
+        || pthread_mutex_trylock(&P->busy) != 0)
+    {
+        for (i = 0; i < n; i++)
+            fn(arg, i);
+        return;
+    }
+
+    if (P->threads == NULL)
+        _thread_pool_start();
+
+    p = P->num_threads;
+    for (i = 0; i < p; i++)
+    {
+        P->deques[i].lo = (n * i) / p;
+        P->deques[i].hi = (n * (i + 1)) / p;
+    }
+
+    pthread_mutex_lock(&P->lock);
+    P->fn = fn;
+    P->arg = arg;
+    P->active = p - 1;
+    P->generation++;
+    pthread_cond_broadcast(&P->start);
+    pthread_mutex_unlock(&P->lock);
+
+    _thread_pool_work(0);
+
+    pthread_mutex_lock(&P->lock);
+    while (P->active != 0)
+        pthread_cond_wait(&P->done, &P->lock);
+    pthread_mutex_unlock(&P->lock);
+
+    pthread_mutex_unlock(&P->busy);
+}
+
+#endif